@@ -0,0 +1,247 @@
+#include "inc.h"
+
+// Micro-benchmarks of the image operations. Every case runs once to warm up the caches and the
+// image pool, then enough repetitions to get a stable median. The cycles are TSC ticks, they don't
+// follow the frequency scaling of the cores.
+
+#define BENCH_MIN_SIZE 256
+#define BENCH_MIN_REPETITIONS 3
+#define BENCH_MAX_REPETITIONS 30
+
+// Pixels processed by the repetitions of a case, small sizes run more of them
+#define BENCH_PIXEL_BUDGET (32ULL * 1024 * 1024)
+
+enum BenchOp {
+	BenchOp_Copy,
+	BenchOp_Mult,
+	BenchOp_Blend,
+	BenchOp_Threshold,
+	BenchOp_Kernel3x3,
+	BenchOp_Kernel5x5,
+	BenchOp_BoxBlur,
+	BenchOp_EdgeDetection,
+	BenchOp_Count,
+};
+
+// The bytes are the ones read and written by a single pass over the pixels, the GB/s of the
+// multipass operations is a lower bound
+struct BenchOpInfo {
+	const char* name;
+	u32 bytes_per_pixel;
+};
+
+static const BenchOpInfo bench_ops[BenchOp_Count] = {
+	{ "copy_rgba8_to_i8", 5 },
+	{ "mult", 2 },
+	{ "blend", 3 },
+	{ "threshold", 2 },
+	{ "kernel3x3", 2 },
+	{ "kernel5x5_2pass", 2 },
+	{ "box_blur_sigma8", 2 },
+	{ "edge_detection", 5 },
+};
+
+struct BenchResult {
+	BenchOp op;
+	u32 size;
+	u32 worker_count;
+	u32 repetitions;
+	f64 median_time;
+	f64 p95_time;
+	f64 cycles_per_pixel;
+};
+
+struct BenchInputs {
+	Image rgba;
+	Image gray0;
+	Image gray1;
+};
+
+internal_fn void bench_sort(f64* values, u32 count)
+{
+	for (u32 i = 1; i < count; ++i) {
+		f64 v = values[i];
+		u32 j = i;
+		for (; j > 0 && values[j - 1] > v; --j) values[j] = values[j - 1];
+		values[j] = v;
+	}
+}
+
+// Noise over a gradient, so the blur and the threshold see some edges
+internal_fn BenchInputs bench_inputs_make(u32 size)
+{
+	BenchInputs inputs;
+	inputs.rgba = image_alloc(size, size, ImageFormat_RGBA8);
+
+	u32 seed = 0x2545F491u;
+
+	for (u32 y = 0; y < size; ++y)
+	{
+		u32* row = (u32*)image_get_row(inputs.rgba, y);
+
+		for (u32 x = 0; x < size; ++x) {
+			seed = seed * 1664525u + 1013904223u;
+			u32 v = ((x ^ y) & 0xFF) + ((seed >> 24) & 0x3F);
+			v = MIN(v, 255);
+			row[x] = v | (((v + 64) & 0xFF) << 8) | ((255 - v) << 16) | 0xFF000000u;
+		}
+	}
+
+	inputs.gray0 = image_copy(inputs.rgba, ImageFormat_I8);
+	inputs.gray1 = image_apply_gaussian_blur(inputs.gray0, BlurDistance_3);
+	return inputs;
+}
+
+internal_fn void bench_inputs_free(BenchInputs inputs)
+{
+	image_free(inputs.rgba);
+	image_free(inputs.gray0);
+	image_free(inputs.gray1);
+}
+
+internal_fn void bench_run_op(BenchOp op, BenchInputs inputs)
+{
+	Image result = IMG_INVALID;
+
+	switch (op)
+	{
+	case BenchOp_Copy: result = image_copy(inputs.rgba, ImageFormat_I8); break;
+	case BenchOp_Mult: image_mult(inputs.gray0, 1.f); break; // Same values, the input doesn't drift
+	case BenchOp_Blend: result = image_blend(inputs.gray0, inputs.gray1, 0.3f); break;
+	case BenchOp_Threshold: result = image_apply_threshold(inputs.gray0, 0.5f); break;
+	case BenchOp_Kernel3x3: result = image_apply_gaussian_blur(inputs.gray0, BlurDistance_3); break;
+	case BenchOp_Kernel5x5: result = image_apply_gaussian_blur(inputs.gray0, BlurDistance_5); break;
+	case BenchOp_BoxBlur: result = image_apply_box_blur(inputs.gray0, 8.f); break;
+	case BenchOp_EdgeDetection: result = edge_detection(inputs.rgba); break;
+	default: assert(0); break;
+	}
+
+	image_free(result);
+}
+
+internal_fn BenchResult bench_run_case(BenchOp op, BenchInputs inputs, u32 size, u32 worker_count)
+{
+	u64 pixels = (u64)size * size;
+	u32 repetitions = (u32)MIN(MAX(BENCH_PIXEL_BUDGET / pixels, BENCH_MIN_REPETITIONS), BENCH_MAX_REPETITIONS);
+
+	f64 times[BENCH_MAX_REPETITIONS];
+	f64 cycles[BENCH_MAX_REPETITIONS];
+
+	bench_run_op(op, inputs);
+
+	for (u32 i = 0; i < repetitions; ++i)
+	{
+		f64 start_time = timer_now();
+		u64 start_cycles = __rdtsc();
+
+		bench_run_op(op, inputs);
+
+		cycles[i] = (f64)(__rdtsc() - start_cycles);
+		times[i] = timer_now() - start_time;
+	}
+
+	bench_sort(times, repetitions);
+	bench_sort(cycles, repetitions);
+
+	BenchResult result;
+	result.op = op;
+	result.size = size;
+	result.worker_count = worker_count;
+	result.repetitions = repetitions;
+	result.median_time = times[repetitions / 2];
+	result.p95_time = times[u32_divide_high(repetitions * 95, 100) - 1];
+	result.cycles_per_pixel = cycles[repetitions / 2] / (f64)pixels;
+	return result;
+}
+
+internal_fn f64 bench_get_mpix_per_second(BenchResult result) {
+	return ((f64)result.size * result.size / 1000000.0) / MAX(result.median_time, 1e-9);
+}
+
+internal_fn f64 bench_get_gb_per_second(BenchResult result) {
+	return ((f64)result.size * result.size * bench_ops[result.op].bytes_per_pixel / 1e9) / MAX(result.median_time, 1e-9);
+}
+
+internal_fn b32 bench_save(Array<BenchResult> results, String path)
+{
+	TextBuilder text = text_builder_make(1024 + (u64)results.count * 320);
+	DEFER(text_builder_free(&text));
+
+	text_builder_append(&text, "{\n\"simd_level\": \"%s\",\n\"logic_core_count\": %u,\n\"results\": [\n", simd_level_get_name((SimdLevel)app.os.simd_level), app.os.logic_core_count);
+
+	for (u32 i = 0; i < results.count; ++i)
+	{
+		BenchResult r = results[i];
+		text_builder_append(&text,
+			"{\"op\": \"%s\", \"width\": %u, \"height\": %u, \"workers\": %u, \"repetitions\": %u, \"median_ms\": %.4f, \"p95_ms\": %.4f, \"mpix_per_second\": %.2f, \"gb_per_second\": %.3f, \"cycles_per_pixel\": %.3f}%s\n",
+			bench_ops[r.op].name, r.size, r.size, r.worker_count, r.repetitions, r.median_time * 1000.0, r.p95_time * 1000.0,
+			bench_get_mpix_per_second(r), bench_get_gb_per_second(r), r.cycles_per_pixel, (i + 1 < results.count) ? "," : "");
+	}
+
+	text_builder_append(&text, "]\n}\n");
+
+	if (text.failed) {
+		assert(0);
+		return false;
+	}
+
+	FileMap file;
+	if (!os_file_map_write(path, text.size, &file)) return false;
+	memory_copy(file.data, text.data, text.size);
+	os_file_unmap(file);
+	return true;
+}
+
+b32 bench_run(u32 max_size, String path)
+{
+	max_size = MAX(max_size, BENCH_MIN_SIZE);
+
+	// Powers of two up to the core count, plus the core count itself
+	u32 worker_counts[32];
+	u32 worker_count_count = 0;
+	for (u32 w = 1; w < app.os.logic_core_count; w *= 2) worker_counts[worker_count_count++] = w;
+	worker_counts[worker_count_count++] = app.os.logic_core_count;
+
+	u32 size_count = 0;
+	for (u32 size = BENCH_MIN_SIZE; size <= max_size; size *= 2) size_count++;
+
+	Array<BenchResult> results = array_make((BenchResult*)arena_push(app.static_arena, sizeof(BenchResult) * worker_count_count * size_count * BenchOp_Count), 0);
+
+	app.sett.blur_distance = BlurDistance_5;
+	app.sett.blur_iterations = 1;
+	app.sett.threshold = 0.3f;
+
+	// The task system can't change its worker count, it starts again for each one
+	for (u32 w = 0; w < worker_count_count; ++w)
+	{
+		if (!task_initialize(worker_counts[w])) return false;
+
+		for (u32 size = BENCH_MIN_SIZE; size <= max_size; size *= 2)
+		{
+			BenchInputs inputs = bench_inputs_make(size);
+
+			for (u32 op = 0; op < BenchOp_Count; ++op)
+			{
+				BenchResult r = bench_run_case((BenchOp)op, inputs, size, worker_counts[w]);
+				results.data[results.count++] = r;
+
+				printf("%-18s %5ux%-5u %2u workers: median %s, p95 %s, %8.2f MPix/s, %6.2f GB/s, %6.2f cycles/pixel\n",
+					bench_ops[op].name, size, size, r.worker_count, string_format_time(r.median_time).data, string_format_time(r.p95_time).data,
+					bench_get_mpix_per_second(r), bench_get_gb_per_second(r), r.cycles_per_pixel);
+			}
+
+			bench_inputs_free(inputs);
+			arena_pop_to(temp_arena, 0);
+		}
+
+		task_shutdown();
+	}
+
+	if (!bench_save(results, path)) {
+		printf("Can't save the benchmark results %s\n", path.data);
+		return false;
+	}
+
+	printf("Benchmark results saved to %s\n", path.data);
+	return true;
+}
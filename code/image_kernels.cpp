@@ -0,0 +1,1878 @@
+#include "inc.h"
+
+// Row kernels for each SIMD level. Every level gives the same result as the scalar code, the
+// table is selected at startup from the CPU features.
+
+RowKernels row_kernels;
+
+// GCC needs the instruction set of each function, MSVC compiles the intrinsics of any level
+#if defined(__GNUC__)
+#define SIMD_TARGET_SSE41 _Pragma("GCC push_options") _Pragma("GCC target(\"sse4.1\")")
+#define SIMD_TARGET_AVX2 _Pragma("GCC push_options") _Pragma("GCC target(\"avx2\")")
+#define SIMD_TARGET_AVX512BW _Pragma("GCC push_options") _Pragma("GCC target(\"avx2,avx512f,avx512bw\")")
+#define SIMD_TARGET_END _Pragma("GCC pop_options")
+#else
+#define SIMD_TARGET_SSE41
+#define SIMD_TARGET_AVX2
+#define SIMD_TARGET_AVX512BW
+#define SIMD_TARGET_END
+#endif
+
+// Luma weights in 1.15 fixed point, they add up to 1 << 15. The alpha premultiply is a
+// multiplication by a * 257 / 2^24 ~ a / (255 * 256) over the luma in 8.8, every result is within
+// +-1 of the float formula (0.299r + 0.587g + 0.114b) * a / 255.
+#define GRAY_WEIGHT_R 9798
+#define GRAY_WEIGHT_G 19235
+#define GRAY_WEIGHT_B 3735
+#define GRAY_ROUND 128
+
+// Mult and blend run in fixed point with mulhrs, round(a * b / 2^15) in 16 bit lanes. Mult takes
+// the pixel in 8.7 and the factor in 8.8, blend is s0 + round((s1 - s0) * f) with the factor in
+// 0.15. Both are within +-1 of the f32 versions, factors out of range use the f32 versions.
+#define FIXED_MULT_MAX 127.f
+
+// Scale of the L1 magnitude, 46341 / 65536 ~= 1 / sqrt(2). Keeps the output range of the
+// previous blend(|Gx|, |Gy|, 0.5) * 1.41 version.
+#define SOBEL_L1_SCALE 46341
+
+//- Scalar
+
+inline_fn u8 gray_from_rgba(u8 r, u8 g, u8 b, u8 a)
+{
+	u32 luma = GRAY_WEIGHT_R * r + GRAY_WEIGHT_G * g + GRAY_WEIGHT_B * b + GRAY_ROUND;
+	return (u8)(((luma >> 7) * (a * 257u)) >> 24);
+}
+
+// Same rounding as the vector conversions, to nearest even
+inline_fn i32 f32_round_to_i32(f32 v) {
+	return _mm_cvtss_si32(_mm_set_ss(v));
+}
+
+inline_fn u8 sobel_magnitude(i32 gx, i32 gy, SobelMagnitude magnitude)
+{
+	i32 ax = ABS(gx);
+	i32 ay = ABS(gy);
+	i32 res;
+
+	if (magnitude == SobelMagnitude_L1) {
+		res = ((ax + ay) * SOBEL_L1_SCALE) >> 16;
+	}
+	else {
+		// Alpha max plus beta min with alpha = 1 and beta = 3/8, under 7% of error
+		i32 max = MAX(ax, ay);
+		i32 min = MIN(ax, ay);
+		res = max + ((min * 3) >> 3);
+	}
+
+	return (u8)MIN(res, 255);
+}
+
+// Epilogue of the blend and sobel kernels, see 'ROW_THRESHOLD_NONE'
+inline_fn u8 threshold_apply(u8 v, u32 threshold) {
+	if (threshold == ROW_THRESHOLD_NONE) return v;
+	return (v > threshold) * 255;
+}
+
+// Returns the shift equivalent to the normalize factor, or -1 if it's not a power of two
+internal_fn i32 normalize_factor_get_shift(u32 normalize_factor)
+{
+	if (normalize_factor == 0 || (normalize_factor & (normalize_factor - 1)) != 0) return -1;
+
+	i32 shift = 0;
+	while ((1u << shift) != normalize_factor) shift++;
+	return shift;
+}
+
+// The sum of a kernel over u8 pixels fits in i16 lanes
+internal_fn b32 kernel_fits_i16(const i32* coefficients, u32 count)
+{
+	i32 positive = 0;
+	i32 negative = 0;
+	for (u32 i = 0; i < count; ++i) {
+		if (coefficients[i] > 0) positive += coefficients[i];
+		else negative -= coefficients[i];
+	}
+	return positive * 255 <= INT16_MAX && negative * 255 <= INT16_MAX;
+}
+
+// Kernels up to 9 taps that fit in i16 run with 16 bit lanes
+#define KERNEL_MAX_I16_TAPS 9
+
+// Every coefficient fits in i16, then the sum of the taps fits in i32
+internal_fn b32 kernel_fits_i32(const i32* coefficients, u32 count)
+{
+	if (count > ROW_KERNEL_MAX_TAPS) return false;
+
+	for (u32 i = 0; i < count; ++i) {
+		if (coefficients[i] < INT16_MIN || coefficients[i] > INT16_MAX) return false;
+	}
+	return true;
+}
+
+// Taps of the 32 bit kernels in pairs, for the multiply-add of 16 bit lanes. The coefficients of a
+// pair are (c0 & 0xFFFF) | (c1 << 16), an odd last tap is paired with a zero coefficient.
+#define KERNEL_MAX_TAP_PAIRS ((ROW_KERNEL_MAX_TAPS + 1) / 2)
+
+struct KernelTapPairs {
+	const u8* sources[KERNEL_MAX_TAP_PAIRS][2];
+	i32 coefficients[KERNEL_MAX_TAP_PAIRS];
+	u32 count;
+};
+
+internal_fn KernelTapPairs kernel_tap_pairs_make(const u8* const* sources, const i32* coefficients, u32 tap_count)
+{
+	KernelTapPairs pairs;
+	pairs.count = 0;
+
+	for (u32 t = 0; t < tap_count; t += 2)
+	{
+		b32 single = t + 1 == tap_count;
+		i32 c1 = single ? 0 : coefficients[t + 1];
+
+		pairs.sources[pairs.count][0] = sources[t];
+		pairs.sources[pairs.count][1] = single ? sources[t] : sources[t + 1];
+		pairs.coefficients[pairs.count] = (i32)(((u32)coefficients[t] & 0xFFFF) | ((u32)c1 << 16));
+		pairs.count++;
+	}
+
+	return pairs;
+}
+
+// The common sizes, 3 to 15 taps, run with the loop over the pairs unrolled. Other sizes run the
+// version with 0 pairs, that loops over 'pairs->count'.
+#define KERNEL_TAP_PAIRS_DISPATCH(_result, _fn, _pair_count, ...) \
+	switch (_pair_count) { \
+	case 2: _result = _fn<2>(__VA_ARGS__); break; \
+	case 3: _result = _fn<3>(__VA_ARGS__); break; \
+	case 4: _result = _fn<4>(__VA_ARGS__); break; \
+	case 5: _result = _fn<5>(__VA_ARGS__); break; \
+	case 6: _result = _fn<6>(__VA_ARGS__); break; \
+	case 7: _result = _fn<7>(__VA_ARGS__); break; \
+	case 8: _result = _fn<8>(__VA_ARGS__); break; \
+	default: _result = _fn<0>(__VA_ARGS__); break; \
+	}
+
+// The vector kernels finish the rows with the scalar ones, from 'x'
+internal_fn void scalar_row_gray_from_rgba8_from(u8* dst, const u8* src, u32 x, u32 count)
+{
+	for (; x < count; ++x) {
+		const u8* p = src + x * 4;
+		dst[x] = gray_from_rgba(p[0], p[1], p[2], p[3]);
+	}
+}
+
+internal_fn void scalar_row_gray_from_rgb8_from(u8* dst, const u8* src, u32 x, u32 count)
+{
+	for (; x < count; ++x) {
+		const u8* p = src + x * 3;
+		dst[x] = gray_from_rgba(p[0], p[1], p[2], 255);
+	}
+}
+
+internal_fn void scalar_row_kernel_from(u8* dst, const u8* const* sources, const i32* coefficients, u32 tap_count, u32 x, u32 count, u32 normalize_factor)
+{
+	for (; x < count; ++x)
+	{
+		i32 res = 0;
+		for (u32 t = 0; t < tap_count; ++t) res += (i32)sources[t][x] * coefficients[t];
+
+		res /= (i32)normalize_factor;
+		dst[x] = (u8)MIN(ABS(res), 255);
+	}
+}
+
+internal_fn void scalar_row_sobel_magnitude_from(u8* dst, const u8* top, const u8* mid, const u8* bot, u32 x, u32 count, SobelMagnitude magnitude, u32 threshold)
+{
+	for (; x < count; ++x)
+	{
+		const u8* t = top + x;
+		const u8* c = mid + x;
+		const u8* b = bot + x;
+
+		i32 gx = ((i32)t[1] + 2 * (i32)c[1] + (i32)b[1]) - ((i32)t[-1] + 2 * (i32)c[-1] + (i32)b[-1]);
+		i32 gy = ((i32)b[-1] + 2 * (i32)b[0] + (i32)b[1]) - ((i32)t[-1] + 2 * (i32)t[0] + (i32)t[1]);
+
+		dst[x] = threshold_apply(sobel_magnitude(gx, gy, magnitude), threshold);
+	}
+}
+
+internal_fn void scalar_row_box_sum_from(u8* dst, i32* sums, const u8* add, const u8* sub, u32 x, u32 count, f32 scale)
+{
+	for (; x < count; ++x) {
+		sums[x] += (i32)add[x] - (i32)sub[x];
+		dst[x] = (u8)f32_round_to_i32((f32)sums[x] * scale);
+	}
+}
+
+internal_fn void scalar_row_gray_from_rgba8(u8* dst, const u8* src, u32 count) {
+	scalar_row_gray_from_rgba8_from(dst, src, 0, count);
+}
+
+internal_fn void scalar_row_gray_from_rgb8(u8* dst, const u8* src, u32 count) {
+	scalar_row_gray_from_rgb8_from(dst, src, 0, count);
+}
+
+internal_fn void scalar_row_mult_f32(u8* dst, const u8* src, u32 count, f32 mult)
+{
+	for (u32 i = 0; i < count; ++i) {
+		f32 v = MIN(MAX((f32)src[i] * mult, 0.f), 255.f);
+		dst[i] = (u8)f32_round_to_i32(v);
+	}
+}
+
+internal_fn void scalar_row_blend_f32(u8* dst, const u8* src0, const u8* src1, u32 count, f32 factor, u32 threshold)
+{
+	f32 factor0 = 1.f - factor;
+	f32 factor1 = factor;
+
+	for (u32 i = 0; i < count; ++i) {
+		i32 v = f32_round_to_i32((f32)src0[i] * factor0 + (f32)src1[i] * factor1);
+		dst[i] = threshold_apply((u8)MIN(MAX(v, 0), 255), threshold);
+	}
+}
+
+inline_fn b32 mult_fits_fixed(f32 mult) {
+	return mult > -FIXED_MULT_MAX && mult < FIXED_MULT_MAX;
+}
+
+inline_fn b32 blend_fits_fixed(f32 factor) {
+	return factor >= 0.f && factor <= 1.f;
+}
+
+inline_fn i16 mult_get_fixed(f32 mult) {
+	return (i16)f32_round_to_i32(mult * 256.f);
+}
+
+inline_fn i16 blend_get_fixed(f32 factor) {
+	return (i16)MIN(f32_round_to_i32(factor * 32768.f), INT16_MAX);
+}
+
+inline_fn i32 mulhrs(i32 a, i32 b) {
+	return (a * b + 0x4000) >> 15;
+}
+
+internal_fn void scalar_row_mult_fixed_from(u8* dst, const u8* src, u32 x, u32 count, i16 mult)
+{
+	for (; x < count; ++x) {
+		i32 v = mulhrs((i32)src[x] << 7, mult);
+		dst[x] = (u8)MIN(MAX(v, 0), 255);
+	}
+}
+
+internal_fn void scalar_row_blend_fixed_from(u8* dst, const u8* src0, const u8* src1, u32 x, u32 count, i16 factor, u32 threshold)
+{
+	for (; x < count; ++x) {
+		u8 v = (u8)(src0[x] + mulhrs((i32)src1[x] - (i32)src0[x], factor));
+		dst[x] = threshold_apply(v, threshold);
+	}
+}
+
+internal_fn void scalar_row_mult(u8* dst, const u8* src, u32 count, f32 mult)
+{
+	if (!mult_fits_fixed(mult)) {
+		scalar_row_mult_f32(dst, src, count, mult);
+		return;
+	}
+	scalar_row_mult_fixed_from(dst, src, 0, count, mult_get_fixed(mult));
+}
+
+internal_fn void scalar_row_blend(u8* dst, const u8* src0, const u8* src1, u32 count, f32 factor, u32 threshold)
+{
+	if (!blend_fits_fixed(factor)) {
+		scalar_row_blend_f32(dst, src0, src1, count, factor, threshold);
+		return;
+	}
+	scalar_row_blend_fixed_from(dst, src0, src1, 0, count, blend_get_fixed(factor), threshold);
+}
+
+internal_fn void scalar_row_threshold(u8* dst, const u8* src, u32 count, u8 threshold)
+{
+	for (u32 i = 0; i < count; ++i) {
+		dst[i] = (src[i] > threshold) * 255;
+	}
+}
+
+internal_fn void scalar_row_kernel(u8* dst, const u8* const* sources, const i32* coefficients, u32 tap_count, u32 count, u32 normalize_factor) {
+	scalar_row_kernel_from(dst, sources, coefficients, tap_count, 0, count, normalize_factor);
+}
+
+internal_fn void scalar_row_box_sum(u8* dst, i32* sums, const u8* add, const u8* sub, u32 count, f32 scale) {
+	scalar_row_box_sum_from(dst, sums, add, sub, 0, count, scale);
+}
+
+// The box along a row is a difference of prefix sums over the row extended with 'radius' copies
+// of the first and last pixels, prefix[k] is the sum of the first k extended pixels. The vector
+// kernels compute the sums of the row itself and the differences, the ends are always scalar.
+internal_fn void box_prefix_begin(i32* prefix, const u8* src, u32 radius)
+{
+	for (u32 k = 0; k <= radius; ++k) prefix[k] = (i32)(k * src[0]);
+}
+
+internal_fn void box_prefix_end(i32* prefix, const u8* src, u32 count, u32 radius)
+{
+	i32* p = prefix + radius + count;
+	for (u32 k = 1; k <= radius; ++k) p[k] = p[0] + (i32)(k * src[count - 1]);
+}
+
+// 'prefix' starts at the sum before the pixel 0
+internal_fn void scalar_box_prefix_from(i32* prefix, const u8* src, u32 x, u32 count)
+{
+	for (; x < count; ++x) prefix[x + 1] = prefix[x] + src[x];
+}
+
+internal_fn void scalar_box_difference_from(u8* dst, const i32* prefix, u32 x, u32 count, u32 radius, f32 scale)
+{
+	for (; x < count; ++x) dst[x] = (u8)f32_round_to_i32((f32)(prefix[x + radius * 2 + 1] - prefix[x]) * scale);
+}
+
+internal_fn void scalar_row_box_blur(u8* dst, const u8* src, i32* prefix, u32 count, u32 radius, f32 scale)
+{
+	box_prefix_begin(prefix, src, radius);
+	scalar_box_prefix_from(prefix + radius, src, 0, count);
+	box_prefix_end(prefix, src, count, radius);
+	scalar_box_difference_from(dst, prefix, 0, count, radius, scale);
+}
+
+internal_fn void scalar_row_sobel_magnitude(u8* dst, const u8* top, const u8* mid, const u8* bot, u32 count, SobelMagnitude magnitude, u32 threshold) {
+	scalar_row_sobel_magnitude_from(dst, top, mid, bot, 0, count, magnitude, threshold);
+}
+
+//- SSE4.1
+
+SIMD_TARGET_SSE41
+
+inline_fn void sse128_f32_from_u8(__m128* result, __m128i bytes)
+{
+	__m128i u16_0 = _mm_cvtepu8_epi16(bytes);
+	__m128i u16_1 = _mm_cvtepu8_epi16(_mm_srli_si128(bytes, 8));
+
+	result[0] = _mm_cvtepi32_ps(_mm_cvtepu16_epi32(u16_0));
+	result[1] = _mm_cvtepi32_ps(_mm_cvtepu16_epi32(_mm_srli_si128(u16_0, 8)));
+	result[2] = _mm_cvtepi32_ps(_mm_cvtepu16_epi32(u16_1));
+	result[3] = _mm_cvtepi32_ps(_mm_cvtepu16_epi32(_mm_srli_si128(u16_1, 8)));
+}
+
+inline_fn __m128i sse128_u8_from_f32(__m128* floats)
+{
+	__m128i u16_0 = _mm_packus_epi32(_mm_cvtps_epi32(floats[0]), _mm_cvtps_epi32(floats[1]));
+	__m128i u16_1 = _mm_packus_epi32(_mm_cvtps_epi32(floats[2]), _mm_cvtps_epi32(floats[3]));
+	return _mm_packus_epi16(u16_0, u16_1);
+}
+
+inline_fn void sse128_i16_from_u8(__m128i* result, __m128i bytes)
+{
+	result[0] = _mm_cvtepu8_epi16(bytes);
+	result[1] = _mm_cvtepu8_epi16(_mm_srli_si128(bytes, 8));
+}
+
+// 4 RGBA pixels to 4 gray values in 32 bit lanes
+inline_fn __m128i sse128_gray_from_rgba8(__m128i pixels)
+{
+	__m128i v_zero = _mm_setzero_si128();
+	__m128i v_weights = _mm_setr_epi16(GRAY_WEIGHT_R, GRAY_WEIGHT_G, GRAY_WEIGHT_B, 0, GRAY_WEIGHT_R, GRAY_WEIGHT_G, GRAY_WEIGHT_B, 0);
+
+	__m128i lo = _mm_madd_epi16(_mm_unpacklo_epi8(pixels, v_zero), v_weights);
+	__m128i hi = _mm_madd_epi16(_mm_unpackhi_epi8(pixels, v_zero), v_weights);
+	__m128i luma = _mm_add_epi32(_mm_hadd_epi32(lo, hi), _mm_set1_epi32(GRAY_ROUND));
+
+	__m128i alpha = _mm_srli_epi32(pixels, 24);
+	alpha = _mm_add_epi32(_mm_slli_epi32(alpha, 8), alpha);
+
+	return _mm_srli_epi32(_mm_mullo_epi32(_mm_srli_epi32(luma, 7), alpha), 24);
+}
+
+inline_fn __m128i sse128_u8_from_i32(__m128i v0, __m128i v1, __m128i v2, __m128i v3) {
+	return _mm_packus_epi16(_mm_packus_epi32(v0, v1), _mm_packus_epi32(v2, v3));
+}
+
+inline_fn void sse128_i32_from_u8(__m128i* result, __m128i bytes)
+{
+	result[0] = _mm_cvtepu8_epi32(bytes);
+	result[1] = _mm_cvtepu8_epi32(_mm_srli_si128(bytes, 4));
+	result[2] = _mm_cvtepu8_epi32(_mm_srli_si128(bytes, 8));
+	result[3] = _mm_cvtepu8_epi32(_mm_srli_si128(bytes, 12));
+}
+
+// 4 RGB pixels expanded to opaque RGBA, loads 16 bytes for 12
+inline_fn __m128i sse128_rgba8_from_rgb8(const u8* src)
+{
+	__m128i v_shuffle = _mm_setr_epi8(0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11, -1);
+	__m128i pixels = _mm_shuffle_epi8(_mm_loadu_si128((__m128i*)src), v_shuffle);
+	return _mm_or_si128(pixels, _mm_set1_epi32((i32)0xFF000000));
+}
+
+internal_fn void sse128_row_gray_from_rgba8(u8* dst, const u8* src, u32 count)
+{
+	u32 i = 0;
+	for (; i + 16 <= count; i += 16)
+	{
+		const u8* p = src + i * 4;
+		__m128i v0 = sse128_gray_from_rgba8(_mm_loadu_si128((__m128i*)(p + 0)));
+		__m128i v1 = sse128_gray_from_rgba8(_mm_loadu_si128((__m128i*)(p + 16)));
+		__m128i v2 = sse128_gray_from_rgba8(_mm_loadu_si128((__m128i*)(p + 32)));
+		__m128i v3 = sse128_gray_from_rgba8(_mm_loadu_si128((__m128i*)(p + 48)));
+		_mm_storeu_si128((__m128i*)(dst + i), sse128_u8_from_i32(v0, v1, v2, v3));
+	}
+
+	scalar_row_gray_from_rgba8_from(dst, src, i, count);
+}
+
+internal_fn void sse128_row_gray_from_rgb8(u8* dst, const u8* src, u32 count)
+{
+	// The last load of a block reads 4 bytes past it, the block is only taken with 2 more pixels
+	u32 i = 0;
+	for (; i + 18 <= count; i += 16)
+	{
+		const u8* p = src + i * 3;
+		__m128i v0 = sse128_gray_from_rgba8(sse128_rgba8_from_rgb8(p + 0));
+		__m128i v1 = sse128_gray_from_rgba8(sse128_rgba8_from_rgb8(p + 12));
+		__m128i v2 = sse128_gray_from_rgba8(sse128_rgba8_from_rgb8(p + 24));
+		__m128i v3 = sse128_gray_from_rgba8(sse128_rgba8_from_rgb8(p + 36));
+		_mm_storeu_si128((__m128i*)(dst + i), sse128_u8_from_i32(v0, v1, v2, v3));
+	}
+
+	scalar_row_gray_from_rgb8_from(dst, src, i, count);
+}
+
+// There is no unsigned byte compare, with both sides biased by 0x80 the signed compare gives the
+// same order
+inline_fn __m128i sse128_threshold_get_bias(u32 threshold) {
+	return _mm_set1_epi8((char)(threshold ^ 0x80));
+}
+
+// 0xFF where the byte is above the threshold, 'v_threshold' comes from 'sse128_threshold_get_bias'
+inline_fn __m128i sse128_threshold_u8(__m128i bytes, __m128i v_threshold) {
+	return _mm_cmpgt_epi8(_mm_xor_si128(bytes, _mm_set1_epi8((char)0x80)), v_threshold);
+}
+
+internal_fn void sse128_row_threshold(u8* dst, const u8* src, u32 count, u8 threshold)
+{
+	__m128i v_threshold = sse128_threshold_get_bias(threshold);
+
+	u32 i = 0;
+	for (; i + 16 <= count; i += 16) {
+		__m128i bytes = _mm_loadu_si128((__m128i*)(src + i));
+		_mm_storeu_si128((__m128i*)(dst + i), sse128_threshold_u8(bytes, v_threshold));
+	}
+
+	scalar_row_threshold(dst + i, src + i, count - i, threshold);
+}
+
+inline_fn __m128i sse128_mult_u8(__m128i bytes, __m128 v_mult)
+{
+	__m128 v_255 = _mm_set1_ps(255.0f);
+	__m128 v_zero = _mm_set1_ps(0.0f);
+
+	__m128 f[4];
+	sse128_f32_from_u8(f, bytes);
+
+	for (u32 i = 0; i < 4; ++i) {
+		f[i] = _mm_mul_ps(f[i], v_mult);
+		f[i] = _mm_min_ps(_mm_max_ps(f[i], v_zero), v_255);
+	}
+
+	return sse128_u8_from_f32(f);
+}
+
+internal_fn void sse128_row_mult_f32(u8* dst, const u8* src, u32 count, f32 mult)
+{
+	__m128 v_mult = _mm_set1_ps(mult);
+
+	u32 i = 0;
+	for (; i + 16 <= count; i += 16)
+	{
+		__m128i bytes = _mm_loadu_si128((__m128i*)(src + i));
+		_mm_storeu_si128((__m128i*)(dst + i), sse128_mult_u8(bytes, v_mult));
+	}
+
+	scalar_row_mult_f32(dst + i, src + i, count - i, mult);
+}
+
+inline_fn __m128i sse128_blend_u8(__m128i bytes0, __m128i bytes1, __m128 v_factor0, __m128 v_factor1)
+{
+	__m128 f0[4];
+	sse128_f32_from_u8(f0, bytes0);
+
+	__m128 f1[4];
+	sse128_f32_from_u8(f1, bytes1);
+
+	__m128 f[4];
+	for (u32 i = 0; i < 4; ++i) {
+		f[i] = _mm_add_ps(_mm_mul_ps(f0[i], v_factor0), _mm_mul_ps(f1[i], v_factor1));
+	}
+
+	return sse128_u8_from_f32(f);
+}
+
+internal_fn void sse128_row_blend_f32(u8* dst, const u8* src0, const u8* src1, u32 count, f32 factor, u32 threshold)
+{
+	__m128 v_factor0 = _mm_set1_ps(1.f - factor);
+	__m128 v_factor1 = _mm_set1_ps(factor);
+	__m128i v_threshold = sse128_threshold_get_bias(threshold);
+
+	u32 i = 0;
+	for (; i + 16 <= count; i += 16)
+	{
+		__m128i bytes0 = _mm_loadu_si128((__m128i*)(src0 + i));
+		__m128i bytes1 = _mm_loadu_si128((__m128i*)(src1 + i));
+		__m128i res = sse128_blend_u8(bytes0, bytes1, v_factor0, v_factor1);
+		if (threshold != ROW_THRESHOLD_NONE) res = sse128_threshold_u8(res, v_threshold);
+		_mm_storeu_si128((__m128i*)(dst + i), res);
+	}
+
+	scalar_row_blend_f32(dst + i, src0 + i, src1 + i, count - i, factor, threshold);
+}
+
+internal_fn void sse128_row_mult(u8* dst, const u8* src, u32 count, f32 mult)
+{
+	if (!mult_fits_fixed(mult)) {
+		sse128_row_mult_f32(dst, src, count, mult);
+		return;
+	}
+
+	i16 mult_fixed = mult_get_fixed(mult);
+	__m128i v_mult = _mm_set1_epi16(mult_fixed);
+	__m128i v_zero = _mm_setzero_si128();
+
+	u32 i = 0;
+	for (; i + 16 <= count; i += 16)
+	{
+		__m128i bytes = _mm_loadu_si128((__m128i*)(src + i));
+		__m128i lo = _mm_mulhrs_epi16(_mm_slli_epi16(_mm_unpacklo_epi8(bytes, v_zero), 7), v_mult);
+		__m128i hi = _mm_mulhrs_epi16(_mm_slli_epi16(_mm_unpackhi_epi8(bytes, v_zero), 7), v_mult);
+		_mm_storeu_si128((__m128i*)(dst + i), _mm_packus_epi16(lo, hi));
+	}
+
+	scalar_row_mult_fixed_from(dst, src, i, count, mult_fixed);
+}
+
+// A factor of 0.5 is the rounded average, the same result as the fixed point path
+internal_fn void sse128_row_blend(u8* dst, const u8* src0, const u8* src1, u32 count, f32 factor, u32 threshold)
+{
+	if (!blend_fits_fixed(factor)) {
+		sse128_row_blend_f32(dst, src0, src1, count, factor, threshold);
+		return;
+	}
+
+	i16 factor_fixed = blend_get_fixed(factor);
+	__m128i v_factor = _mm_set1_epi16(factor_fixed);
+	__m128i v_zero = _mm_setzero_si128();
+	__m128i v_threshold = sse128_threshold_get_bias(threshold);
+
+	u32 i = 0;
+	for (; i + 16 <= count; i += 16)
+	{
+		__m128i bytes0 = _mm_loadu_si128((__m128i*)(src0 + i));
+		__m128i bytes1 = _mm_loadu_si128((__m128i*)(src1 + i));
+
+		__m128i res;
+
+		if (factor == 0.5f) {
+			res = _mm_avg_epu8(bytes0, bytes1);
+		}
+		else {
+			__m128i lo0 = _mm_unpacklo_epi8(bytes0, v_zero);
+			__m128i hi0 = _mm_unpackhi_epi8(bytes0, v_zero);
+			__m128i lo = _mm_add_epi16(lo0, _mm_mulhrs_epi16(_mm_sub_epi16(_mm_unpacklo_epi8(bytes1, v_zero), lo0), v_factor));
+			__m128i hi = _mm_add_epi16(hi0, _mm_mulhrs_epi16(_mm_sub_epi16(_mm_unpackhi_epi8(bytes1, v_zero), hi0), v_factor));
+			res = _mm_packus_epi16(lo, hi);
+		}
+
+		if (threshold != ROW_THRESHOLD_NONE) res = sse128_threshold_u8(res, v_threshold);
+		_mm_storeu_si128((__m128i*)(dst + i), res);
+	}
+
+	scalar_row_blend_fixed_from(dst, src0, src1, i, count, factor_fixed, threshold);
+}
+
+// 16 pixels per iteration with 32 bit lanes, returns the first pixel left for the scalar tail
+template <u32 PairCount>
+internal_fn u32 sse128_row_kernel_i32(u8* dst, const KernelTapPairs* pairs, u32 count, i32 shift)
+{
+	u32 pair_count = PairCount ? PairCount : pairs->count;
+
+	// Copied out of 'pairs', the stores to 'dst' could alias them
+	const u8* sources[KERNEL_MAX_TAP_PAIRS][2];
+	__m128i v_coefficients[KERNEL_MAX_TAP_PAIRS];
+
+	for (u32 p = 0; p < pair_count; ++p) {
+		sources[p][0] = pairs->sources[p][0];
+		sources[p][1] = pairs->sources[p][1];
+		v_coefficients[p] = _mm_set1_epi32(pairs->coefficients[p]);
+	}
+
+	__m128i v_shift = _mm_cvtsi32_si128(shift);
+
+	u32 x = 0;
+	for (; x + 16 <= count; x += 16)
+	{
+		__m128i sum[4] = { _mm_setzero_si128(), _mm_setzero_si128(), _mm_setzero_si128(), _mm_setzero_si128() };
+
+		for (u32 p = 0; p < pair_count; ++p)
+		{
+			__m128i words0[2], words1[2];
+			sse128_i16_from_u8(words0, _mm_loadu_si128((__m128i*)(sources[p][0] + x)));
+			sse128_i16_from_u8(words1, _mm_loadu_si128((__m128i*)(sources[p][1] + x)));
+
+			for (u32 i = 0; i < 2; ++i) {
+				sum[i * 2 + 0] = _mm_add_epi32(sum[i * 2 + 0], _mm_madd_epi16(_mm_unpacklo_epi16(words0[i], words1[i]), v_coefficients[p]));
+				sum[i * 2 + 1] = _mm_add_epi32(sum[i * 2 + 1], _mm_madd_epi16(_mm_unpackhi_epi16(words0[i], words1[i]), v_coefficients[p]));
+			}
+		}
+
+		// Signed saturation, the unsigned one would wrap values over 32767 in the byte pack
+		__m128i words[2];
+		for (u32 i = 0; i < 2; ++i) {
+			words[i] = _mm_packs_epi32(_mm_srl_epi32(_mm_abs_epi32(sum[i * 2 + 0]), v_shift), _mm_srl_epi32(_mm_abs_epi32(sum[i * 2 + 1]), v_shift));
+		}
+
+		_mm_storeu_si128((__m128i*)(dst + x), _mm_packus_epi16(words[0], words[1]));
+	}
+
+	return x;
+}
+
+// 16 pixels per iteration with 16 bit lanes, or with 32 bit lanes for the kernels that overflow
+// them. With a power of two normalize factor |sum / n| == |sum| >> shift, so the result is the same
+// as the scalar kernel.
+internal_fn void sse128_row_kernel(u8* dst, const u8* const* sources, const i32* coefficients, u32 tap_count, u32 count, u32 normalize_factor)
+{
+	u32 x = 0;
+	i32 shift = normalize_factor_get_shift(normalize_factor);
+
+	if (shift >= 0 && tap_count <= KERNEL_MAX_I16_TAPS && kernel_fits_i16(coefficients, tap_count))
+	{
+		// Skip zero taps, half of the sobel kernel
+		const u8* tap_sources[9];
+		__m128i tap_coefficients[9];
+		u32 taps = 0;
+
+		assert(tap_count <= 9);
+
+		for (u32 i = 0; i < tap_count; ++i) {
+			if (coefficients[i] == 0) continue;
+			tap_sources[taps] = sources[i];
+			tap_coefficients[taps] = _mm_set1_epi16((i16)coefficients[i]);
+			taps++;
+		}
+
+		__m128i v_shift = _mm_cvtsi32_si128(shift);
+
+		for (; x + 16 <= count; x += 16)
+		{
+			__m128i sum[2] = { _mm_setzero_si128(), _mm_setzero_si128() };
+
+			for (u32 t = 0; t < taps; ++t)
+			{
+				__m128i words[2];
+				sse128_i16_from_u8(words, _mm_loadu_si128((__m128i*)(tap_sources[t] + x)));
+
+				sum[0] = _mm_add_epi16(sum[0], _mm_mullo_epi16(words[0], tap_coefficients[t]));
+				sum[1] = _mm_add_epi16(sum[1], _mm_mullo_epi16(words[1], tap_coefficients[t]));
+			}
+
+			sum[0] = _mm_srl_epi16(_mm_abs_epi16(sum[0]), v_shift);
+			sum[1] = _mm_srl_epi16(_mm_abs_epi16(sum[1]), v_shift);
+
+			_mm_storeu_si128((__m128i*)(dst + x), _mm_packus_epi16(sum[0], sum[1]));
+		}
+	}
+	else if (shift >= 0 && kernel_fits_i32(coefficients, tap_count))
+	{
+		KernelTapPairs pairs = kernel_tap_pairs_make(sources, coefficients, tap_count);
+		KERNEL_TAP_PAIRS_DISPATCH(x, sse128_row_kernel_i32, pairs.count, dst, &pairs, count, shift);
+	}
+
+	scalar_row_kernel_from(dst, sources, coefficients, tap_count, x, count, normalize_factor);
+}
+
+internal_fn void sse128_row_box_sum(u8* dst, i32* sums, const u8* add, const u8* sub, u32 count, f32 scale)
+{
+	__m128 v_scale = _mm_set1_ps(scale);
+
+	u32 i = 0;
+	for (; i + 16 <= count; i += 16)
+	{
+		__m128i a[4], s[4];
+		sse128_i32_from_u8(a, _mm_loadu_si128((__m128i*)(add + i)));
+		sse128_i32_from_u8(s, _mm_loadu_si128((__m128i*)(sub + i)));
+
+		__m128 f[4];
+		for (u32 j = 0; j < 4; ++j) {
+			__m128i* p = (__m128i*)(sums + i + j * 4);
+			__m128i sum = _mm_add_epi32(_mm_loadu_si128(p), _mm_sub_epi32(a[j], s[j]));
+			_mm_storeu_si128(p, sum);
+			f[j] = _mm_mul_ps(_mm_cvtepi32_ps(sum), v_scale);
+		}
+
+		_mm_storeu_si128((__m128i*)(dst + i), sse128_u8_from_f32(f));
+	}
+
+	scalar_row_box_sum_from(dst, sums, add, sub, i, count, scale);
+}
+
+// Inclusive scan of each vector, plus the last sum of the previous one
+inline_fn __m128i sse128_prefix_i32(__m128i v, __m128i carry)
+{
+	v = _mm_add_epi32(v, _mm_slli_si128(v, 4));
+	v = _mm_add_epi32(v, _mm_slli_si128(v, 8));
+	return _mm_add_epi32(v, carry);
+}
+
+internal_fn void sse128_row_box_blur(u8* dst, const u8* src, i32* prefix, u32 count, u32 radius, f32 scale)
+{
+	box_prefix_begin(prefix, src, radius);
+
+	i32* p = prefix + radius;
+	__m128i carry = _mm_set1_epi32(p[0]);
+
+	u32 i = 0;
+	for (; i + 16 <= count; i += 16)
+	{
+		__m128i v[4];
+		sse128_i32_from_u8(v, _mm_loadu_si128((__m128i*)(src + i)));
+
+		for (u32 j = 0; j < 4; ++j) {
+			v[j] = sse128_prefix_i32(v[j], carry);
+			carry = _mm_shuffle_epi32(v[j], _MM_SHUFFLE(3, 3, 3, 3));
+			_mm_storeu_si128((__m128i*)(p + i + j * 4 + 1), v[j]);
+		}
+	}
+
+	scalar_box_prefix_from(p, src, i, count);
+	box_prefix_end(prefix, src, count, radius);
+
+	__m128 v_scale = _mm_set1_ps(scale);
+	u32 width = radius * 2 + 1;
+
+	i = 0;
+	for (; i + 16 <= count; i += 16)
+	{
+		__m128 f[4];
+		for (u32 j = 0; j < 4; ++j) {
+			__m128i head = _mm_loadu_si128((__m128i*)(prefix + i + j * 4 + width));
+			__m128i tail = _mm_loadu_si128((__m128i*)(prefix + i + j * 4));
+			f[j] = _mm_mul_ps(_mm_cvtepi32_ps(_mm_sub_epi32(head, tail)), v_scale);
+		}
+
+		_mm_storeu_si128((__m128i*)(dst + i), sse128_u8_from_f32(f));
+	}
+
+	scalar_box_difference_from(dst, prefix, i, count, radius, scale);
+}
+
+// |Gx| + |Gy| <= 2040 so the magnitude is computed exactly in 16 bit lanes
+internal_fn void sse128_row_sobel_magnitude(u8* dst, const u8* top, const u8* mid, const u8* bot, u32 count, SobelMagnitude magnitude, u32 threshold)
+{
+	__m128i v_scale = _mm_set1_epi16((i16)SOBEL_L1_SCALE);
+	__m128i v_threshold = sse128_threshold_get_bias(threshold);
+
+	u32 x = 0;
+	for (; x + 16 <= count; x += 16)
+	{
+		__m128i lt[2], ct[2], rt[2], lc[2], rc[2], lb[2], cb[2], rb[2];
+		sse128_i16_from_u8(lt, _mm_loadu_si128((__m128i*)(top + x - 1)));
+		sse128_i16_from_u8(ct, _mm_loadu_si128((__m128i*)(top + x)));
+		sse128_i16_from_u8(rt, _mm_loadu_si128((__m128i*)(top + x + 1)));
+		sse128_i16_from_u8(lc, _mm_loadu_si128((__m128i*)(mid + x - 1)));
+		sse128_i16_from_u8(rc, _mm_loadu_si128((__m128i*)(mid + x + 1)));
+		sse128_i16_from_u8(lb, _mm_loadu_si128((__m128i*)(bot + x - 1)));
+		sse128_i16_from_u8(cb, _mm_loadu_si128((__m128i*)(bot + x)));
+		sse128_i16_from_u8(rb, _mm_loadu_si128((__m128i*)(bot + x + 1)));
+
+		__m128i res[2];
+
+		for (u32 i = 0; i < 2; ++i)
+		{
+			__m128i right = _mm_add_epi16(_mm_add_epi16(rt[i], rb[i]), _mm_slli_epi16(rc[i], 1));
+			__m128i left = _mm_add_epi16(_mm_add_epi16(lt[i], lb[i]), _mm_slli_epi16(lc[i], 1));
+			__m128i ax = _mm_abs_epi16(_mm_sub_epi16(right, left));
+
+			__m128i bottom = _mm_add_epi16(_mm_add_epi16(lb[i], rb[i]), _mm_slli_epi16(cb[i], 1));
+			__m128i upper = _mm_add_epi16(_mm_add_epi16(lt[i], rt[i]), _mm_slli_epi16(ct[i], 1));
+			__m128i ay = _mm_abs_epi16(_mm_sub_epi16(bottom, upper));
+
+			if (magnitude == SobelMagnitude_L1) {
+				res[i] = _mm_mulhi_epu16(_mm_add_epi16(ax, ay), v_scale);
+			}
+			else {
+				__m128i max = _mm_max_epi16(ax, ay);
+				__m128i min = _mm_min_epi16(ax, ay);
+				__m128i min3 = _mm_add_epi16(min, _mm_add_epi16(min, min));
+				res[i] = _mm_add_epi16(max, _mm_srli_epi16(min3, 3));
+			}
+		}
+
+		__m128i bytes = _mm_packus_epi16(res[0], res[1]);
+		if (threshold != ROW_THRESHOLD_NONE) bytes = sse128_threshold_u8(bytes, v_threshold);
+		_mm_storeu_si128((__m128i*)(dst + x), bytes);
+	}
+
+	scalar_row_sobel_magnitude_from(dst, top, mid, bot, x, count, magnitude, threshold);
+}
+
+SIMD_TARGET_END
+
+//- AVX2
+
+SIMD_TARGET_AVX2
+
+inline_fn void avx256_f32_from_u8(__m256* result, __m256i bytes)
+{
+	// u8 -> u16
+	__m256i u16_0 = _mm256_cvtepu8_epi16(_mm256_extracti128_si256(bytes, 0));
+	__m256i u16_1 = _mm256_cvtepu8_epi16(_mm256_extracti128_si256(bytes, 1));
+
+	// u16 -> u32
+	__m256i u32_0 = _mm256_cvtepu16_epi32(_mm256_extracti128_si256(u16_0, 0));
+	__m256i u32_1 = _mm256_cvtepu16_epi32(_mm256_extracti128_si256(u16_0, 1));
+	__m256i u32_2 = _mm256_cvtepu16_epi32(_mm256_extracti128_si256(u16_1, 0));
+	__m256i u32_3 = _mm256_cvtepu16_epi32(_mm256_extracti128_si256(u16_1, 1));
+
+	// u32 -> f32
+	__m256 f0 = _mm256_cvtepi32_ps(u32_0);
+	__m256 f1 = _mm256_cvtepi32_ps(u32_1);
+	__m256 f2 = _mm256_cvtepi32_ps(u32_2);
+	__m256 f3 = _mm256_cvtepi32_ps(u32_3);
+
+	result[0] = f0;
+	result[1] = f1;
+	result[2] = f2;
+	result[3] = f3;
+}
+
+inline_fn __m256i avx256_u8_from_f32(__m256* floats)
+{
+	// f32 -> u32
+	__m256i u32_0 = _mm256_cvtps_epi32(floats[0]);
+	__m256i u32_1 = _mm256_cvtps_epi32(floats[1]);
+	__m256i u32_2 = _mm256_cvtps_epi32(floats[2]);
+	__m256i u32_3 = _mm256_cvtps_epi32(floats[3]);
+
+	// u32 -> u16
+	__m256i u16_0 = _mm256_packus_epi32(u32_0, u32_1);
+	__m256i u16_1 = _mm256_packus_epi32(u32_2, u32_3);
+	u16_0 = _mm256_permute4x64_epi64(u16_0, _MM_SHUFFLE(3, 1, 2, 0));
+	u16_1 = _mm256_permute4x64_epi64(u16_1, _MM_SHUFFLE(3, 1, 2, 0));
+
+	// u16 -> u8
+	__m256i bytes = _mm256_packus_epi16(u16_0, u16_1);
+	bytes = _mm256_permute4x64_epi64(bytes, _MM_SHUFFLE(3, 1, 2, 0));
+
+	return bytes;
+}
+
+inline_fn void avx256_i16_from_u8(__m256i* result, __m256i bytes)
+{
+	result[0] = _mm256_cvtepu8_epi16(_mm256_extracti128_si256(bytes, 0));
+	result[1] = _mm256_cvtepu8_epi16(_mm256_extracti128_si256(bytes, 1));
+}
+
+// Saturates to 0-255
+inline_fn __m256i avx256_u8_from_i16(__m256i* words)
+{
+	__m256i bytes = _mm256_packus_epi16(words[0], words[1]);
+	return _mm256_permute4x64_epi64(bytes, _MM_SHUFFLE(3, 1, 2, 0));
+}
+
+// 8 RGBA pixels to 8 gray values in 32 bit lanes
+inline_fn __m256i avx256_gray_from_rgba8(__m256i pixels)
+{
+	__m256i v_zero = _mm256_setzero_si256();
+	__m256i v_weights = _mm256_setr_epi16(GRAY_WEIGHT_R, GRAY_WEIGHT_G, GRAY_WEIGHT_B, 0, GRAY_WEIGHT_R, GRAY_WEIGHT_G, GRAY_WEIGHT_B, 0, GRAY_WEIGHT_R, GRAY_WEIGHT_G, GRAY_WEIGHT_B, 0, GRAY_WEIGHT_R, GRAY_WEIGHT_G, GRAY_WEIGHT_B, 0);
+
+	// (r * wr + g * wg, b * wb) per pixel, the horizontal add keeps the pixels in order
+	__m256i lo = _mm256_madd_epi16(_mm256_unpacklo_epi8(pixels, v_zero), v_weights);
+	__m256i hi = _mm256_madd_epi16(_mm256_unpackhi_epi8(pixels, v_zero), v_weights);
+	__m256i luma = _mm256_add_epi32(_mm256_hadd_epi32(lo, hi), _mm256_set1_epi32(GRAY_ROUND));
+
+	__m256i alpha = _mm256_srli_epi32(pixels, 24);
+	alpha = _mm256_add_epi32(_mm256_slli_epi32(alpha, 8), alpha);
+
+	return _mm256_srli_epi32(_mm256_mullo_epi32(_mm256_srli_epi32(luma, 7), alpha), 24);
+}
+
+// Packs four vectors of 8 values in 32 bit lanes into 32 bytes
+inline_fn __m256i avx256_u8_from_i32(__m256i v0, __m256i v1, __m256i v2, __m256i v3)
+{
+	__m256i bytes = _mm256_packus_epi16(_mm256_packus_epi32(v0, v1), _mm256_packus_epi32(v2, v3));
+	return _mm256_permutevar8x32_epi32(bytes, _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7));
+}
+
+internal_fn void avx256_row_gray_from_rgba8(u8* dst, const u8* src, u32 count)
+{
+	u32 i = 0;
+	for (; i + 32 <= count; i += 32)
+	{
+		const u8* p = src + i * 4;
+		__m256i v0 = avx256_gray_from_rgba8(_mm256_loadu_si256((__m256i*)(p + 0)));
+		__m256i v1 = avx256_gray_from_rgba8(_mm256_loadu_si256((__m256i*)(p + 32)));
+		__m256i v2 = avx256_gray_from_rgba8(_mm256_loadu_si256((__m256i*)(p + 64)));
+		__m256i v3 = avx256_gray_from_rgba8(_mm256_loadu_si256((__m256i*)(p + 96)));
+		_mm256_storeu_si256((__m256i*)(dst + i), avx256_u8_from_i32(v0, v1, v2, v3));
+	}
+
+	scalar_row_gray_from_rgba8_from(dst, src, i, count);
+}
+
+// 8 RGB pixels expanded to opaque RGBA. Each lane loads 16 bytes for 12, the caller keeps 4 bytes
+// after the pixels.
+inline_fn __m256i avx256_rgba8_from_rgb8(const u8* src)
+{
+	__m256i pixels = _mm256_inserti128_si256(_mm256_castsi128_si256(_mm_loadu_si128((__m128i*)src)), _mm_loadu_si128((__m128i*)(src + 12)), 1);
+	__m256i v_shuffle = _mm256_setr_epi8(0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11, -1, 0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11, -1);
+	return _mm256_or_si256(_mm256_shuffle_epi8(pixels, v_shuffle), _mm256_set1_epi32((i32)0xFF000000));
+}
+
+internal_fn void avx256_row_gray_from_rgb8(u8* dst, const u8* src, u32 count)
+{
+	// The last load of a block reads 4 bytes past it, the block is only taken with 2 more pixels
+	u32 i = 0;
+	for (; i + 34 <= count; i += 32)
+	{
+		const u8* p = src + i * 3;
+		__m256i v0 = avx256_gray_from_rgba8(avx256_rgba8_from_rgb8(p + 0));
+		__m256i v1 = avx256_gray_from_rgba8(avx256_rgba8_from_rgb8(p + 24));
+		__m256i v2 = avx256_gray_from_rgba8(avx256_rgba8_from_rgb8(p + 48));
+		__m256i v3 = avx256_gray_from_rgba8(avx256_rgba8_from_rgb8(p + 72));
+		_mm256_storeu_si256((__m256i*)(dst + i), avx256_u8_from_i32(v0, v1, v2, v3));
+	}
+
+	scalar_row_gray_from_rgb8_from(dst, src, i, count);
+}
+
+inline_fn __m256i avx256_threshold_get_bias(u32 threshold) {
+	return _mm256_set1_epi8((char)(threshold ^ 0x80));
+}
+
+// 0xFF where the byte is above the threshold, 'v_threshold' comes from 'avx256_threshold_get_bias'
+inline_fn __m256i avx256_threshold_u8(__m256i bytes, __m256i v_threshold) {
+	return _mm256_cmpgt_epi8(_mm256_xor_si256(bytes, _mm256_set1_epi8((char)0x80)), v_threshold);
+}
+
+internal_fn void avx256_row_threshold(u8* dst, const u8* src, u32 count, u8 threshold)
+{
+	__m256i v_threshold = avx256_threshold_get_bias(threshold);
+
+	u32 i = 0;
+	for (; i + 32 <= count; i += 32) {
+		__m256i bytes = _mm256_loadu_si256((__m256i*)(src + i));
+		_mm256_storeu_si256((__m256i*)(dst + i), avx256_threshold_u8(bytes, v_threshold));
+	}
+
+	scalar_row_threshold(dst + i, src + i, count - i, threshold);
+}
+
+inline_fn __m256i avx256_mult_u8(__m256i bytes, __m256 v_mult)
+{
+	__m256 v_255 = _mm256_set1_ps(255.0f);
+	__m256 v_zero = _mm256_set1_ps(0.0f);
+
+	__m256 f[4];
+	avx256_f32_from_u8(f, bytes);
+
+	// Mult
+	f[0] = _mm256_mul_ps(f[0], v_mult);
+	f[1] = _mm256_mul_ps(f[1], v_mult);
+	f[2] = _mm256_mul_ps(f[2], v_mult);
+	f[3] = _mm256_mul_ps(f[3], v_mult);
+
+	// Clamp 0-255
+	f[0] = _mm256_min_ps(_mm256_max_ps(f[0], v_zero), v_255);
+	f[1] = _mm256_min_ps(_mm256_max_ps(f[1], v_zero), v_255);
+	f[2] = _mm256_min_ps(_mm256_max_ps(f[2], v_zero), v_255);
+	f[3] = _mm256_min_ps(_mm256_max_ps(f[3], v_zero), v_255);
+
+	return avx256_u8_from_f32(f);
+}
+
+internal_fn void avx256_row_mult_f32(u8* dst, const u8* src, u32 count, f32 mult)
+{
+	__m256 v_mult = _mm256_set1_ps(mult);
+
+	u32 i = 0;
+	for (; i + 32 <= count; i += 32)
+	{
+		__m256i bytes = _mm256_loadu_si256((__m256i*)(src + i));
+		_mm256_storeu_si256((__m256i*)(dst + i), avx256_mult_u8(bytes, v_mult));
+	}
+
+	// The tail goes through the same vector path so the rounding doesn't change at the end of a row
+	if (i < count)
+	{
+		u8 tail[32] = {};
+		memory_copy(tail, src + i, count - i);
+		__m256i bytes = _mm256_loadu_si256((__m256i*)tail);
+		_mm256_storeu_si256((__m256i*)tail, avx256_mult_u8(bytes, v_mult));
+		memory_copy(dst + i, tail, count - i);
+	}
+}
+
+inline_fn __m256i avx256_blend_u8(__m256i bytes0, __m256i bytes1, __m256 v_factor0, __m256 v_factor1)
+{
+	__m256 f0[4];
+	avx256_f32_from_u8(f0, bytes0);
+
+	__m256 f1[4];
+	avx256_f32_from_u8(f1, bytes1);
+
+	f0[0] = _mm256_mul_ps(f0[0], v_factor0);
+	f0[1] = _mm256_mul_ps(f0[1], v_factor0);
+	f0[2] = _mm256_mul_ps(f0[2], v_factor0);
+	f0[3] = _mm256_mul_ps(f0[3], v_factor0);
+
+	f1[0] = _mm256_mul_ps(f1[0], v_factor1);
+	f1[1] = _mm256_mul_ps(f1[1], v_factor1);
+	f1[2] = _mm256_mul_ps(f1[2], v_factor1);
+	f1[3] = _mm256_mul_ps(f1[3], v_factor1);
+
+	__m256 f[4];
+	f[0] = _mm256_add_ps(f0[0], f1[0]);
+	f[1] = _mm256_add_ps(f0[1], f1[1]);
+	f[2] = _mm256_add_ps(f0[2], f1[2]);
+	f[3] = _mm256_add_ps(f0[3], f1[3]);
+
+	return avx256_u8_from_f32(f);
+}
+
+internal_fn void avx256_row_blend_f32(u8* dst, const u8* src0, const u8* src1, u32 count, f32 factor, u32 threshold)
+{
+	__m256 v_factor0 = _mm256_set1_ps(1.f - factor);
+	__m256 v_factor1 = _mm256_set1_ps(factor);
+	__m256i v_threshold = avx256_threshold_get_bias(threshold);
+
+	u32 i = 0;
+	for (; i + 32 <= count; i += 32)
+	{
+		__m256i bytes0 = _mm256_loadu_si256((__m256i*)(src0 + i));
+		__m256i bytes1 = _mm256_loadu_si256((__m256i*)(src1 + i));
+		__m256i res = avx256_blend_u8(bytes0, bytes1, v_factor0, v_factor1);
+		if (threshold != ROW_THRESHOLD_NONE) res = avx256_threshold_u8(res, v_threshold);
+		_mm256_storeu_si256((__m256i*)(dst + i), res);
+	}
+
+	if (i < count)
+	{
+		u8 tail0[32] = {};
+		u8 tail1[32] = {};
+		memory_copy(tail0, src0 + i, count - i);
+		memory_copy(tail1, src1 + i, count - i);
+		__m256i bytes0 = _mm256_loadu_si256((__m256i*)tail0);
+		__m256i bytes1 = _mm256_loadu_si256((__m256i*)tail1);
+		__m256i res = avx256_blend_u8(bytes0, bytes1, v_factor0, v_factor1);
+		if (threshold != ROW_THRESHOLD_NONE) res = avx256_threshold_u8(res, v_threshold);
+		_mm256_storeu_si256((__m256i*)tail0, res);
+		memory_copy(dst + i, tail0, count - i);
+	}
+}
+
+internal_fn void avx256_row_mult(u8* dst, const u8* src, u32 count, f32 mult)
+{
+	if (!mult_fits_fixed(mult)) {
+		avx256_row_mult_f32(dst, src, count, mult);
+		return;
+	}
+
+	i16 mult_fixed = mult_get_fixed(mult);
+	__m256i v_mult = _mm256_set1_epi16(mult_fixed);
+	__m256i v_zero = _mm256_setzero_si256();
+
+	// The unpacks and the pack stay inside the 128 bit lanes, the pixels come out in order
+	u32 i = 0;
+	for (; i + 32 <= count; i += 32)
+	{
+		__m256i bytes = _mm256_loadu_si256((__m256i*)(src + i));
+		__m256i lo = _mm256_mulhrs_epi16(_mm256_slli_epi16(_mm256_unpacklo_epi8(bytes, v_zero), 7), v_mult);
+		__m256i hi = _mm256_mulhrs_epi16(_mm256_slli_epi16(_mm256_unpackhi_epi8(bytes, v_zero), 7), v_mult);
+		_mm256_storeu_si256((__m256i*)(dst + i), _mm256_packus_epi16(lo, hi));
+	}
+
+	scalar_row_mult_fixed_from(dst, src, i, count, mult_fixed);
+}
+
+internal_fn void avx256_row_blend(u8* dst, const u8* src0, const u8* src1, u32 count, f32 factor, u32 threshold)
+{
+	if (!blend_fits_fixed(factor)) {
+		avx256_row_blend_f32(dst, src0, src1, count, factor, threshold);
+		return;
+	}
+
+	i16 factor_fixed = blend_get_fixed(factor);
+	__m256i v_factor = _mm256_set1_epi16(factor_fixed);
+	__m256i v_zero = _mm256_setzero_si256();
+	__m256i v_threshold = avx256_threshold_get_bias(threshold);
+
+	u32 i = 0;
+	for (; i + 32 <= count; i += 32)
+	{
+		__m256i bytes0 = _mm256_loadu_si256((__m256i*)(src0 + i));
+		__m256i bytes1 = _mm256_loadu_si256((__m256i*)(src1 + i));
+
+		__m256i res;
+
+		if (factor == 0.5f) {
+			res = _mm256_avg_epu8(bytes0, bytes1);
+		}
+		else {
+			__m256i lo0 = _mm256_unpacklo_epi8(bytes0, v_zero);
+			__m256i hi0 = _mm256_unpackhi_epi8(bytes0, v_zero);
+			__m256i lo = _mm256_add_epi16(lo0, _mm256_mulhrs_epi16(_mm256_sub_epi16(_mm256_unpacklo_epi8(bytes1, v_zero), lo0), v_factor));
+			__m256i hi = _mm256_add_epi16(hi0, _mm256_mulhrs_epi16(_mm256_sub_epi16(_mm256_unpackhi_epi8(bytes1, v_zero), hi0), v_factor));
+			res = _mm256_packus_epi16(lo, hi);
+		}
+
+		if (threshold != ROW_THRESHOLD_NONE) res = avx256_threshold_u8(res, v_threshold);
+		_mm256_storeu_si256((__m256i*)(dst + i), res);
+	}
+
+	scalar_row_blend_fixed_from(dst, src0, src1, i, count, factor_fixed, threshold);
+}
+
+// 32 pixels per iteration with 32 bit lanes, same as 'sse128_row_kernel_i32'. The unpacks and the
+// packs work inside each 128 bit lane, the packs put the words back in order.
+template <u32 PairCount>
+internal_fn u32 avx256_row_kernel_i32(u8* dst, const KernelTapPairs* pairs, u32 count, i32 shift)
+{
+	u32 pair_count = PairCount ? PairCount : pairs->count;
+
+	const u8* sources[KERNEL_MAX_TAP_PAIRS][2];
+	__m256i v_coefficients[KERNEL_MAX_TAP_PAIRS];
+
+	for (u32 p = 0; p < pair_count; ++p) {
+		sources[p][0] = pairs->sources[p][0];
+		sources[p][1] = pairs->sources[p][1];
+		v_coefficients[p] = _mm256_set1_epi32(pairs->coefficients[p]);
+	}
+
+	__m128i v_shift = _mm_cvtsi32_si128(shift);
+
+	u32 x = 0;
+	for (; x + 32 <= count; x += 32)
+	{
+		__m256i sum[4] = { _mm256_setzero_si256(), _mm256_setzero_si256(), _mm256_setzero_si256(), _mm256_setzero_si256() };
+
+		for (u32 p = 0; p < pair_count; ++p)
+		{
+			__m256i words0[2], words1[2];
+			avx256_i16_from_u8(words0, _mm256_loadu_si256((__m256i*)(sources[p][0] + x)));
+			avx256_i16_from_u8(words1, _mm256_loadu_si256((__m256i*)(sources[p][1] + x)));
+
+			for (u32 i = 0; i < 2; ++i) {
+				sum[i * 2 + 0] = _mm256_add_epi32(sum[i * 2 + 0], _mm256_madd_epi16(_mm256_unpacklo_epi16(words0[i], words1[i]), v_coefficients[p]));
+				sum[i * 2 + 1] = _mm256_add_epi32(sum[i * 2 + 1], _mm256_madd_epi16(_mm256_unpackhi_epi16(words0[i], words1[i]), v_coefficients[p]));
+			}
+		}
+
+		__m256i words[2];
+		for (u32 i = 0; i < 2; ++i) {
+			words[i] = _mm256_packs_epi32(_mm256_srl_epi32(_mm256_abs_epi32(sum[i * 2 + 0]), v_shift), _mm256_srl_epi32(_mm256_abs_epi32(sum[i * 2 + 1]), v_shift));
+		}
+
+		_mm256_storeu_si256((__m256i*)(dst + x), avx256_u8_from_i16(words));
+	}
+
+	return x;
+}
+
+// 32 pixels per iteration with 16 or 32 bit lanes, same as 'sse128_row_kernel'
+internal_fn void avx256_row_kernel(u8* dst, const u8* const* sources, const i32* coefficients, u32 tap_count, u32 count, u32 normalize_factor)
+{
+	u32 x = 0;
+	i32 shift = normalize_factor_get_shift(normalize_factor);
+
+	if (shift >= 0 && tap_count <= KERNEL_MAX_I16_TAPS && kernel_fits_i16(coefficients, tap_count))
+	{
+		// Skip zero taps, half of the sobel kernel
+		const u8* tap_sources[9];
+		__m256i tap_coefficients[9];
+		u32 taps = 0;
+
+		assert(tap_count <= 9);
+
+		for (u32 i = 0; i < tap_count; ++i) {
+			if (coefficients[i] == 0) continue;
+			tap_sources[taps] = sources[i];
+			tap_coefficients[taps] = _mm256_set1_epi16((i16)coefficients[i]);
+			taps++;
+		}
+
+		__m128i v_shift = _mm_cvtsi32_si128(shift);
+
+		for (; x + 32 <= count; x += 32)
+		{
+			__m256i sum[2] = { _mm256_setzero_si256(), _mm256_setzero_si256() };
+
+			for (u32 t = 0; t < taps; ++t)
+			{
+				__m256i words[2];
+				avx256_i16_from_u8(words, _mm256_loadu_si256((__m256i*)(tap_sources[t] + x)));
+
+				sum[0] = _mm256_add_epi16(sum[0], _mm256_mullo_epi16(words[0], tap_coefficients[t]));
+				sum[1] = _mm256_add_epi16(sum[1], _mm256_mullo_epi16(words[1], tap_coefficients[t]));
+			}
+
+			sum[0] = _mm256_srl_epi16(_mm256_abs_epi16(sum[0]), v_shift);
+			sum[1] = _mm256_srl_epi16(_mm256_abs_epi16(sum[1]), v_shift);
+
+			_mm256_storeu_si256((__m256i*)(dst + x), avx256_u8_from_i16(sum));
+		}
+	}
+	else if (shift >= 0 && kernel_fits_i32(coefficients, tap_count))
+	{
+		KernelTapPairs pairs = kernel_tap_pairs_make(sources, coefficients, tap_count);
+		KERNEL_TAP_PAIRS_DISPATCH(x, avx256_row_kernel_i32, pairs.count, dst, &pairs, count, shift);
+	}
+
+	scalar_row_kernel_from(dst, sources, coefficients, tap_count, x, count, normalize_factor);
+}
+
+internal_fn void avx256_row_box_sum(u8* dst, i32* sums, const u8* add, const u8* sub, u32 count, f32 scale)
+{
+	__m256 v_scale = _mm256_set1_ps(scale);
+
+	u32 i = 0;
+	for (; i + 32 <= count; i += 32)
+	{
+		__m256 f[4];
+		for (u32 j = 0; j < 4; ++j) {
+			__m256i a = _mm256_cvtepu8_epi32(_mm_loadl_epi64((__m128i*)(add + i + j * 8)));
+			__m256i s = _mm256_cvtepu8_epi32(_mm_loadl_epi64((__m128i*)(sub + i + j * 8)));
+
+			__m256i* p = (__m256i*)(sums + i + j * 8);
+			__m256i sum = _mm256_add_epi32(_mm256_loadu_si256(p), _mm256_sub_epi32(a, s));
+			_mm256_storeu_si256(p, sum);
+			f[j] = _mm256_mul_ps(_mm256_cvtepi32_ps(sum), v_scale);
+		}
+
+		_mm256_storeu_si256((__m256i*)(dst + i), avx256_u8_from_f32(f));
+	}
+
+	scalar_row_box_sum_from(dst, sums, add, sub, i, count, scale);
+}
+
+// The scan runs inside each 128 bit lane, then the low lane is added to the high one
+inline_fn __m256i avx256_prefix_i32(__m256i v, __m256i carry)
+{
+	v = _mm256_add_epi32(v, _mm256_slli_si256(v, 4));
+	v = _mm256_add_epi32(v, _mm256_slli_si256(v, 8));
+
+	__m256i low = _mm256_permutevar8x32_epi32(v, _mm256_set1_epi32(3));
+	v = _mm256_add_epi32(v, _mm256_blend_epi32(_mm256_setzero_si256(), low, 0xF0));
+	return _mm256_add_epi32(v, carry);
+}
+
+internal_fn void avx256_row_box_blur(u8* dst, const u8* src, i32* prefix, u32 count, u32 radius, f32 scale)
+{
+	box_prefix_begin(prefix, src, radius);
+
+	i32* p = prefix + radius;
+	__m256i carry = _mm256_set1_epi32(p[0]);
+	__m256i v_last = _mm256_set1_epi32(7);
+
+	u32 i = 0;
+	for (; i + 32 <= count; i += 32)
+	{
+		for (u32 j = 0; j < 4; ++j) {
+			__m256i v = _mm256_cvtepu8_epi32(_mm_loadl_epi64((__m128i*)(src + i + j * 8)));
+			v = avx256_prefix_i32(v, carry);
+			carry = _mm256_permutevar8x32_epi32(v, v_last);
+			_mm256_storeu_si256((__m256i*)(p + i + j * 8 + 1), v);
+		}
+	}
+
+	scalar_box_prefix_from(p, src, i, count);
+	box_prefix_end(prefix, src, count, radius);
+
+	__m256 v_scale = _mm256_set1_ps(scale);
+	u32 width = radius * 2 + 1;
+
+	i = 0;
+	for (; i + 32 <= count; i += 32)
+	{
+		__m256 f[4];
+		for (u32 j = 0; j < 4; ++j) {
+			__m256i head = _mm256_loadu_si256((__m256i*)(prefix + i + j * 8 + width));
+			__m256i tail = _mm256_loadu_si256((__m256i*)(prefix + i + j * 8));
+			f[j] = _mm256_mul_ps(_mm256_cvtepi32_ps(_mm256_sub_epi32(head, tail)), v_scale);
+		}
+
+		_mm256_storeu_si256((__m256i*)(dst + i), avx256_u8_from_f32(f));
+	}
+
+	scalar_box_difference_from(dst, prefix, i, count, radius, scale);
+}
+
+// |Gx| + |Gy| <= 2040 so the magnitude is computed exactly in 16 bit lanes
+internal_fn void avx256_row_sobel_magnitude(u8* dst, const u8* top, const u8* mid, const u8* bot, u32 count, SobelMagnitude magnitude, u32 threshold)
+{
+	__m256i v_scale = _mm256_set1_epi16((i16)SOBEL_L1_SCALE);
+	__m256i v_threshold = avx256_threshold_get_bias(threshold);
+
+	u32 x = 0;
+	for (; x + 32 <= count; x += 32)
+	{
+		__m256i lt[2], ct[2], rt[2], lc[2], rc[2], lb[2], cb[2], rb[2];
+		avx256_i16_from_u8(lt, _mm256_loadu_si256((__m256i*)(top + x - 1)));
+		avx256_i16_from_u8(ct, _mm256_loadu_si256((__m256i*)(top + x)));
+		avx256_i16_from_u8(rt, _mm256_loadu_si256((__m256i*)(top + x + 1)));
+		avx256_i16_from_u8(lc, _mm256_loadu_si256((__m256i*)(mid + x - 1)));
+		avx256_i16_from_u8(rc, _mm256_loadu_si256((__m256i*)(mid + x + 1)));
+		avx256_i16_from_u8(lb, _mm256_loadu_si256((__m256i*)(bot + x - 1)));
+		avx256_i16_from_u8(cb, _mm256_loadu_si256((__m256i*)(bot + x)));
+		avx256_i16_from_u8(rb, _mm256_loadu_si256((__m256i*)(bot + x + 1)));
+
+		__m256i res[2];
+
+		for (u32 i = 0; i < 2; ++i)
+		{
+			// Gx = (rt + 2rc + rb) - (lt + 2lc + lb)
+			__m256i right = _mm256_add_epi16(_mm256_add_epi16(rt[i], rb[i]), _mm256_slli_epi16(rc[i], 1));
+			__m256i left = _mm256_add_epi16(_mm256_add_epi16(lt[i], lb[i]), _mm256_slli_epi16(lc[i], 1));
+			__m256i ax = _mm256_abs_epi16(_mm256_sub_epi16(right, left));
+
+			// Gy = (lb + 2cb + rb) - (lt + 2ct + rt)
+			__m256i bottom = _mm256_add_epi16(_mm256_add_epi16(lb[i], rb[i]), _mm256_slli_epi16(cb[i], 1));
+			__m256i upper = _mm256_add_epi16(_mm256_add_epi16(lt[i], rt[i]), _mm256_slli_epi16(ct[i], 1));
+			__m256i ay = _mm256_abs_epi16(_mm256_sub_epi16(bottom, upper));
+
+			if (magnitude == SobelMagnitude_L1) {
+				res[i] = _mm256_mulhi_epu16(_mm256_add_epi16(ax, ay), v_scale);
+			}
+			else {
+				__m256i max = _mm256_max_epi16(ax, ay);
+				__m256i min = _mm256_min_epi16(ax, ay);
+				__m256i min3 = _mm256_add_epi16(min, _mm256_add_epi16(min, min));
+				res[i] = _mm256_add_epi16(max, _mm256_srli_epi16(min3, 3));
+			}
+		}
+
+		__m256i bytes = avx256_u8_from_i16(res);
+		if (threshold != ROW_THRESHOLD_NONE) bytes = avx256_threshold_u8(bytes, v_threshold);
+		_mm256_storeu_si256((__m256i*)(dst + x), bytes);
+	}
+
+	scalar_row_sobel_magnitude_from(dst, top, mid, bot, x, count, magnitude, threshold);
+}
+
+SIMD_TARGET_END
+
+//- AVX-512BW
+// The row tails use masked loads and stores, the lanes past the row are never read or written
+
+SIMD_TARGET_AVX512BW
+
+inline_fn __mmask64 avx512_tail_mask(u32 remaining) {
+	return (remaining >= 64) ? ~0ULL : ((1ULL << remaining) - 1);
+}
+
+// 64 bytes to f32 and back, 16 pixels per vector. Like the 16 bit words below, the values are
+// interleaved inside each 128 bit lane and the packs put them back in order.
+inline_fn void avx512_f32_from_u8(__m512* result, __m512i bytes)
+{
+	__m512i v_zero = _mm512_setzero_si512();
+	__m512i words0 = _mm512_unpacklo_epi8(bytes, v_zero);
+	__m512i words1 = _mm512_unpackhi_epi8(bytes, v_zero);
+
+	result[0] = _mm512_cvtepi32_ps(_mm512_unpacklo_epi16(words0, v_zero));
+	result[1] = _mm512_cvtepi32_ps(_mm512_unpackhi_epi16(words0, v_zero));
+	result[2] = _mm512_cvtepi32_ps(_mm512_unpacklo_epi16(words1, v_zero));
+	result[3] = _mm512_cvtepi32_ps(_mm512_unpackhi_epi16(words1, v_zero));
+}
+
+// Saturates like the packs of the AVX2 version
+inline_fn __m512i avx512_u8_from_f32(__m512* floats)
+{
+	__m512i words0 = _mm512_packus_epi32(_mm512_cvtps_epi32(floats[0]), _mm512_cvtps_epi32(floats[1]));
+	__m512i words1 = _mm512_packus_epi32(_mm512_cvtps_epi32(floats[2]), _mm512_cvtps_epi32(floats[3]));
+	return _mm512_packus_epi16(words0, words1);
+}
+
+// Only valid for operations between pixels at the same position, the words are interleaved inside
+// each 128 bit lane and 'avx512_u8_from_i16' puts them back in order.
+inline_fn void avx512_i16_from_u8(__m512i* result, __m512i bytes)
+{
+	result[0] = _mm512_unpacklo_epi8(bytes, _mm512_setzero_si512());
+	result[1] = _mm512_unpackhi_epi8(bytes, _mm512_setzero_si512());
+}
+
+// Saturates to 0-255
+inline_fn __m512i avx512_u8_from_i16(__m512i* words) {
+	return _mm512_packus_epi16(words[0], words[1]);
+}
+
+// 64 bytes to 4 vectors of i32, in order
+inline_fn void avx512_i32_from_u8(__m512i* result, __m512i bytes)
+{
+	result[0] = _mm512_cvtepu8_epi32(_mm512_extracti32x4_epi32(bytes, 0));
+	result[1] = _mm512_cvtepu8_epi32(_mm512_extracti32x4_epi32(bytes, 1));
+	result[2] = _mm512_cvtepu8_epi32(_mm512_extracti32x4_epi32(bytes, 2));
+	result[3] = _mm512_cvtepu8_epi32(_mm512_extracti32x4_epi32(bytes, 3));
+}
+
+inline_fn __m512i avx512_threshold_u8(__m512i bytes, __m512i v_threshold) {
+	__mmask64 above = _mm512_cmpgt_epu8_mask(bytes, v_threshold);
+	return _mm512_maskz_mov_epi8(above, _mm512_set1_epi8((char)0xFF));
+}
+
+internal_fn void avx512_row_threshold(u8* dst, const u8* src, u32 count, u8 threshold)
+{
+	__m512i v_threshold = _mm512_set1_epi8((char)threshold);
+
+	for (u32 i = 0; i < count; i += 64)
+	{
+		__mmask64 mask = avx512_tail_mask(count - i);
+
+		__m512i bytes = _mm512_maskz_loadu_epi8(mask, src + i);
+		_mm512_mask_storeu_epi8(dst + i, mask, avx512_threshold_u8(bytes, v_threshold));
+	}
+}
+
+internal_fn void avx512_row_mult_f32(u8* dst, const u8* src, u32 count, f32 mult)
+{
+	__m512 v_mult = _mm512_set1_ps(mult);
+	__m512 v_255 = _mm512_set1_ps(255.0f);
+	__m512 v_zero = _mm512_setzero_ps();
+
+	for (u32 i = 0; i < count; i += 64)
+	{
+		__mmask64 mask = avx512_tail_mask(count - i);
+
+		__m512 f[4];
+		avx512_f32_from_u8(f, _mm512_maskz_loadu_epi8(mask, src + i));
+
+		for (u32 j = 0; j < 4; ++j) {
+			f[j] = _mm512_min_ps(_mm512_max_ps(_mm512_mul_ps(f[j], v_mult), v_zero), v_255);
+		}
+
+		_mm512_mask_storeu_epi8(dst + i, mask, avx512_u8_from_f32(f));
+	}
+}
+
+internal_fn void avx512_row_blend_f32(u8* dst, const u8* src0, const u8* src1, u32 count, f32 factor, u32 threshold)
+{
+	__m512 v_factor0 = _mm512_set1_ps(1.f - factor);
+	__m512 v_factor1 = _mm512_set1_ps(factor);
+	__m512i v_threshold = _mm512_set1_epi8((char)threshold);
+
+	for (u32 i = 0; i < count; i += 64)
+	{
+		__mmask64 mask = avx512_tail_mask(count - i);
+
+		__m512 f0[4];
+		avx512_f32_from_u8(f0, _mm512_maskz_loadu_epi8(mask, src0 + i));
+
+		__m512 f1[4];
+		avx512_f32_from_u8(f1, _mm512_maskz_loadu_epi8(mask, src1 + i));
+
+		// Explicit rounding, AVX-512 implies FMA and a fused multiply-add would change the result
+		__m512 f[4];
+		for (u32 j = 0; j < 4; ++j) {
+			__m512 v0 = _mm512_mul_round_ps(f0[j], v_factor0, _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC);
+			__m512 v1 = _mm512_mul_round_ps(f1[j], v_factor1, _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC);
+			f[j] = _mm512_add_round_ps(v0, v1, _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC);
+		}
+
+		__m512i res = avx512_u8_from_f32(f);
+		if (threshold != ROW_THRESHOLD_NONE) res = avx512_threshold_u8(res, v_threshold);
+		_mm512_mask_storeu_epi8(dst + i, mask, res);
+	}
+}
+
+internal_fn void avx512_row_mult(u8* dst, const u8* src, u32 count, f32 mult)
+{
+	if (!mult_fits_fixed(mult)) {
+		avx512_row_mult_f32(dst, src, count, mult);
+		return;
+	}
+
+	__m512i v_mult = _mm512_set1_epi16(mult_get_fixed(mult));
+
+	for (u32 i = 0; i < count; i += 64)
+	{
+		__mmask64 mask = avx512_tail_mask(count - i);
+
+		__m512i words[2];
+		avx512_i16_from_u8(words, _mm512_maskz_loadu_epi8(mask, src + i));
+
+		words[0] = _mm512_mulhrs_epi16(_mm512_slli_epi16(words[0], 7), v_mult);
+		words[1] = _mm512_mulhrs_epi16(_mm512_slli_epi16(words[1], 7), v_mult);
+
+		_mm512_mask_storeu_epi8(dst + i, mask, avx512_u8_from_i16(words));
+	}
+}
+
+internal_fn void avx512_row_blend(u8* dst, const u8* src0, const u8* src1, u32 count, f32 factor, u32 threshold)
+{
+	if (!blend_fits_fixed(factor)) {
+		avx512_row_blend_f32(dst, src0, src1, count, factor, threshold);
+		return;
+	}
+
+	__m512i v_factor = _mm512_set1_epi16(blend_get_fixed(factor));
+	__m512i v_threshold = _mm512_set1_epi8((char)threshold);
+
+	for (u32 i = 0; i < count; i += 64)
+	{
+		__mmask64 mask = avx512_tail_mask(count - i);
+
+		__m512i bytes0 = _mm512_maskz_loadu_epi8(mask, src0 + i);
+		__m512i bytes1 = _mm512_maskz_loadu_epi8(mask, src1 + i);
+
+		__m512i res;
+
+		if (factor == 0.5f) {
+			res = _mm512_avg_epu8(bytes0, bytes1);
+		}
+		else {
+			__m512i words0[2], words1[2];
+			avx512_i16_from_u8(words0, bytes0);
+			avx512_i16_from_u8(words1, bytes1);
+
+			for (u32 j = 0; j < 2; ++j) {
+				words0[j] = _mm512_add_epi16(words0[j], _mm512_mulhrs_epi16(_mm512_sub_epi16(words1[j], words0[j]), v_factor));
+			}
+
+			res = avx512_u8_from_i16(words0);
+		}
+
+		if (threshold != ROW_THRESHOLD_NONE) res = avx512_threshold_u8(res, v_threshold);
+		_mm512_mask_storeu_epi8(dst + i, mask, res);
+	}
+}
+
+// 64 pixels per iteration with 32 bit lanes, same as 'sse128_row_kernel_i32'. Every pixel is
+// written, the tail with masks.
+template <u32 PairCount>
+internal_fn u32 avx512_row_kernel_i32(u8* dst, const KernelTapPairs* pairs, u32 count, i32 shift)
+{
+	u32 pair_count = PairCount ? PairCount : pairs->count;
+
+	const u8* sources[KERNEL_MAX_TAP_PAIRS][2];
+	__m512i v_coefficients[KERNEL_MAX_TAP_PAIRS];
+
+	for (u32 p = 0; p < pair_count; ++p) {
+		sources[p][0] = pairs->sources[p][0];
+		sources[p][1] = pairs->sources[p][1];
+		v_coefficients[p] = _mm512_set1_epi32(pairs->coefficients[p]);
+	}
+
+	__m128i v_shift = _mm_cvtsi32_si128(shift);
+
+	for (u32 x = 0; x < count; x += 64)
+	{
+		__mmask64 mask = avx512_tail_mask(count - x);
+
+		__m512i sum[4] = { _mm512_setzero_si512(), _mm512_setzero_si512(), _mm512_setzero_si512(), _mm512_setzero_si512() };
+
+		for (u32 p = 0; p < pair_count; ++p)
+		{
+			__m512i words0[2], words1[2];
+			avx512_i16_from_u8(words0, _mm512_maskz_loadu_epi8(mask, sources[p][0] + x));
+			avx512_i16_from_u8(words1, _mm512_maskz_loadu_epi8(mask, sources[p][1] + x));
+
+			for (u32 i = 0; i < 2; ++i) {
+				sum[i * 2 + 0] = _mm512_add_epi32(sum[i * 2 + 0], _mm512_madd_epi16(_mm512_unpacklo_epi16(words0[i], words1[i]), v_coefficients[p]));
+				sum[i * 2 + 1] = _mm512_add_epi32(sum[i * 2 + 1], _mm512_madd_epi16(_mm512_unpackhi_epi16(words0[i], words1[i]), v_coefficients[p]));
+			}
+		}
+
+		__m512i words[2];
+		for (u32 i = 0; i < 2; ++i) {
+			words[i] = _mm512_packs_epi32(_mm512_srl_epi32(_mm512_abs_epi32(sum[i * 2 + 0]), v_shift), _mm512_srl_epi32(_mm512_abs_epi32(sum[i * 2 + 1]), v_shift));
+		}
+
+		_mm512_mask_storeu_epi8(dst + x, mask, avx512_u8_from_i16(words));
+	}
+
+	return count;
+}
+
+// 64 pixels per iteration with 16 or 32 bit lanes, same as 'sse128_row_kernel'
+internal_fn void avx512_row_kernel(u8* dst, const u8* const* sources, const i32* coefficients, u32 tap_count, u32 count, u32 normalize_factor)
+{
+	i32 shift = normalize_factor_get_shift(normalize_factor);
+
+	if (shift >= 0 && (tap_count > KERNEL_MAX_I16_TAPS || !kernel_fits_i16(coefficients, tap_count)) && kernel_fits_i32(coefficients, tap_count))
+	{
+		KernelTapPairs pairs = kernel_tap_pairs_make(sources, coefficients, tap_count);
+		u32 x = 0;
+		KERNEL_TAP_PAIRS_DISPATCH(x, avx512_row_kernel_i32, pairs.count, dst, &pairs, count, shift);
+
+		// The masked tail leaves nothing to the scalar kernel
+		scalar_row_kernel_from(dst, sources, coefficients, tap_count, x, count, normalize_factor);
+		return;
+	}
+
+	if (shift < 0 || tap_count > KERNEL_MAX_I16_TAPS || !kernel_fits_i16(coefficients, tap_count)) {
+		scalar_row_kernel_from(dst, sources, coefficients, tap_count, 0, count, normalize_factor);
+		return;
+	}
+
+	// Skip zero taps, half of the sobel kernel
+	const u8* tap_sources[9];
+	__m512i tap_coefficients[9];
+	u32 taps = 0;
+
+	assert(tap_count <= 9);
+
+	for (u32 i = 0; i < tap_count; ++i) {
+		if (coefficients[i] == 0) continue;
+		tap_sources[taps] = sources[i];
+		tap_coefficients[taps] = _mm512_set1_epi16((i16)coefficients[i]);
+		taps++;
+	}
+
+	__m128i v_shift = _mm_cvtsi32_si128(shift);
+
+	for (u32 x = 0; x < count; x += 64)
+	{
+		__mmask64 mask = avx512_tail_mask(count - x);
+
+		__m512i sum[2] = { _mm512_setzero_si512(), _mm512_setzero_si512() };
+
+		for (u32 t = 0; t < taps; ++t)
+		{
+			__m512i words[2];
+			avx512_i16_from_u8(words, _mm512_maskz_loadu_epi8(mask, tap_sources[t] + x));
+
+			sum[0] = _mm512_add_epi16(sum[0], _mm512_mullo_epi16(words[0], tap_coefficients[t]));
+			sum[1] = _mm512_add_epi16(sum[1], _mm512_mullo_epi16(words[1], tap_coefficients[t]));
+		}
+
+		sum[0] = _mm512_srl_epi16(_mm512_abs_epi16(sum[0]), v_shift);
+		sum[1] = _mm512_srl_epi16(_mm512_abs_epi16(sum[1]), v_shift);
+
+		_mm512_mask_storeu_epi8(dst + x, mask, avx512_u8_from_i16(sum));
+	}
+}
+
+// The sums of the tail are masked per group of 16 pixels
+internal_fn void avx512_row_box_sum(u8* dst, i32* sums, const u8* add, const u8* sub, u32 count, f32 scale)
+{
+	__m512 v_scale = _mm512_set1_ps(scale);
+
+	for (u32 i = 0; i < count; i += 64)
+	{
+		__mmask64 mask = avx512_tail_mask(count - i);
+
+		__m512i a[4], s[4];
+		avx512_i32_from_u8(a, _mm512_maskz_loadu_epi8(mask, add + i));
+		avx512_i32_from_u8(s, _mm512_maskz_loadu_epi8(mask, sub + i));
+
+		for (u32 j = 0; j < 4; ++j) {
+			__mmask16 lanes = (__mmask16)(mask >> (j * 16));
+			if (lanes == 0) break;
+
+			i32* p = sums + i + j * 16;
+			__m512i sum = _mm512_add_epi32(_mm512_maskz_loadu_epi32(lanes, p), _mm512_sub_epi32(a[j], s[j]));
+			_mm512_mask_storeu_epi32(p, lanes, sum);
+
+			__m512i res = _mm512_cvtps_epi32(_mm512_mul_ps(_mm512_cvtepi32_ps(sum), v_scale));
+			_mm512_mask_cvtusepi32_storeu_epi8(dst + i + j * 16, lanes, res);
+		}
+	}
+}
+
+// Shifts of 1, 2, 4 and 8 lanes across the whole vector
+inline_fn __m512i avx512_prefix_i32(__m512i v, __m512i carry)
+{
+	__m512i v_zero = _mm512_setzero_si512();
+	v = _mm512_add_epi32(v, _mm512_alignr_epi32(v, v_zero, 15));
+	v = _mm512_add_epi32(v, _mm512_alignr_epi32(v, v_zero, 14));
+	v = _mm512_add_epi32(v, _mm512_alignr_epi32(v, v_zero, 12));
+	v = _mm512_add_epi32(v, _mm512_alignr_epi32(v, v_zero, 8));
+	return _mm512_add_epi32(v, carry);
+}
+
+internal_fn void avx512_row_box_blur(u8* dst, const u8* src, i32* prefix, u32 count, u32 radius, f32 scale)
+{
+	box_prefix_begin(prefix, src, radius);
+
+	i32* p = prefix + radius;
+	__m512i carry = _mm512_set1_epi32(p[0]);
+	__m512i v_last = _mm512_set1_epi32(15);
+
+	u32 i = 0;
+	for (; i + 64 <= count; i += 64)
+	{
+		__m512i v[4];
+		avx512_i32_from_u8(v, _mm512_loadu_si512(src + i));
+
+		for (u32 j = 0; j < 4; ++j) {
+			v[j] = avx512_prefix_i32(v[j], carry);
+			carry = _mm512_permutexvar_epi32(v_last, v[j]);
+			_mm512_storeu_si512(p + i + j * 16 + 1, v[j]);
+		}
+	}
+
+	scalar_box_prefix_from(p, src, i, count);
+	box_prefix_end(prefix, src, count, radius);
+
+	__m512 v_scale = _mm512_set1_ps(scale);
+	u32 width = radius * 2 + 1;
+
+	for (i = 0; i < count; i += 64)
+	{
+		__mmask64 mask = avx512_tail_mask(count - i);
+
+		for (u32 j = 0; j < 4; ++j) {
+			__mmask16 lanes = (__mmask16)(mask >> (j * 16));
+			if (lanes == 0) break;
+
+			__m512i head = _mm512_maskz_loadu_epi32(lanes, prefix + i + j * 16 + width);
+			__m512i tail = _mm512_maskz_loadu_epi32(lanes, prefix + i + j * 16);
+			__m512i res = _mm512_cvtps_epi32(_mm512_mul_ps(_mm512_cvtepi32_ps(_mm512_sub_epi32(head, tail)), v_scale));
+			_mm512_mask_cvtusepi32_storeu_epi8(dst + i + j * 16, lanes, res);
+		}
+	}
+}
+
+internal_fn void avx512_row_sobel_magnitude(u8* dst, const u8* top, const u8* mid, const u8* bot, u32 count, SobelMagnitude magnitude, u32 threshold)
+{
+	__m512i v_scale = _mm512_set1_epi16((i16)SOBEL_L1_SCALE);
+	__m512i v_threshold = _mm512_set1_epi8((char)threshold);
+
+	for (u32 x = 0; x < count; x += 64)
+	{
+		__mmask64 mask = avx512_tail_mask(count - x);
+
+		__m512i lt[2], ct[2], rt[2], lc[2], rc[2], lb[2], cb[2], rb[2];
+		avx512_i16_from_u8(lt, _mm512_maskz_loadu_epi8(mask, top + x - 1));
+		avx512_i16_from_u8(ct, _mm512_maskz_loadu_epi8(mask, top + x));
+		avx512_i16_from_u8(rt, _mm512_maskz_loadu_epi8(mask, top + x + 1));
+		avx512_i16_from_u8(lc, _mm512_maskz_loadu_epi8(mask, mid + x - 1));
+		avx512_i16_from_u8(rc, _mm512_maskz_loadu_epi8(mask, mid + x + 1));
+		avx512_i16_from_u8(lb, _mm512_maskz_loadu_epi8(mask, bot + x - 1));
+		avx512_i16_from_u8(cb, _mm512_maskz_loadu_epi8(mask, bot + x));
+		avx512_i16_from_u8(rb, _mm512_maskz_loadu_epi8(mask, bot + x + 1));
+
+		__m512i res[2];
+
+		for (u32 i = 0; i < 2; ++i)
+		{
+			__m512i right = _mm512_add_epi16(_mm512_add_epi16(rt[i], rb[i]), _mm512_slli_epi16(rc[i], 1));
+			__m512i left = _mm512_add_epi16(_mm512_add_epi16(lt[i], lb[i]), _mm512_slli_epi16(lc[i], 1));
+			__m512i ax = _mm512_abs_epi16(_mm512_sub_epi16(right, left));
+
+			__m512i bottom = _mm512_add_epi16(_mm512_add_epi16(lb[i], rb[i]), _mm512_slli_epi16(cb[i], 1));
+			__m512i upper = _mm512_add_epi16(_mm512_add_epi16(lt[i], rt[i]), _mm512_slli_epi16(ct[i], 1));
+			__m512i ay = _mm512_abs_epi16(_mm512_sub_epi16(bottom, upper));
+
+			if (magnitude == SobelMagnitude_L1) {
+				res[i] = _mm512_mulhi_epu16(_mm512_add_epi16(ax, ay), v_scale);
+			}
+			else {
+				__m512i max = _mm512_max_epi16(ax, ay);
+				__m512i min = _mm512_min_epi16(ax, ay);
+				__m512i min3 = _mm512_add_epi16(min, _mm512_add_epi16(min, min));
+				res[i] = _mm512_add_epi16(max, _mm512_srli_epi16(min3, 3));
+			}
+		}
+
+		__m512i bytes = avx512_u8_from_i16(res);
+		if (threshold != ROW_THRESHOLD_NONE) bytes = avx512_threshold_u8(bytes, v_threshold);
+		_mm512_mask_storeu_epi8(dst + x, mask, bytes);
+	}
+}
+
+SIMD_TARGET_END
+
+//- Dispatch
+
+void row_kernels_initialize(SimdLevel level)
+{
+	RowKernels k = {};
+	k.level = level;
+
+	k.gray_from_rgba8 = scalar_row_gray_from_rgba8;
+	k.gray_from_rgb8 = scalar_row_gray_from_rgb8;
+	k.mult = scalar_row_mult;
+	k.blend = scalar_row_blend;
+	k.threshold = scalar_row_threshold;
+	k.kernel = scalar_row_kernel;
+	k.sobel_magnitude = scalar_row_sobel_magnitude;
+	k.box_sum = scalar_row_box_sum;
+	k.box_blur = scalar_row_box_blur;
+
+	if (level >= SimdLevel_SSE41) {
+		k.gray_from_rgba8 = sse128_row_gray_from_rgba8;
+		k.gray_from_rgb8 = sse128_row_gray_from_rgb8;
+		k.mult = sse128_row_mult;
+		k.blend = sse128_row_blend;
+		k.threshold = sse128_row_threshold;
+		k.kernel = sse128_row_kernel;
+		k.sobel_magnitude = sse128_row_sobel_magnitude;
+		k.box_sum = sse128_row_box_sum;
+		k.box_blur = sse128_row_box_blur;
+	}
+
+	if (level >= SimdLevel_AVX2) {
+		k.gray_from_rgba8 = avx256_row_gray_from_rgba8;
+		k.gray_from_rgb8 = avx256_row_gray_from_rgb8;
+		k.mult = avx256_row_mult;
+		k.blend = avx256_row_blend;
+		k.threshold = avx256_row_threshold;
+		k.kernel = avx256_row_kernel;
+		k.sobel_magnitude = avx256_row_sobel_magnitude;
+		k.box_sum = avx256_row_box_sum;
+		k.box_blur = avx256_row_box_blur;
+	}
+
+	// The gray conversion keeps the AVX2 version
+	if (level >= SimdLevel_AVX512BW) {
+		k.mult = avx512_row_mult;
+		k.blend = avx512_row_blend;
+		k.threshold = avx512_row_threshold;
+		k.kernel = avx512_row_kernel;
+		k.sobel_magnitude = avx512_row_sobel_magnitude;
+		k.box_sum = avx512_row_box_sum;
+		k.box_blur = avx512_row_box_blur;
+	}
+
+	row_kernels = k;
+}
+
+static const char* simd_level_names[SimdLevel_Count] = { "scalar", "sse41", "avx2", "avx512" };
+
+const char* simd_level_get_name(SimdLevel level)
+{
+	if (level >= SimdLevel_Count) return "unknown";
+	return simd_level_names[level];
+}
+
+SimdLevel simd_level_from_name(const char* name)
+{
+	for (u32 i = 0; i < SimdLevel_Count; ++i) {
+		if (strcmp(name, simd_level_names[i]) == 0) return (SimdLevel)i;
+	}
+	return SimdLevel_Count;
+}
+
+u32 simd_level_get_granularity(SimdLevel level)
+{
+	if (level == SimdLevel_AVX512BW) return 64;
+	if (level == SimdLevel_AVX2) return 32;
+	if (level == SimdLevel_SSE41) return 16;
+	return 8;
+}
+
+SimdLevel simd_level_select(SimdLevel supported)
+{
+	// SOBEL_SIMD=scalar|sse41|avx2|avx512 forces a level, never above the supported one
+	const char* forced = getenv("SOBEL_SIMD");
+	if (forced == NULL) return supported;
+
+	SimdLevel level = simd_level_from_name(forced);
+
+	if (level == SimdLevel_Count) {
+		printf("Unknown SOBEL_SIMD level '%s', using %s\n", forced, simd_level_get_name(supported));
+		return supported;
+	}
+
+	if (level > supported) {
+		printf("SOBEL_SIMD level '%s' is not supported by this CPU, using %s\n", forced, simd_level_get_name(supported));
+		return supported;
+	}
+
+	return level;
+}
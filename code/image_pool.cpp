@@ -0,0 +1,239 @@
+#include "inc.h"
+
+// Image buffers are recycled by size class instead of going back to the OS. Classes are split in
+// four steps per power of two, so a buffer wastes at most 25% of its size.
+
+#define IMAGE_POOL_MIN_OCTAVE 12 // 4KB
+#define IMAGE_POOL_STEPS_PER_OCTAVE 4
+#define IMAGE_POOL_CLASS_COUNT (32 * IMAGE_POOL_STEPS_PER_OCTAVE)
+
+// Free buffers above this size are released to the OS
+#define IMAGE_POOL_MAX_CACHED_BYTES GB(1)
+
+// Mixed allocations under this size go to the heap, with a header of the same layout
+#define IMAGE_POOL_MIXED_MIN_SIZE KB(64)
+#define IMAGE_POOL_HEAP_CLASS 0xFFFFFFFFu
+
+// Lives right before the user memory, keeps it aligned to a cache line
+struct ImagePoolHeader
+{
+	ImagePoolHeader* next;
+	u64 class_size;
+	u32 class_index;
+	u8 _padding[44];
+};
+
+static_assert(sizeof(ImagePoolHeader) == 64);
+
+struct ImagePoolState
+{
+	volatile u32 lock;
+	ImagePoolHeader* free_lists[IMAGE_POOL_CLASS_COUNT];
+	u64 cached_bytes;
+	ImagePoolStats stats;
+};
+
+static ImagePoolState image_pool;
+
+internal_fn void image_pool_lock()
+{
+	while (interlock_exchange_u32(&image_pool.lock, 0, 1) != 0) _mm_pause();
+}
+
+internal_fn void image_pool_unlock()
+{
+	cpu_write_barrier();
+	image_pool.lock = 0;
+}
+
+internal_fn u32 image_pool_class_from_size(u64 size, u64* class_size)
+{
+	size = MAX(size, 1ULL << IMAGE_POOL_MIN_OCTAVE);
+
+	// 'size' is in (2^octave, 2^(octave + 1)]
+	u32 octave = IMAGE_POOL_MIN_OCTAVE - 1;
+	while ((1ULL << (octave + 1)) < size) octave++;
+
+	u64 step = (1ULL << octave) / IMAGE_POOL_STEPS_PER_OCTAVE;
+	u64 step_count = u64_divide_high(size, step);
+
+	*class_size = step_count * step;
+	return (octave - (IMAGE_POOL_MIN_OCTAVE - 1)) * IMAGE_POOL_STEPS_PER_OCTAVE + (u32)(step_count - IMAGE_POOL_STEPS_PER_OCTAVE - 1);
+}
+
+void* image_pool_acquire(u64 size)
+{
+	u64 class_size;
+	u32 class_index = image_pool_class_from_size(size + sizeof(ImagePoolHeader), &class_size);
+
+	if (class_index >= IMAGE_POOL_CLASS_COUNT) {
+		assert(0);
+		return NULL;
+	}
+
+	image_pool_lock();
+
+	ImagePoolHeader* header = image_pool.free_lists[class_index];
+
+	if (header != NULL) {
+		image_pool.free_lists[class_index] = header->next;
+		image_pool.cached_bytes -= class_size;
+		image_pool.stats.hit_count++;
+	}
+
+	image_pool.stats.acquire_count++;
+	image_pool.stats.in_use_bytes += class_size;
+
+	image_pool_unlock();
+
+	if (header == NULL)
+	{
+		header = (ImagePoolHeader*)os_allocate_image_memory(class_size, 1);
+
+		if (header == NULL) {
+			image_pool_lock();
+			image_pool.stats.in_use_bytes -= class_size;
+			image_pool_unlock();
+			return NULL;
+		}
+
+		// Fault the pages in now, the buffer is reused without touching the OS again
+		u8* bytes = (u8*)header;
+		for (u64 i = 0; i < class_size; i += app.os.page_size) bytes[i] = 0;
+
+		header->class_size = class_size;
+		header->class_index = class_index;
+
+		image_pool_lock();
+		image_pool.stats.resident_bytes += class_size;
+		image_pool.stats.peak_resident_bytes = MAX(image_pool.stats.peak_resident_bytes, image_pool.stats.resident_bytes);
+		image_pool_unlock();
+	}
+
+	header->next = NULL;
+	return header + 1;
+}
+
+void image_pool_release(void* ptr)
+{
+	if (ptr == NULL) return;
+
+	ImagePoolHeader* header = (ImagePoolHeader*)ptr - 1;
+	u64 class_size = header->class_size;
+
+	image_pool_lock();
+
+	image_pool.stats.in_use_bytes -= class_size;
+
+	b32 cache = image_pool.cached_bytes + class_size <= IMAGE_POOL_MAX_CACHED_BYTES;
+
+	if (cache) {
+		header->next = image_pool.free_lists[header->class_index];
+		image_pool.free_lists[header->class_index] = header;
+		image_pool.cached_bytes += class_size;
+	}
+	else {
+		image_pool.stats.resident_bytes -= class_size;
+	}
+
+	image_pool_unlock();
+
+	if (!cache) os_free_image_memory(header);
+}
+
+u64 image_pool_get_capacity(void* ptr)
+{
+	ImagePoolHeader* header = (ImagePoolHeader*)ptr - 1;
+	return header->class_size - sizeof(ImagePoolHeader);
+}
+
+// Keeps the buffer while it fits in its size class
+void* image_pool_reallocate(void* ptr, u64 size)
+{
+	if (ptr == NULL) return image_pool_acquire(size);
+
+	u64 capacity = image_pool_get_capacity(ptr);
+	if (capacity >= size) return ptr;
+
+	void* new_ptr = image_pool_acquire(size);
+	if (new_ptr == NULL) return NULL;
+
+	memory_copy(new_ptr, ptr, capacity);
+	image_pool_release(ptr);
+	return new_ptr;
+}
+
+// Third party code mixes small scratch with image sized buffers. The scratch goes to the heap, it
+// doesn't take the pool lock, isn't rounded to a class nor faulted in, and stays out of the stats.
+void* image_pool_acquire_mixed(u64 size)
+{
+	if (size >= IMAGE_POOL_MIXED_MIN_SIZE) return image_pool_acquire(size);
+
+	ImagePoolHeader* header = (ImagePoolHeader*)memory_allocate(sizeof(ImagePoolHeader) + size);
+	if (header == NULL) return NULL;
+
+	header->next = NULL;
+	header->class_size = sizeof(ImagePoolHeader) + size;
+	header->class_index = IMAGE_POOL_HEAP_CLASS;
+	return header + 1;
+}
+
+void image_pool_release_mixed(void* ptr)
+{
+	if (ptr == NULL) return;
+
+	if (!image_pool_is_pooled(ptr)) memory_free((ImagePoolHeader*)ptr - 1);
+	else image_pool_release(ptr);
+}
+
+void* image_pool_reallocate_mixed(void* ptr, u64 size)
+{
+	if (ptr == NULL) return image_pool_acquire_mixed(size);
+
+	u64 capacity = image_pool_get_capacity(ptr);
+	if (capacity >= size) return ptr;
+
+	void* new_ptr = image_pool_acquire_mixed(size);
+	if (new_ptr == NULL) return NULL;
+
+	memory_copy(new_ptr, ptr, capacity);
+	image_pool_release_mixed(ptr);
+	return new_ptr;
+}
+
+b32 image_pool_is_pooled(void* ptr)
+{
+	ImagePoolHeader* header = (ImagePoolHeader*)ptr - 1;
+	return header->class_index != IMAGE_POOL_HEAP_CLASS;
+}
+
+void image_pool_trim()
+{
+	image_pool_lock();
+
+	for (u32 i = 0; i < IMAGE_POOL_CLASS_COUNT; ++i)
+	{
+		ImagePoolHeader* header = image_pool.free_lists[i];
+
+		while (header != NULL) {
+			ImagePoolHeader* next = header->next;
+			image_pool.stats.resident_bytes -= header->class_size;
+			os_free_image_memory(header);
+			header = next;
+		}
+
+		image_pool.free_lists[i] = NULL;
+	}
+
+	image_pool.cached_bytes = 0;
+
+	image_pool_unlock();
+}
+
+ImagePoolStats image_pool_get_stats()
+{
+	image_pool_lock();
+	ImagePoolStats stats = image_pool.stats;
+	image_pool_unlock();
+	return stats;
+}
@@ -15,88 +15,258 @@ u32 image_format_get_number_of_channels(ImageFormat format)
 	return 1;
 }
 
-u32 image_calculate_size(Image image) {
-	return image.width * image.height * image_format_get_pixel_stride(image.format);
+// Size of the rows, without the apron above and below
+u64 image_calculate_size(Image image) {
+	return (u64)image.stride * image.height;
 }
 
-Image image_alloc(u32 width, u32 height, ImageFormat format)
+// Bytes from the start of the memory to the first pixel. The left apron is rounded up so the rows
+// inside the apron are aligned too.
+internal_fn u64 image_apron_offset(u32 apron, u32 stride, u32 pixel_stride)
+{
+	u64 left = u64_divide_high((u64)apron * pixel_stride, IMAGE_ROW_ALIGNMENT) * IMAGE_ROW_ALIGNMENT;
+	return left + (u64)apron * stride;
+}
+
+Image image_alloc_with_apron(u32 width, u32 height, ImageFormat format, u32 apron, ImageBorder border)
 {
+	u32 pixel_stride = image_format_get_pixel_stride(format);
+
+	// The right apron of a row and the left apron of the next one share the space between them
+	u32 stride = u32_divide_high((width + apron * 2) * pixel_stride, IMAGE_ROW_ALIGNMENT) * IMAGE_ROW_ALIGNMENT;
+	u64 offset = image_apron_offset(apron, stride, pixel_stride);
+	u64 size = offset + (u64)stride * (height + apron) + app.os.pixels_padding;
+
+	u8* memory = (u8*)image_pool_acquire(size);
+
 	Image img = {};
 	img.width = width;
 	img.height = height;
-	img._data = (u8*)os_allocate_image_memory(width * height, image_format_get_pixel_stride(format));
+	img.stride = stride;
+	img.apron = apron;
+	img.border = border;
+	img._data = memory + offset;
 	img.format = format;
 
 	return img;
 }
 
+Image image_alloc(u32 width, u32 height, ImageFormat format)
+{
+	return image_alloc_with_apron(width, height, format, 0, ImageBorder_Replicate);
+}
+
 void image_free(Image image)
 {
 	if (image_is_invalid(image)) return;
-	os_free_image_memory(image._data);
+	u8* memory = (u8*)image._data - image_apron_offset(image.apron, image.stride, image_format_get_pixel_stride(image.format));
+	image_pool_release(memory);
+}
+
+inline_fn i32 image_border_index(i32 i, i32 count, ImageBorder border)
+{
+	if (border == ImageBorder_Mirror) {
+		if (i < 0) i = -i;
+		if (i >= count) i = (count - 1) * 2 - i;
+	}
+	return MAX(MIN(i, count - 1), 0);
+}
+
+void image_update_apron(Image image)
+{
+	if (image.apron == 0 || image.width == 0 || image.height == 0) return;
+
+	i32 apron = (i32)image.apron;
+	i32 width = (i32)image.width;
+	i32 height = (i32)image.height;
+	u32 pixel_stride = image_format_get_pixel_stride(image.format);
+
+	for (i32 y = 0; y < height; ++y)
+	{
+		u8* row = image_get_row(image, y);
+
+		for (i32 x = 1; x <= apron; ++x)
+		{
+			i32 left = image_border_index(-x, width, image.border);
+			i32 right = image_border_index(width - 1 + x, width, image.border);
+			memory_copy(row - x * pixel_stride, row + left * pixel_stride, pixel_stride);
+			memory_copy(row + (width - 1 + x) * pixel_stride, row + right * pixel_stride, pixel_stride);
+		}
+	}
+
+	// Rows above and below, including their left and right apron
+	u64 row_size = (u64)(width + apron * 2) * pixel_stride;
+	u64 row_offset = (u64)apron * pixel_stride;
+
+	for (i32 y = 1; y <= apron; ++y)
+	{
+		i32 top = image_border_index(-y, height, image.border);
+		i32 bottom = image_border_index(height - 1 + y, height, image.border);
+		memory_copy(image_get_row(image, -y) - row_offset, image_get_row(image, top) - row_offset, row_size);
+		memory_copy(image_get_row(image, height - 1 + y) - row_offset, image_get_row(image, bottom) - row_offset, row_size);
+	}
+}
+
+// Row kernels
+// Each one writes 'count' pixels. Neighbourhood kernels also read the pixels around the source
+// pointers, the caller must keep those reads inside the image.
+
+struct Kernel3x3Indices {
+	i32 lt;
+	i32 ct;
+	i32 rt;
+	i32 lc;
+	i32 cc;
+	i32 rc;
+	i32 lb;
+	i32 cb;
+	i32 rb;
+};
+
+internal_fn Kernel3x3Indices kernel3x3_from_image(Image kernel)
+{
+	Array<i8> buffer = image_get_data<i8>(kernel);
+
+	Kernel3x3Indices k;
+	k.lt = buffer[IMG_INDEX(kernel, 0, 0)];
+	k.ct = buffer[IMG_INDEX(kernel, 1, 0)];
+	k.rt = buffer[IMG_INDEX(kernel, 2, 0)];
+	k.lc = buffer[IMG_INDEX(kernel, 0, 1)];
+	k.cc = buffer[IMG_INDEX(kernel, 1, 1)];
+	k.rc = buffer[IMG_INDEX(kernel, 2, 1)];
+	k.lb = buffer[IMG_INDEX(kernel, 0, 2)];
+	k.cb = buffer[IMG_INDEX(kernel, 1, 2)];
+	k.rb = buffer[IMG_INDEX(kernel, 2, 2)];
+	return k;
+}
+
+static const SeparableKernel gaussian5_kernel = { 5, 16, { 1, 4, 6, 4, 1 } };
+
+// Largest power of two scale that keeps the coefficients in i16, the row kernels run them in 16 bit lanes
+#define SEPARABLE_KERNEL_MAX_SHIFT 14
+
+SeparableKernel separable_kernel_from_f32(const f32* coefficients, u32 tap_count)
+{
+	SeparableKernel k = {};
+
+	if (tap_count % 2 == 0 || tap_count > SEPARABLE_KERNEL_MAX_TAPS) {
+		assert(0);
+		return k;
+	}
+
+	f32 max = 0.f;
+	for (u32 i = 0; i < tap_count; ++i) max = MAX(max, ABS(coefficients[i]));
+
+	u32 shift = SEPARABLE_KERNEL_MAX_SHIFT;
+	while (shift > 0 && max * (f32)(1u << shift) > (f32)INT16_MAX) shift--;
+
+	k.tap_count = tap_count;
+	k.normalize_factor = 1u << shift;
+
+	for (u32 i = 0; i < tap_count; ++i) {
+		k.coefficients[i] = (i32)roundf(coefficients[i] * (f32)k.normalize_factor);
+	}
+
+	return k;
+}
+
+SeparableKernel separable_kernel_gaussian(f32 sigma)
+{
+	sigma = MAX(sigma, 0.1f);
+
+	i32 radius = (i32)ceilf(sigma * 3.f);
+	radius = MIN(MAX(radius, 1), SEPARABLE_KERNEL_MAX_TAPS / 2);
+
+	f32 weights[SEPARABLE_KERNEL_MAX_TAPS];
+	f32 total = 0.f;
+
+	for (i32 i = -radius; i <= radius; ++i) {
+		weights[i + radius] = expf(-(f32)(i * i) / (2.f * sigma * sigma));
+		total += weights[i + radius];
+	}
+
+	for (i32 i = 0; i <= radius * 2; ++i) weights[i] /= total;
+
+	SeparableKernel k = separable_kernel_from_f32(weights, radius * 2 + 1);
+
+	// The rounding error goes to the center, so a flat image keeps its value
+	i32 sum = 0;
+	for (u32 i = 0; i < k.tap_count; ++i) sum += k.coefficients[i];
+	k.coefficients[radius] += (i32)k.normalize_factor - sum;
+
+	return k;
+}
+
+// The row kernels come from the table of the SIMD level, see image_kernels.cpp
+
+internal_fn void row_kernel3x3(u8* dst, const u8* top, const u8* mid, const u8* bot, u32 count, Kernel3x3Indices k, u32 normalize_factor)
+{
+	const u8* sources[9] = { top - 1, top, top + 1, mid - 1, mid, mid + 1, bot - 1, bot, bot + 1 };
+	row_kernels.kernel(dst, sources, (const i32*)&k, 9, count, normalize_factor);
+}
+
+internal_fn void row_kernel_horizontal(u8* dst, const u8* src, u32 count, const SeparableKernel* k)
+{
+	i32 radius = (i32)k->tap_count / 2;
+
+	const u8* sources[SEPARABLE_KERNEL_MAX_TAPS];
+	for (i32 t = 0; t < (i32)k->tap_count; ++t) sources[t] = src + t - radius;
+
+	row_kernels.kernel(dst, sources, k->coefficients, k->tap_count, count, k->normalize_factor);
+}
+
+// 'rows' are the source rows centered on the destination row, one per tap
+internal_fn void row_kernel_vertical(u8* dst, const u8* const* rows, u32 count, const SeparableKernel* k)
+{
+	row_kernels.kernel(dst, rows, k->coefficients, k->tap_count, count, k->normalize_factor);
+}
+
+// The threshold of the row kernels, pixels above it are set
+internal_fn u8 threshold_get_u8(f32 threshold) {
+	return (u8)(f32_clamp01(threshold) * 255.f);
 }
 
 // Common image operations with same dimensions
 struct ImageOp_Task {
 	Image dst, src0, src1;
-	u32 width;
-	u32 height;
-	u32 write_count;
 	u32 mode; // 0 -> copy; 1 -> mult; 2 -> blend; 3 -> threshold
 	union {
 		f32 mult;
 		f32 blend_factor;
 		f32 threshold;
 	};
+	u32 blend_threshold; // ROW_THRESHOLD_NONE or applied by the blend
 };
 
-internal_fn void image_op_task(u32 index, void* _data)
+internal_fn void image_op_task(u32 row_begin, u32 row_end, void* _data)
 {
 	ImageOp_Task* data = (ImageOp_Task*)_data;
 
-	u32 total_pixel_count = data->width * data->height;
-	u32 pixel_offset = index * data->write_count;
-	u32 end_pixel = MIN(pixel_offset + data->write_count, total_pixel_count);
+	Image dst = data->dst;
+	u32 count = dst.width;
 
 	// Image Copy
 	if (data->mode == 0)
 	{
 		Image src = data->src0;
-		Image dst = data->dst;
 
 		u32 src_pixel_stride = image_format_get_pixel_stride(src.format);
-		u32 dst_pixel_stride = image_format_get_pixel_stride(dst.format);
 
 		if (dst.format == src.format)
 		{
-			u8* dst_ptr = (u8*)dst._data + pixel_offset * dst_pixel_stride;
-			u8* src_ptr = (u8*)src._data + pixel_offset * src_pixel_stride;
-			u32 copy_size = (end_pixel - pixel_offset) * src_pixel_stride;
-
-			memory_copy(dst_ptr, src_ptr, copy_size);
+			for (u32 y = row_begin; y < row_end; ++y) memory_copy(image_get_row(dst, y), image_get_row(src, y), count * src_pixel_stride);
 			return;
 		}
 
 		if (dst.format == ImageFormat_I8 && src.format == ImageFormat_RGBA8)
 		{
-			Array<u8> s = image_get_data<u8>(src);
-			Array<u8> d = image_get_data<u8>(dst);
-
-			for (u32 i = pixel_offset; i < end_pixel; ++i)
-			{
-				u32 src_offset = i * src_pixel_stride;
-				u32 dst_offset = i * dst_pixel_stride;
-
-				f32 r = s[src_offset + 0] * (1.f / 255.f) * 0.299f;
-				f32 g = s[src_offset + 1] * (1.f / 255.f) * 0.587f;
-				f32 b = s[src_offset + 2] * (1.f / 255.f) * 0.114f;
-				f32 a = s[src_offset + 3] * (1.f / 255.f);
-
-				f32 v = f32_clamp01((r + g + b) * a);
-
-				d[dst_offset] = (u8)(v * 255.f);
-			}
+			for (u32 y = row_begin; y < row_end; ++y) row_kernels.gray_from_rgba8(image_get_row(dst, y), image_get_row(src, y), count);
+			return;
+		}
 
+		if (dst.format == ImageFormat_I8 && src.format == ImageFormat_RGB8)
+		{
+			for (u32 y = row_begin; y < row_end; ++y) row_kernels.gray_from_rgb8(image_get_row(dst, y), image_get_row(src, y), count);
 			return;
 		}
 
@@ -107,47 +277,15 @@ internal_fn void image_op_task(u32 index, void* _data)
 	// Image Mult
 	else if (data->mode == 1)
 	{
-		Image dst = data->dst;
-
 		if (dst.format != ImageFormat_I8) {
 			assert(0);
 			return;
 		}
 
-		Array<u8> d = image_get_data<u8>(dst);
-
-		u32 simd_step = app.os.simd_granularity;
-
-		__m256 v_mult = _mm256_set1_ps(data->mult);
-		__m256 v_255  = _mm256_set1_ps(255.0f);
-		__m256 v_zero = _mm256_set1_ps(0.0f);
-
-		for (u32 i = pixel_offset; i < end_pixel; i += simd_step)
-		{
-			u8* ptr = &d[i];
-			assert((u64)ptr % simd_step == 0);
-			__m256i bytes = _mm256_load_si256((__m256i*)ptr);
-
-			__m256 f[4];
-			avx256_f32_from_u8(f, bytes);
-
-			// Mult
-			f[0] = _mm256_mul_ps(f[0], v_mult);
-			f[1] = _mm256_mul_ps(f[1], v_mult);
-			f[2] = _mm256_mul_ps(f[2], v_mult);
-			f[3] = _mm256_mul_ps(f[3], v_mult);
-
-			// Clamp 0-255
-			f[0] = _mm256_min_ps(_mm256_max_ps(f[0], v_zero), v_255);
-			f[1] = _mm256_min_ps(_mm256_max_ps(f[1], v_zero), v_255);
-			f[2] = _mm256_min_ps(_mm256_max_ps(f[2], v_zero), v_255);
-			f[3] = _mm256_min_ps(_mm256_max_ps(f[3], v_zero), v_255);
-
-			bytes = avx256_u8_from_f32(f);
-
-			_mm256_store_si256((__m256i*)ptr, bytes);
+		for (u32 y = row_begin; y < row_end; ++y) {
+			u8* ptr = image_get_row(dst, y);
+			row_kernels.mult(ptr, ptr, count, data->mult);
 		}
-
 		return;
 	}
 	// Image Blend
@@ -155,57 +293,12 @@ internal_fn void image_op_task(u32 index, void* _data)
 	{
 		Image src0 = data->src0;
 		Image src1 = data->src1;
-		Image dst = data->dst;
 
 		if (src0.format == ImageFormat_I8 && src1.format == ImageFormat_I8)
 		{
-			Array<u8> s0 = image_get_data<u8>(src0);
-			Array<u8> s1 = image_get_data<u8>(src1);
-			Array<u8> d = image_get_data<u8>(dst);
-
-			u32 simd_step = app.os.simd_granularity;
-
-			__m256 v_factor0 = _mm256_set1_ps(1.f - data->blend_factor);
-			__m256 v_factor1 = _mm256_set1_ps(data->blend_factor);
-
-			for (u32 i = pixel_offset; i < end_pixel; i += simd_step)
-			{
-				u8* ptr0 = &s0[i];
-				u8* ptr1 = &s1[i];
-				u8* ptr_dst = &d[i];
-				assert((u64)ptr0% simd_step == 0);
-				assert((u64)ptr1% simd_step == 0);
-				assert((u64)ptr_dst% simd_step == 0);
-
-				__m256i bytes0 = _mm256_load_si256((__m256i*)ptr0);
-				__m256i bytes1 = _mm256_load_si256((__m256i*)ptr1);
-
-				__m256 f0[4];
-				avx256_f32_from_u8(f0, bytes0);
-
-				__m256 f1[4];
-				avx256_f32_from_u8(f1, bytes1);
-
-				f0[0] = _mm256_mul_ps(f0[0], v_factor0);
-				f0[1] = _mm256_mul_ps(f0[1], v_factor0);
-				f0[2] = _mm256_mul_ps(f0[2], v_factor0);
-				f0[3] = _mm256_mul_ps(f0[3], v_factor0);
-
-				f1[0] = _mm256_mul_ps(f1[0], v_factor1);
-				f1[1] = _mm256_mul_ps(f1[1], v_factor1);
-				f1[2] = _mm256_mul_ps(f1[2], v_factor1);
-				f1[3] = _mm256_mul_ps(f1[3], v_factor1);
-
-				__m256 f[4];
-				f[0] = _mm256_add_ps(f0[0], f1[0]);
-				f[1] = _mm256_add_ps(f0[1], f1[1]);
-				f[2] = _mm256_add_ps(f0[2], f1[2]);
-				f[3] = _mm256_add_ps(f0[3], f1[3]);
-
-				__m256i bytes = avx256_u8_from_f32(f);
-				_mm256_store_si256((__m256i*)ptr_dst, bytes);
+			for (u32 y = row_begin; y < row_end; ++y) {
+				row_kernels.blend(image_get_row(dst, y), image_get_row(src0, y), image_get_row(src1, y), count, data->blend_factor, data->blend_threshold);
 			}
-
 			return;
 		}
 
@@ -215,44 +308,40 @@ internal_fn void image_op_task(u32 index, void* _data)
 	// Image Threshold
 	else if (data->mode == 3)
 	{
-		Array<u8> s = image_get_data<u8>(data->src0);
-		Array<u8> d = image_get_data<u8>(data->dst);
-
-		u8 threshold_u8 = (u8)(f32_clamp01(data->threshold) * 255.f);
+		u8 threshold_u8 = threshold_get_u8(data->threshold);
 
-		for (u32 i = pixel_offset; i < end_pixel; i += 4) {
-			d[i + 0] = (s[i + 0] > threshold_u8) * 255;
-			d[i + 1] = (s[i + 1] > threshold_u8) * 255;
-			d[i + 2] = (s[i + 2] > threshold_u8) * 255;
-			d[i + 3] = (s[i + 3] > threshold_u8) * 255;
+		for (u32 y = row_begin; y < row_end; ++y) {
+			row_kernels.threshold(image_get_row(dst, y), image_get_row(data->src0, y), count, threshold_u8);
 		}
 	}
 }
 
+internal_fn void image_op_run(ImageOp_Task* data)
+{
+	u32 grain = MAX(app.os.min_pixels_per_task / MAX(data->dst.width, 1), 1);
+	task_parallel_for(0, data->dst.height, grain, 1, image_op_task, { data, sizeof(*data) });
+}
+
 Image image_copy(Image src, ImageFormat format)
+{
+	return image_copy_with_apron(src, format, src.apron, src.border);
+}
+
+Image image_copy_with_apron(Image src, ImageFormat format, u32 apron, ImageBorder border)
 {
 	PROFILE_SCOPE("Image Copy");
 
 	if (image_is_invalid(src)) return IMG_INVALID;
 
-	Image dst = image_alloc(src.width, src.height, format);
-
-	u32 pixel_count = src.width * src.height;
-	u32 task_count = u32_divide_high(pixel_count, app.os.pixels_per_thread);
-
-	TaskContext ctx = {};
+	Image dst = image_alloc_with_apron(src.width, src.height, format, apron, border);
 
 	ImageOp_Task data = {};
 	data.mode = 0;
-	data.width = src.width;
-	data.height = src.height;
 	data.dst = dst;
 	data.src0 = src;
 	data.src1 = IMG_INVALID;
-	data.write_count = app.os.pixels_per_thread;
 
-	task_dispatch(image_op_task, { &data, sizeof(data) }, task_count, &ctx);
-	task_wait(&ctx);
+	image_op_run(&data);
 
 	return dst;
 }
@@ -261,75 +350,14 @@ void image_mult(Image dst, f32 mult)
 {
 	PROFILE_SCOPE("Image Mult");
 
-	u32 pixel_count = dst.width * dst.height;
-	u32 task_count = u32_divide_high(pixel_count, app.os.pixels_per_thread);
-
-	TaskContext ctx = {};
-
 	ImageOp_Task data = {};
 	data.mode = 1;
 	data.mult = mult;
-	data.width = dst.width;
-	data.height = dst.height;
 	data.dst = dst;
 	data.src0 = IMG_INVALID;
 	data.src1 = IMG_INVALID;
-	data.write_count = app.os.pixels_per_thread;
 
-	task_dispatch(image_op_task, { &data, sizeof(data) }, task_count, &ctx);
-	task_wait(&ctx);
-}
-
-Image image_apply_sobel_convolution(Image src)
-{
-	PROFILE_SCOPE("Sobel Convolution");
-
-	if (src.format != ImageFormat_I8) {
-		return IMG_INVALID;
-	}
-
-	const u32 normalize_factor = 1;
-
-	Image kernel = image_alloc(3, 3, ImageFormat_I8);
-
-	Array<i8> k = image_get_data<i8>(kernel);
-	k[IMG_INDEX(kernel, 0, 0)] = -1;
-	k[IMG_INDEX(kernel, 1, 0)] = 0;
-	k[IMG_INDEX(kernel, 2, 0)] = 1;
-
-	k[IMG_INDEX(kernel, 0, 1)] = -2;
-	k[IMG_INDEX(kernel, 1, 1)] = 0;
-	k[IMG_INDEX(kernel, 2, 1)] = +2;
-
-	k[IMG_INDEX(kernel, 0, 2)] = -1;
-	k[IMG_INDEX(kernel, 1, 2)] = 0;
-	k[IMG_INDEX(kernel, 2, 2)] = 1;
-
-	Image x_axis = image_apply_1pass_kernel3x3(src, kernel, normalize_factor, false);
-	app_save_intermediate(x_axis, "x_axis_sobel");
-	DEFER(image_free(x_axis));
-
-	k = image_get_data<i8>(kernel);
-	k[IMG_INDEX(kernel, 0, 0)] = -1;
-	k[IMG_INDEX(kernel, 1, 0)] = -2;
-	k[IMG_INDEX(kernel, 2, 0)] = -1;
-
-	k[IMG_INDEX(kernel, 0, 1)] = 0;
-	k[IMG_INDEX(kernel, 1, 1)] = 0;
-	k[IMG_INDEX(kernel, 2, 1)] = 0;
-
-	k[IMG_INDEX(kernel, 0, 2)] = 1;
-	k[IMG_INDEX(kernel, 1, 2)] = 2;
-	k[IMG_INDEX(kernel, 2, 2)] = 1;
-
-	Image y_axis = image_apply_1pass_kernel3x3(src, kernel, normalize_factor, false);
-	app_save_intermediate(y_axis, "y_axis_sobel");
-	DEFER(image_free(y_axis));
-
-	Image result = image_blend(x_axis, y_axis, 0.5f);
-	app_save_intermediate(result, "raw_sobel_blend");
-	image_mult(result, 1.41f);
-	return result;
+	image_op_run(&data);
 }
 
 Image image_apply_threshold(Image src, f32 threshold)
@@ -340,25 +368,16 @@ Image image_apply_threshold(Image src, f32 threshold)
 		return IMG_INVALID;
 	}
 
-	Image dst = image_alloc(src.width, src.height, ImageFormat_I8);
-
-	u32 pixel_count = dst.width * dst.height;
-	u32 task_count = u32_divide_high(pixel_count, app.os.pixels_per_thread);
-
-	TaskContext ctx = {};
+	Image dst = image_alloc_with_apron(src.width, src.height, ImageFormat_I8, src.apron, src.border);
 
 	ImageOp_Task data = {};
 	data.mode = 3;
 	data.threshold = threshold;
-	data.width = src.width;
-	data.height = src.height;
 	data.dst = dst;
 	data.src0 = src;
 	data.src1 = IMG_INVALID;
-	data.write_count = app.os.pixels_per_thread;
 
-	task_dispatch(image_op_task, { &data, sizeof(data) }, task_count, &ctx);
-	task_wait(&ctx);
+	image_op_run(&data);
 
 	return dst;
 }
@@ -373,6 +392,7 @@ Image image_apply_gaussian_blur(Image src, BlurDistance distance)
 
 	if (distance == BlurDistance_3) {
 		Image kernel = image_alloc(3, 3, ImageFormat_I8);
+		DEFER(image_free(kernel));
 
 		Array<i8> k = image_get_data<i8>(kernel);
 		k[IMG_INDEX(kernel, 0, 0)] = 1;
@@ -391,26 +411,15 @@ Image image_apply_gaussian_blur(Image src, BlurDistance distance)
 	}
 
 	if (distance == BlurDistance_5) {
-		Image kernel = image_alloc(5, 1, ImageFormat_I8);
-
-		Array<i8> k = image_get_data<i8>(kernel);
-		k[0] = 1;
-		k[1] = 4;
-		k[2] = 6;
-		k[3] = 4;
-		k[4] = 1;
-
-		return image_apply_2pass_kernel5x5(src, kernel, 16);
+		return image_apply_separable_kernel(src, gaussian5_kernel);
 	}
 
 	assert(0);
 	return IMG_INVALID;
 }
 
-Image image_blend(Image src0, Image src1, f32 factor)
+internal_fn Image image_blend_internal(Image src0, Image src1, f32 factor, u32 threshold)
 {
-	PROFILE_SCOPE("Blend");
-
 	if (src0.width != src1.width || src0.height != src1.height) {
 		assert(0);
 		return IMG_INVALID;
@@ -421,181 +430,138 @@ Image image_blend(Image src0, Image src1, f32 factor)
 		return IMG_INVALID;
 	}
 
-	Image dst = image_alloc(src0.width, src0.height, src0.format);
-
-	u32 pixel_count = dst.width * dst.height;
-	u32 task_count = u32_divide_high(pixel_count, app.os.pixels_per_thread);
-
-	TaskContext ctx = {};
+	Image dst = image_alloc_with_apron(src0.width, src0.height, src0.format, src0.apron, src0.border);
 
 	ImageOp_Task data = {};
 	data.mode = 2;
 	data.blend_factor = factor;
-	data.width = dst.width;
-	data.height = dst.height;
+	data.blend_threshold = threshold;
 	data.dst = dst;
 	data.src0 = src0;
 	data.src1 = src1;
-	data.write_count = app.os.pixels_per_thread;
 
-	task_dispatch(image_op_task, { &data, sizeof(data) }, task_count, &ctx);
-	task_wait(&ctx);
+	image_op_run(&data);
 
 	return dst;
 }
 
-struct Kernel3x3Indices {
-	i32 lt;
-	i32 ct;
-	i32 rt;
-	i32 lc;
-	i32 cc;
-	i32 rc;
-	i32 lb;
-	i32 cb;
-	i32 rb;
-};
-
-inline_fn i32 sample_1pass_kernel3x3(Array<u8> s, i32 base, Kernel3x3Indices off, Kernel3x3Indices k, u32 normalize_factor)
+Image image_blend(Image src0, Image src1, f32 factor)
 {
-	i32 lt = (i32)s[base + off.lt] * k.lt;
-	i32 ct = (i32)s[base + off.ct] * k.ct;
-	i32 rt = (i32)s[base + off.rt] * k.rt;
-	i32 lc = (i32)s[base + off.lc] * k.lc;
-	i32 cc = (i32)s[base + off.cc] * k.cc;
-	i32 rc = (i32)s[base + off.rc] * k.rc;
-	i32 lb = (i32)s[base + off.lb] * k.lb;
-	i32 cb = (i32)s[base + off.cb] * k.cb;
-	i32 rb = (i32)s[base + off.rb] * k.rb;
-
-	i32 res = lt + ct + rt + lc + cc + rc + lb + cb + rb;
-	res /= (i32)normalize_factor;
-	return MIN(ABS(res), 255);
+	PROFILE_SCOPE("Blend");
+	return image_blend_internal(src0, src1, factor, ROW_THRESHOLD_NONE);
 }
 
-struct Kernel5Indices {
-	i32 v[5];
-};
-
-inline_fn i32 sample_2pass_kernel5x5(Array<u8> s, i32 base, Kernel5Indices off, Kernel5Indices k, u32 normalize_factor)
+Image image_blend_threshold(Image src0, Image src1, f32 factor, f32 threshold)
 {
-	i32 vl1 = (i32)s[base + off.v[0]] * k.v[0];
-	i32 vl0 = (i32)s[base + off.v[1]] * k.v[1];
-	i32 vc = (i32)s[base + off.v[2]] * k.v[2];
-	i32 vr0 = (i32)s[base + off.v[3]] * k.v[3];
-	i32 vr1 = (i32)s[base + off.v[4]] * k.v[4];
-
-	i32 res = vl1 + vl0 + vc + vr0 + vr1;
-	res /= (i32)normalize_factor;
-	return MIN(ABS(res), 255);
+	PROFILE_SCOPE("Blend Threshold");
+	return image_blend_internal(src0, src1, factor, threshold_get_u8(threshold));
 }
 
+// Bytes of the rows of a column strip in the vertical pass, all the rows of a strip fit in L1
+#define KERNEL_STRIP_SIZE KB(10)
+
 struct ImageApplyKernel_Task {
 	Image dst, src, kernel;
-	u32 write_count;
-	u32 mode; // 0 -> 3x3; 1 -> h5; 2 -> v5
+	const SeparableKernel* separable; // Horizontal and vertical passes, owned by the caller
+	u32 x_begin; // Columns written in each row
+	u32 x_end;
+	u32 mode; // 0 -> 3x3; 1 -> horizontal; 2 -> vertical; 3 -> sobel
 	u32 normalize_factor;
+	SobelMagnitude magnitude;
+	u32 threshold; // ROW_THRESHOLD_NONE or applied by the sobel
 };
 
-internal_fn void image_apply_kernel_task(u32 index, void* _data)
+internal_fn void image_apply_kernel_task(u32 row_begin, u32 row_end, void* _data)
 {
 	ImageApplyKernel_Task* data = (ImageApplyKernel_Task*)_data;
 
 	Image src = data->src;
 	Image dst = data->dst;
 
-	u32 border_size = (data->mode == 0) ? 1 : 2;
-
-	u32 pixel_offset = index * data->write_count;
-	pixel_offset += border_size + border_size * src.width;
-
-	u32 total_pixel_count = (src.width - (border_size * 2)) * (src.height - (border_size * 2));
-	u32 end_pixel = MIN(pixel_offset + data->write_count, total_pixel_count);
-
-	Array<u8> s = image_get_data<u8>(src);
-	Array<u8> d = image_get_data<u8>(dst);
+	u32 x_begin = data->x_begin;
+	u32 count = data->x_end - data->x_begin;
 
 	if (data->mode == 0)
 	{
-		Kernel3x3Indices k;
+		Kernel3x3Indices k = kernel3x3_from_image(data->kernel);
+
+		for (u32 y = row_begin; y < row_end; ++y)
 		{
-			u32 w = data->kernel.width;
-			Array<i8> buffer = image_get_data<i8>(data->kernel);
-			k.lt = buffer[0 + 0 * w];
-			k.ct = buffer[1 + 0 * w];
-			k.rt = buffer[2 + 0 * w];
-			k.lc = buffer[0 + 1 * w];
-			k.cc = buffer[1 + 1 * w];
-			k.rc = buffer[2 + 1 * w];
-			k.lb = buffer[0 + 2 * w];
-			k.cb = buffer[1 + 2 * w];
-			k.rb = buffer[2 + 2 * w];
+			u8* d = image_get_row(dst, y);
+			u8* top = image_get_row(src, y - 1);
+			u8* mid = image_get_row(src, y);
+			u8* bot = image_get_row(src, y + 1);
+			row_kernel3x3(d + x_begin, top + x_begin, mid + x_begin, bot + x_begin, count, k, data->normalize_factor);
 		}
-
-		Kernel3x3Indices off;
-		off.lt = IMG_INDEX(src, -1, -1);
-		off.ct = IMG_INDEX(src, +0, -1);
-		off.rt = IMG_INDEX(src, +1, -1);
-		off.lc = IMG_INDEX(src, -1, +0);
-		off.cc = IMG_INDEX(src, +0, +0);
-		off.rc = IMG_INDEX(src, +1, +0);
-		off.lb = IMG_INDEX(src, -1, +1);
-		off.cb = IMG_INDEX(src, +0, +1);
-		off.rb = IMG_INDEX(src, +1, +1);
-
-		for (u32 base = pixel_offset; base < end_pixel; ++base) {
-			u32 x = base % src.width;
-			b32 not_in_border = x != 0 && x != src.width - 1;
-			d[base] = not_in_border ? sample_1pass_kernel3x3(s, base, off, k, data->normalize_factor) : d[base];
+	}
+	else if (data->mode == 1)
+	{
+		for (u32 y = row_begin; y < row_end; ++y)
+		{
+			u8* d = image_get_row(dst, y);
+			u8* s = image_get_row(src, y);
+			row_kernel_horizontal(d + x_begin, s + x_begin, count, data->separable);
 		}
 	}
-	else if (data->mode == 1 || data->mode == 2)
+	else if (data->mode == 3)
 	{
-		Kernel5Indices k;
+		for (u32 y = row_begin; y < row_end; ++y)
 		{
-			Array<i8> buffer = image_get_data<i8>(data->kernel);
-			k.v[0] = buffer[0];
-			k.v[1] = buffer[1];
-			k.v[2] = buffer[2];
-			k.v[3] = buffer[3];
-			k.v[4] = buffer[4];
+			u8* d = image_get_row(dst, y);
+			u8* top = image_get_row(src, y - 1);
+			u8* mid = image_get_row(src, y);
+			u8* bot = image_get_row(src, y + 1);
+			row_kernels.sobel_magnitude(d + x_begin, top + x_begin, mid + x_begin, bot + x_begin, count, data->magnitude, data->threshold);
 		}
+	}
+	else if (data->mode == 2)
+	{
+		const SeparableKernel* k = data->separable;
+		u32 tap_count = k->tap_count;
+		i32 radius = (i32)tap_count / 2;
 
-		if (data->mode == 1) {
-			Kernel5Indices def_off;
-			def_off.v[0] = -2;
-			def_off.v[1] = -1;
-			def_off.v[2] = 0;
-			def_off.v[3] = 1;
-			def_off.v[4] = 2;
-
-			for (u32 base = pixel_offset; base < end_pixel; ++base) {
-				u32 x = base % src.width;
-				b32 not_in_border = x != 0 && x != src.width - 1;
-				d[base] = not_in_border ? sample_2pass_kernel5x5(s, base, def_off, k, data->normalize_factor) : d[base];
-			}
-		}
-		else if (data->mode == 2)
+		// Walk down the rows in column strips with a rolling window of a source row per tap. The
+		// strip of the rows shared with the previous output row is still in L1, so each output
+		// row only loads one new source row from memory.
+		u32 x_end = data->x_end;
+		u32 strip_width = MAX((u32)(KERNEL_STRIP_SIZE / tap_count) / 64 * 64, 64);
+
+		for (u32 strip_begin = x_begin; strip_begin < x_end; strip_begin += strip_width)
 		{
-			// TODO: Hitting a lot of cache misses given the vertical access. Try to change the
-			// image format or a transpose, that may or not help with performance.
-
-			Kernel5Indices def_off;
-			def_off.v[0] = IMG_INDEX(src, 0, -2);
-			def_off.v[1] = IMG_INDEX(src, 0, -1);
-			def_off.v[2] = IMG_INDEX(src, 0, 0);
-			def_off.v[3] = IMG_INDEX(src, 0, 1);
-			def_off.v[4] = IMG_INDEX(src, 0, 2);
-
-			for (u32 base = pixel_offset; base < end_pixel; ++base) {
-				u32 x = base % src.width;
-				b32 not_in_border = x != 0 && x != src.width - 1;
-				d[base] = not_in_border ? sample_2pass_kernel5x5(s, base, def_off, k, data->normalize_factor) : d[base];
+			u32 strip_count = MIN(strip_width, x_end - strip_begin);
+
+			const u8* rows[SEPARABLE_KERNEL_MAX_TAPS];
+			for (u32 i = 0; i < tap_count; ++i) rows[i] = image_get_row(src, (i32)(row_begin + i) - radius) + strip_begin;
+
+			for (u32 y = row_begin; y < row_end; ++y)
+			{
+				u8* d = image_get_row(dst, y) + strip_begin;
+				row_kernel_vertical(d, rows, strip_count, k);
+
+				if (y + 1 == row_end) break;
+
+				for (u32 i = 0; i + 1 < tap_count; ++i) rows[i] = rows[i + 1];
+				rows[tap_count - 1] = image_get_row(src, (i32)y + 1 + radius) + strip_begin;
 			}
 		}
 	}
 }
 
+// Without an apron the kernels skip the pixels whose neighbourhood goes out of the image
+internal_fn void image_apply_kernel_rows(ImageApplyKernel_Task* data, u32 radius, b32 use_apron, u32 min_rows_per_task)
+{
+	u32 width = data->src.width;
+	u32 height = data->src.height;
+	u32 border = use_apron ? 0 : radius;
+
+	data->x_begin = border;
+	data->x_end = width - border;
+
+	u32 grain = MAX(app.os.min_pixels_per_task / width, min_rows_per_task);
+	task_parallel_for(border, height - border, grain, 1, image_apply_kernel_task, { data, sizeof(*data) });
+}
+
+// Sources with an apron of one pixel are processed entirely, otherwise the border is copied or zeroed
 Image image_apply_1pass_kernel3x3(Image src, Image kernel, u32 normalize_factor, b32 include_border)
 {
 	PROFILE_SCOPE("1pass kernel3x3");
@@ -608,9 +574,14 @@ Image image_apply_1pass_kernel3x3(Image src, Image kernel, u32 normalize_factor,
 		return IMG_INVALID;
 	}
 
+	b32 use_apron = src.apron >= 1;
 	Image dst;
-	
-	if (include_border) {
+
+	if (use_apron) {
+		dst = image_alloc_with_apron(src.width, src.height, src.format, src.apron, src.border);
+		image_update_apron(src);
+	}
+	else if (include_border) {
 		dst = image_copy(src, src.format);
 	}
 	else {
@@ -618,80 +589,563 @@ Image image_apply_1pass_kernel3x3(Image src, Image kernel, u32 normalize_factor,
 		memory_zero(dst._data, image_calculate_size(dst));
 	}
 
-	u32 pixel_count = (src.width - 2) * (src.height - 2);
-	u32 task_count = u32_divide_high(pixel_count, app.os.pixels_per_thread);
-
-	TaskContext ctx = {};
+	if (!use_apron && (src.width < 3 || src.height < 3)) return dst;
 
 	ImageApplyKernel_Task data = {};
 	data.mode = 0;
 	data.dst = dst;
 	data.src = src;
 	data.kernel = kernel;
-	data.write_count = app.os.pixels_per_thread;
 	data.normalize_factor = normalize_factor;
 
-	task_dispatch(image_apply_kernel_task, { &data, sizeof(data) }, task_count, &ctx);
-	task_wait(&ctx);
+	image_apply_kernel_rows(&data, 1, use_apron, 1);
 
 	return dst;
 }
 
-Image image_apply_2pass_kernel5x5(Image src, Image kernel, u32 normalize_factor)
+// Gx and Gy are computed together from the same neighbourhood, without clamping each axis
+internal_fn Image image_apply_sobel(Image src, SobelMagnitude magnitude, u32 threshold)
+{
+	if (src.format != ImageFormat_I8) {
+		return IMG_INVALID;
+	}
+
+	b32 use_apron = src.apron >= 1;
+	Image dst = image_alloc_with_apron(src.width, src.height, src.format, src.apron, src.border);
+
+	if (use_apron) {
+		image_update_apron(src);
+	}
+	else {
+		memory_zero(dst._data, image_calculate_size(dst));
+		if (src.width < 3 || src.height < 3) return dst;
+	}
+
+	ImageApplyKernel_Task data = {};
+	data.mode = 3;
+	data.dst = dst;
+	data.src = src;
+	data.magnitude = magnitude;
+	data.threshold = threshold;
+
+	image_apply_kernel_rows(&data, 1, use_apron, 1);
+
+	return dst;
+}
+
+Image image_apply_sobel_convolution(Image src, SobelMagnitude magnitude)
+{
+	PROFILE_SCOPE("Sobel Convolution");
+	return image_apply_sobel(src, magnitude, ROW_THRESHOLD_NONE);
+}
+
+// The zero borders are under any threshold, same result as the convolution followed by the threshold
+Image image_apply_sobel_threshold(Image src, SobelMagnitude magnitude, f32 threshold)
+{
+	PROFILE_SCOPE("Sobel Threshold");
+	return image_apply_sobel(src, magnitude, threshold_get_u8(threshold));
+}
+
+// Sources with an apron of the kernel radius are processed entirely, otherwise the border keeps the source value
+Image image_apply_separable_kernel(Image src, SeparableKernel kernel)
 {
-	PROFILE_SCOPE("2pass kernel5x5");
+	PROFILE_SCOPE("Separable Kernel");
 
 	if (src.format != ImageFormat_I8) {
 		return IMG_INVALID;
 	}
 
-	if (kernel.format != ImageFormat_I8 || kernel.width != 5 || kernel.height != 1) {
+	if (kernel.tap_count % 2 == 0 || kernel.tap_count > SEPARABLE_KERNEL_MAX_TAPS || kernel.normalize_factor == 0) {
+		assert(0);
 		return IMG_INVALID;
 	}
 
-	Image inter = image_copy(src, src.format);
-	DEFER(image_free(inter));
+	u32 radius = kernel.tap_count / 2;
+	b32 use_apron = src.apron >= radius;
+	Image inter;
+	Image dst;
 
-	Image dst = image_copy(src, src.format);
+	if (use_apron) {
+		inter = image_alloc_with_apron(src.width, src.height, src.format, src.apron, src.border);
+		dst = image_alloc_with_apron(src.width, src.height, src.format, src.apron, src.border);
+		image_update_apron(src);
+	}
+	else {
+		inter = image_copy(src, src.format);
+		dst = image_copy(src, src.format);
+		if (src.width < kernel.tap_count) {
+			image_free(inter);
+			return dst;
+		}
+	}
 
-	u32 pixel_count = (src.width - 4) * (src.height - 4);
-	u32 task_count = u32_divide_high(pixel_count, app.os.pixels_per_thread);
+	DEFER(image_free(inter));
 
 	ImageApplyKernel_Task data = {};
-	data.kernel = kernel;
-	data.write_count = app.os.pixels_per_thread;
-	data.normalize_factor = normalize_factor;
+	data.separable = &kernel;
 
-	// Horizontal
+	// Horizontal, every row is needed by the vertical pass
 	{
 		data.dst = inter;
 		data.src = src;
 		data.mode = 1;
-		TaskContext ctx = {};
-		task_dispatch(image_apply_kernel_task, { &data, sizeof(data) }, task_count, &ctx);
-		task_wait(&ctx);
+
+		data.x_begin = use_apron ? 0 : radius;
+		data.x_end = src.width - data.x_begin;
+
+		u32 grain = MAX(app.os.min_pixels_per_task / src.width, 1);
+		task_parallel_for(0, src.height, grain, 1, image_apply_kernel_task, { &data, sizeof(data) });
 	}
 
 	app_save_intermediate(inter, "inter_blur");
 
 	// Vertical
+	if (use_apron || src.height >= kernel.tap_count)
 	{
+		if (use_apron) image_update_apron(inter);
+
 		data.dst = dst;
 		data.src = inter;
 		data.mode = 2;
-		TaskContext ctx = {};
-		task_dispatch(image_apply_kernel_task, { &data, sizeof(data) }, task_count, &ctx);
-		task_wait(&ctx);
+
+		// Each task reloads the rows around its first row, give it enough rows to amortize them
+		image_apply_kernel_rows(&data, radius, use_apron, 16);
 	}
 
 	return dst;
 }
 
+Image image_apply_2pass_kernel5x5(Image src, Image kernel, u32 normalize_factor)
+{
+	if (kernel.format != ImageFormat_I8 || kernel.width != 5 || kernel.height != 1) {
+		return IMG_INVALID;
+	}
+
+	Array<i8> buffer = image_get_data<i8>(kernel);
+
+	SeparableKernel k = {};
+	k.tap_count = 5;
+	k.normalize_factor = normalize_factor;
+	for (u32 i = 0; i < 5; ++i) k.coefficients[i] = buffer[i];
+
+	return image_apply_separable_kernel(src, k);
+}
+
+// Box Blur
+// Three box blurs of the right widths are close to a gaussian, "Fast Almost-Gaussian Filtering"
+// (Kovesi). Each box costs one add and one sub per pixel whatever the radius. The rows run the
+// three boxes one after the other in L1 scratch rows, as differences of prefix sums. Then each strip
+// of columns runs the three vertical boxes with running sums in 32 bit lanes. Each box rounds to u8.
+
+// Columns of a vertical task, the running sums are reloaded at the top of each strip
+#define BOX_BLUR_MIN_STRIP 256
+
+// Crossover with the separable kernel, also keeps the gaussian untruncated below it
+#define GAUSSIAN_BLUR_BOX_MIN_SIGMA 3.f
+
+void box_blur_get_radii(f32 sigma, u32* radii)
+{
+	sigma = MAX(sigma, 0.1f);
+
+	f32 n = (f32)BOX_BLUR_PASSES;
+	f32 variance = 12.f * sigma * sigma;
+
+	// Widths are odd, the first 'm' boxes use the lower one
+	i32 lower = (i32)floorf(sqrtf(variance / n + 1.f));
+	if (lower % 2 == 0) lower--;
+	lower = MAX(lower, 1);
+
+	f32 m = (variance - n * lower * lower - 4.f * n * lower - 3.f * n) / (-4.f * lower - 4.f);
+	i32 lower_count = (i32)roundf(m);
+
+	for (i32 i = 0; i < BOX_BLUR_PASSES; ++i) {
+		i32 width = (i < lower_count) ? lower : lower + 2;
+		radii[i] = (u32)(width / 2);
+	}
+}
+
+inline_fn f32 box_blur_get_scale(u32 radius) {
+	return 1.f / (f32)(radius * 2 + 1);
+}
+
+struct BoxBlur_Task {
+	Image dst, src, inter;
+	u32 radii[BOX_BLUR_PASSES];
+};
+
+internal_fn void box_blur_horizontal_task(u32 row_begin, u32 row_end, void* _data)
+{
+	BoxBlur_Task* data = (BoxBlur_Task*)_data;
+
+	u32 width = data->src.width;
+	u64 stride = u64_divide_high(width, app.os.cache_line_size) * app.os.cache_line_size;
+
+	u32 max_radius = 0;
+	for (u32 i = 0; i < BOX_BLUR_PASSES; ++i) max_radius = MAX(max_radius, data->radii[i]);
+
+	// Two rows and the prefix sums of the widest box
+	u8* scratch = (u8*)image_pool_acquire(stride * 2 + ((u64)width + max_radius * 2 + 1) * sizeof(i32));
+	DEFER(image_pool_release(scratch));
+
+	i32* prefix = (i32*)(scratch + stride * 2);
+
+	for (u32 y = row_begin; y < row_end; ++y)
+	{
+		const u8* src = image_get_row(data->src, y);
+		u8* rows[BOX_BLUR_PASSES] = { scratch, scratch + stride, image_get_row(data->inter, y) };
+
+		for (u32 i = 0; i < BOX_BLUR_PASSES; ++i) {
+			row_kernels.box_blur(rows[i], src, prefix, width, data->radii[i], box_blur_get_scale(data->radii[i]));
+			src = rows[i];
+		}
+	}
+}
+
+// One box over the columns [x, x + count) of every row, the rows past the ends are replicated
+internal_fn void box_blur_columns(Image dst, Image src, u32 x, u32 count, u32 radius, i32* sums)
+{
+	u32 last = src.height - 1;
+	f32 scale = box_blur_get_scale(radius);
+
+	// Window of the row -1
+	u32 inside = MIN(radius, src.height);
+	const u8* first = image_get_row(src, 0) + x;
+	const u8* bottom = image_get_row(src, last) + x;
+
+	for (u32 i = 0; i < count; ++i) sums[i] = (i32)first[i] * (i32)(radius + 1) + (i32)bottom[i] * (i32)(radius - inside);
+
+	for (u32 y = 0; y < inside; ++y) {
+		const u8* row = image_get_row(src, y) + x;
+		for (u32 i = 0; i < count; ++i) sums[i] += row[i];
+	}
+
+	for (u32 y = 0; y <= last; ++y)
+	{
+		const u8* add = image_get_row(src, MIN(y + radius, last)) + x;
+		const u8* sub = image_get_row(src, (y > radius) ? y - radius - 1 : 0) + x;
+		row_kernels.box_sum(image_get_row(dst, y) + x, sums, add, sub, count, scale);
+	}
+}
+
+// Inter -> dst -> inter -> dst, only the columns of the task
+internal_fn void box_blur_vertical_task(u32 column_begin, u32 column_end, void* _data)
+{
+	BoxBlur_Task* data = (BoxBlur_Task*)_data;
+
+	u32 count = column_end - column_begin;
+
+	i32* sums = (i32*)image_pool_acquire(count * sizeof(i32));
+	DEFER(image_pool_release(sums));
+
+	Image sources[BOX_BLUR_PASSES] = { data->inter, data->dst, data->inter };
+	Image targets[BOX_BLUR_PASSES] = { data->dst, data->inter, data->dst };
+
+	for (u32 i = 0; i < BOX_BLUR_PASSES; ++i) {
+		box_blur_columns(targets[i], sources[i], column_begin, count, data->radii[i], sums);
+	}
+}
+
+// Processes every pixel, the apron of the source is not used
+Image image_apply_box_blur(Image src, f32 sigma)
+{
+	PROFILE_SCOPE("Box Blur");
+
+	if (src.format != ImageFormat_I8) {
+		return IMG_INVALID;
+	}
+
+	Image inter = image_alloc_with_apron(src.width, src.height, src.format, src.apron, src.border);
+	Image dst = image_alloc_with_apron(src.width, src.height, src.format, src.apron, src.border);
+	DEFER(image_free(inter));
+
+	BoxBlur_Task data = {};
+	data.dst = dst;
+	data.src = src;
+	data.inter = inter;
+	box_blur_get_radii(sigma, data.radii);
+
+	// Horizontal
+	{
+		u32 grain = MAX(app.os.min_pixels_per_task / src.width, 1);
+		task_parallel_for(0, src.height, grain, 1, box_blur_horizontal_task, { &data, sizeof(data) });
+	}
+
+	app_save_intermediate(inter, "inter_blur");
+
+	// Vertical, strips of whole cache lines so the tasks never write the same line
+	{
+		u32 grain = MAX(app.os.min_pixels_per_task / src.height, BOX_BLUR_MIN_STRIP);
+		task_parallel_for(0, src.width, grain, app.os.cache_line_size, box_blur_vertical_task, { &data, sizeof(data) });
+	}
+
+	return dst;
+}
+
+b32 gaussian_blur_uses_box(f32 sigma) {
+	return sigma >= GAUSSIAN_BLUR_BOX_MIN_SIGMA;
+}
+
+// A single separable pass, its cost grows with the taps. The large sigmas use the box blur, its
+// cost doesn't depend on the sigma.
+Image image_apply_gaussian_blur_sigma(Image src, f32 sigma)
+{
+	PROFILE_SCOPE("Gaussian Blur Sigma");
+	if (gaussian_blur_uses_box(sigma)) return image_apply_box_blur(src, sigma);
+	return image_apply_separable_kernel(src, separable_kernel_gaussian(sigma));
+}
+
+// Fused Edge Detection
+// Runs gray -> blur -> sobel -> threshold over bands of rows. Each task keeps the rows of the
+// intermediate stages in scratch windows sized to fit in L2, only the final mask is written to
+// image memory. Stages need 'halo' extra rows above and below the band to compute their borders.
+// The result is the same as running the stages one by one.
+
+// Contiguous rows of an image, starting at the row 'y_base'
+struct RowWindow {
+	u8* data;
+	u64 stride;
+	u32 y_base;
+};
+
+inline_fn u8* row_window_get(RowWindow window, u32 y) {
+	assert(y >= window.y_base);
+	return window.data + (u64)(y - window.y_base) * window.stride;
+}
+
+static const Kernel3x3Indices gaussian3x3_kernel = { 1, 2, 1, 2, 4, 2, 1, 2, 1 };
+
+internal_fn void fused_gray_rows(RowWindow dst, Image src, u32 row_begin, u32 row_end)
+{
+	for (u32 y = row_begin; y < row_end; ++y) {
+		row_kernels.gray_from_rgba8(row_window_get(dst, y), image_get_row(src, y), src.width);
+	}
+}
+
+// Same as 'image_apply_gaussian_blur' with the 3x3 gaussian when 'kernel' is NULL, otherwise same as
+// 'image_apply_separable_kernel'. Border pixels keep the source value.
+internal_fn void fused_blur_rows(RowWindow dst, RowWindow src, RowWindow inter, const SeparableKernel* kernel, u32 width, u32 height, u32 row_begin, u32 row_end)
+{
+	if (kernel == NULL)
+	{
+		for (u32 y = row_begin; y < row_end; ++y)
+		{
+			u8* d = row_window_get(dst, y);
+			u8* s = row_window_get(src, y);
+			memory_copy(d, s, width);
+
+			if (y == 0 || y == height - 1 || width < 3) continue;
+
+			u8* top = row_window_get(src, y - 1);
+			u8* bot = row_window_get(src, y + 1);
+			row_kernel3x3(d + 1, top + 1, s + 1, bot + 1, width - 2, gaussian3x3_kernel, 16);
+		}
+	}
+	else
+	{
+		u32 tap_count = kernel->tap_count;
+		u32 radius = tap_count / 2;
+		u32 inter_begin = (row_begin < radius) ? 0 : row_begin - radius;
+		u32 inter_end = MIN(row_end + radius, height);
+
+		for (u32 y = inter_begin; y < inter_end; ++y)
+		{
+			u8* d = row_window_get(inter, y);
+			u8* s = row_window_get(src, y);
+			memory_copy(d, s, width);
+
+			if (width < tap_count) continue;
+			row_kernel_horizontal(d + radius, s + radius, width - radius * 2, kernel);
+		}
+
+		for (u32 y = row_begin; y < row_end; ++y)
+		{
+			u8* d = row_window_get(dst, y);
+			u8* s = row_window_get(src, y);
+			memory_copy(d, s, width);
+
+			if (y < radius || y >= height - radius || width < tap_count) continue;
+
+			const u8* rows[SEPARABLE_KERNEL_MAX_TAPS];
+			for (u32 i = 0; i < tap_count; ++i) rows[i] = row_window_get(inter, y + i - radius) + radius;
+
+			row_kernel_vertical(d + radius, rows, width - radius * 2, kernel);
+		}
+	}
+}
+
+// Same as 'image_apply_sobel_convolution' followed by 'image_apply_threshold'
+internal_fn void fused_sobel_threshold_rows(Image dst, RowWindow src, SobelMagnitude magnitude, u8 threshold, u32 row_begin, u32 row_end)
+{
+	u32 width = dst.width;
+	u32 height = dst.height;
+
+	for (u32 y = row_begin; y < row_end; ++y)
+	{
+		u8* d = image_get_row(dst, y);
+
+		// The borders of the sobel image are zero, that is always under the threshold
+		if (y == 0 || y == height - 1 || width < 3) {
+			memory_zero(d, width);
+			continue;
+		}
+
+		u8* top = row_window_get(src, y - 1);
+		u8* mid = row_window_get(src, y);
+		u8* bot = row_window_get(src, y + 1);
+
+		d[0] = 0;
+		d[width - 1] = 0;
+		row_kernels.sobel_magnitude(d + 1, top + 1, mid + 1, bot + 1, width - 2, magnitude, threshold);
+	}
+}
+
+struct EdgeDetection_Task {
+	Image dst, src;
+	const SeparableKernel* blur_kernel; // NULL for the 3x3 gaussian
+	u32 blur_radius;
+	SobelMagnitude magnitude;
+	u32 blur_iterations;
+	u32 band_rows;
+	u32 band_count;
+	u32 halo;
+	u8 threshold;
+	volatile u32* next_band;
+};
+
+internal_fn void edge_detection_task(u32 index, void* _data)
+{
+	EdgeDetection_Task* data = (EdgeDetection_Task*)_data;
+
+	Image src = data->src;
+	Image dst = data->dst;
+	u32 width = src.width;
+	u32 height = src.height;
+	u32 blur_radius = data->blur_radius;
+
+	// Three windows ping-pong between stages (the 5x5 blur needs one for the horizontal pass)
+	u64 stride = u64_divide_high(width, app.os.cache_line_size) * app.os.cache_line_size;
+	u32 window_rows = data->band_rows + data->halo * 2;
+	u64 window_size = stride * window_rows;
+
+	u8* memory = (u8*)image_pool_acquire(window_size * 3 + app.os.pixels_padding);
+	DEFER(image_pool_release(memory));
+
+	RowWindow windows[3];
+	for (u32 i = 0; i < 3; ++i) {
+		windows[i].data = memory + window_size * i;
+		windows[i].stride = stride;
+	}
+
+	// Tasks take bands until there are no more, the windows are allocated once per task
+	while (true)
+	{
+		u32 band = interlock_increment_u32(data->next_band) - 1;
+		if (band >= data->band_count) break;
+
+		u32 row_begin = band * data->band_rows;
+		u32 row_end = MIN(row_begin + data->band_rows, height);
+		u32 y_base = (row_begin < data->halo) ? 0 : row_begin - data->halo;
+
+		for (u32 i = 0; i < 3; ++i) windows[i].y_base = y_base;
+
+		u32 halo = data->halo;
+		u32 begin = (row_begin < halo) ? 0 : row_begin - halo;
+		u32 end = MIN(row_end + halo, height);
+
+		RowWindow current;
+
+		if (src.format == ImageFormat_I8) {
+			current.data = image_get_row(src, 0);
+			current.stride = src.stride;
+			current.y_base = 0;
+		}
+		else {
+			current = windows[0];
+			fused_gray_rows(current, src, begin, end);
+		}
+
+		for (u32 it = 0; it < data->blur_iterations; ++it)
+		{
+			halo -= blur_radius;
+			begin = (row_begin < halo) ? 0 : row_begin - halo;
+			end = MIN(row_end + halo, height);
+
+			RowWindow next = (current.data == windows[0].data) ? windows[1] : windows[0];
+			fused_blur_rows(next, current, windows[2], data->blur_kernel, width, height, begin, end);
+			current = next;
+		}
+
+		fused_sobel_threshold_rows(dst, current, data->magnitude, data->threshold, row_begin, row_end);
+	}
+}
+
+Image image_apply_edge_detection_fused(Image src, BlurDistance blur_distance, u32 blur_iterations, f32 blur_sigma, SobelMagnitude magnitude, f32 threshold)
+{
+	PROFILE_SCOPE("Fused Edge Detection");
+
+	if (src.format != ImageFormat_I8 && src.format != ImageFormat_RGBA8) {
+		return IMG_INVALID;
+	}
+
+	// The running sums of the box blur go down whole columns, they don't split in bands
+	if (blur_sigma > 0.f && gaussian_blur_uses_box(blur_sigma))
+	{
+		// Without apron, the borders of the sobel are zero like the ones of the bands
+		Image gray = image_copy_with_apron(src, ImageFormat_I8, 0, ImageBorder_Replicate);
+		Image blur = image_apply_box_blur(gray, blur_sigma);
+		Image dst = image_apply_sobel_threshold(blur, magnitude, threshold);
+
+		image_free(gray);
+		image_free(blur);
+		return dst;
+	}
+
+	Image dst = image_alloc(src.width, src.height, ImageFormat_I8);
+
+	SeparableKernel blur_kernel = gaussian5_kernel;
+	if (blur_sigma > 0.f) {
+		blur_kernel = separable_kernel_gaussian(blur_sigma);
+		blur_iterations = 1;
+	}
+
+	EdgeDetection_Task data = {};
+	data.dst = dst;
+	data.src = src;
+	data.blur_kernel = (blur_sigma > 0.f || blur_distance == BlurDistance_5) ? &blur_kernel : NULL;
+	data.blur_radius = (data.blur_kernel != NULL) ? blur_kernel.tap_count / 2 : 1;
+	data.blur_iterations = blur_iterations;
+	data.magnitude = magnitude;
+	data.halo = blur_iterations * data.blur_radius + 1;
+	data.threshold = threshold_get_u8(threshold);
+
+	// Use half of the L2 for the three windows, the other half is left for the input and output rows
+	u64 stride = u64_divide_high(src.width, app.os.cache_line_size) * app.os.cache_line_size;
+	u64 budget_rows = (app.os.l2_cache_size / 2) / (stride * 3);
+	u64 band_rows = (budget_rows > data.halo * 2) ? budget_rows - data.halo * 2 : 0;
+	data.band_rows = (u32)MIN(MAX(band_rows, 16), (u64)src.height);
+	data.band_count = u32_divide_high(src.height, data.band_rows);
+
+	volatile u32 next_band = 0;
+	data.next_band = &next_band;
+
+	u32 task_count = MIN(data.band_count, app.os.logic_core_count);
+
+	TaskContext ctx = {};
+	task_dispatch(edge_detection_task, { &data, sizeof(data) }, task_count, &ctx);
+	task_wait(&ctx);
+
+	return dst;
+}
+
+// The image sized buffers of the decoder come from the image pool, so the decoded pixels already
+// live in a buffer that 'image_free' can release. Its small scratch (zlib and huffman tables,
+// component rows) goes to the heap. The extra 1/16 leaves room to align the rows, see 'load_image'.
+#define STBI_DECODE_SIZE(size) ((size) + (size) / 16 + app.os.pixels_padding)
 #define STBI_ASSERT(x) assert(x)
-#define STBI_MALLOC(size) memory_allocate(size)
-#define STBI_FREE(ptr) memory_free(ptr)
-#define STBI_REALLOC_SIZED(old_ptr, old_size, new_size) memory_reallocate(old_ptr, new_size)
-#define STBI_REALLOC(old_ptr, new_size) memory_reallocate(old_ptr, new_size)
+#define STBI_MALLOC(size) image_pool_acquire_mixed(STBI_DECODE_SIZE(size))
+#define STBI_FREE(ptr) image_pool_release_mixed(ptr)
+#define STBI_REALLOC_SIZED(old_ptr, old_size, new_size) image_pool_reallocate_mixed(old_ptr, STBI_DECODE_SIZE(new_size))
+#define STBI_REALLOC(old_ptr, new_size) image_pool_reallocate_mixed(old_ptr, STBI_DECODE_SIZE(new_size))
 #define STB_IMAGE_IMPLEMENTATION
 
 #define STBIW_ASSERT(x) assert(x)
@@ -716,39 +1170,144 @@ Image load_image(String path)
 {
     PROFILE_SCOPE("Load Image");
 
-    String path0 = string_copy(app.temp_arena, path);
+	FileMap file;
+	if (!os_file_map_read(path, &file)) return IMG_INVALID;
+	DEFER(os_file_unmap(file));
+
+	if (file.size > INT32_MAX) return IMG_INVALID;
 
 	u32 pixel_stride = 4;
 
     int w = 0, h = 0, c = 0;
-    void* data = stbi_load(path0.data, &w, &h, &c, pixel_stride);
+    u8* data = stbi_load_from_memory(file.data, (int)file.size, &w, &h, &c, pixel_stride);
 
     if (data == NULL) return IMG_INVALID;
 
-	DEFER(STBI_FREE(data));
+	u32 row_size = w * pixel_stride;
+
+	Image image = {};
+	image.width = w;
+	image.height = h;
+	image.stride = u32_divide_high(row_size, IMAGE_ROW_ALIGNMENT) * IMAGE_ROW_ALIGNMENT;
+	image.format = ImageFormat_RGBA8;
+	image._data = data;
+
+	// Small images come from the heap and narrow ones can need more than the decoder left, those are copied
+	if (!image_pool_is_pooled(data) || image_pool_get_capacity(data) < (u64)image.stride * h + app.os.pixels_padding)
+	{
+		Image copy = image_alloc(w, h, ImageFormat_RGBA8);
+		for (i32 y = 0; y < h; ++y) memory_copy(image_get_row(copy, y), data + (u64)y * row_size, row_size);
+
+		image_pool_release_mixed(data);
+		return copy;
+	}
 
-    Image image = {};
-    image.format = ImageFormat_RGBA8;
-    image._data = (u8*)os_allocate_image_memory(w * h, pixel_stride);
-    image.width = w;
-    image.height = h;
-	memory_copy(image._data, data, w * h * pixel_stride);
+	// The decoded rows are packed, they are spread to the aligned stride in place. Starting from the
+	// bottom no row is overwritten before it's moved.
+	if (image.stride != row_size) {
+		for (i32 y = h - 1; y > 0; --y) memory_move(image_get_row(image, y), data + (u64)y * row_size, row_size);
+	}
 
     return image;
 }
 
-b32 save_image(String path, Image image)
+Image load_image_gray(String path, u32 apron, ImageBorder border)
+{
+    PROFILE_SCOPE("Load Image Gray");
+
+	FileMap file;
+	if (!os_file_map_read(path, &file)) return IMG_INVALID;
+	DEFER(os_file_unmap(file));
+
+	if (file.size > INT32_MAX) return IMG_INVALID;
+
+    int w = 0, h = 0, c = 0;
+	if (!stbi_info_from_memory(file.data, (int)file.size, &w, &h, &c)) return IMG_INVALID;
+
+	// Decoded with the channels of the file, only gray + alpha is expanded to RGBA. The RGBA buffer
+	// of those files is alive during the copy, 5 bytes per pixel at the peak.
+	i32 channels = (c == 2) ? 4 : c;
+
+    u8* data = stbi_load_from_memory(file.data, (int)file.size, &w, &h, &c, channels);
+
+    if (data == NULL) return IMG_INVALID;
+
+	DEFER(image_pool_release_mixed(data));
+
+	Image src = {};
+	src.width = w;
+	src.height = h;
+	src.stride = w * channels;
+	src._data = data;
+
+	if (channels == 1) src.format = ImageFormat_I8;
+	else if (channels == 3) src.format = ImageFormat_RGB8;
+	else src.format = ImageFormat_RGBA8;
+
+	// The luma is computed in the same pass that lays out the rows
+	return image_copy_with_apron(src, ImageFormat_I8, apron, border);
+}
+
+const char* image_file_format_get_extension(ImageFileFormat format)
+{
+    if (format == ImageFileFormat_PNM) return "pnm";
+    if (format == ImageFileFormat_Raw) return "raw";
+    return "png";
+}
+
+// Writes the header followed by the rows without padding, straight into the mapped file
+internal_fn b32 save_image_uncompressed(String path, Image image, const void* header, u32 header_size)
+{
+    u32 row_size = image.width * image_format_get_pixel_stride(image.format);
+
+    FileMap map;
+    if (!os_file_map_write(path, header_size + (u64)row_size * image.height, &map)) return false;
+    DEFER(os_file_unmap(map));
+
+    memory_copy(map.data, header, header_size);
+
+    u8* dst = map.data + header_size;
+    for (u32 y = 0; y < image.height; ++y) {
+        memory_copy(dst + (u64)y * row_size, image_get_row(image, y), row_size);
+    }
+
+    return true;
+}
+
+b32 save_image(String path, Image image, ImageFileFormat format)
 {
     PROFILE_SCOPE("Save Image");
 
     if (image_is_invalid(image)) return false;
 
     u32 number_of_channels = image_format_get_number_of_channels(image.format);
-    u32 pixel_stride = image_format_get_pixel_stride(image.format);
-    u32 row_stride_in_bytes = image.width * pixel_stride;
 
-    String path0 = string_copy(app.temp_arena, path);
+    if (format == ImageFileFormat_PNM)
+    {
+        String header;
+        if (number_of_channels == 1) header = string_format(temp_arena, "P5\n%u %u\n255\n", image.width, image.height);
+        else if (number_of_channels == 3) header = string_format(temp_arena, "P6\n%u %u\n255\n", image.width, image.height);
+        else header = string_format(temp_arena, "P7\nWIDTH %u\nHEIGHT %u\nDEPTH 4\nMAXVAL 255\nTUPLTYPE RGB_ALPHA\nENDHDR\n", image.width, image.height);
+
+        return save_image_uncompressed(path, image, header.data, (u32)header.size);
+    }
+
+    if (format == ImageFileFormat_Raw)
+    {
+        ImageRawHeader header;
+        header.magic = IMAGE_RAW_MAGIC;
+        header.width = image.width;
+        header.height = image.height;
+        header.channels = number_of_channels;
+
+        return save_image_uncompressed(path, image, &header, sizeof(header));
+    }
 
-    if (!stbi_write_png(path0.data, image.width, image.height, number_of_channels, image._data, row_stride_in_bytes)) return false;
+    String path0 = string_copy(temp_arena, path);
+
+    // stb reads the level from a global, every caller sets the same value
+    stbi_write_png_compression_level = app.sett.png_compression_level;
+
+    if (!stbi_write_png(path0.data, image.width, image.height, number_of_channels, image._data, image.stride)) return false;
     return true;
-}
\ No newline at end of file
+}
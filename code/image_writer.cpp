@@ -0,0 +1,171 @@
+#include "inc.h"
+
+// PNG encoding is mostly deflate, two threads keep up with the pipeline without taking many cores
+#define IMAGE_WRITER_THREAD_COUNT 2
+#define IMAGE_WRITER_QUEUE_SIZE 8
+
+struct ImageWriterEntry
+{
+	char* path;
+	Image image;
+	ImageFileFormat format;
+};
+
+struct ImageWriterState
+{
+	volatile u32 lock;
+	ImageWriterEntry queue[IMAGE_WRITER_QUEUE_SIZE];
+	u32 queue_begin;
+	u32 queue_count;
+
+	// Queued or being saved
+	volatile u32 pending_count;
+
+	// Both are wake up hints, the state is always checked under the lock
+	Semaphore queued_semaphore;
+	Semaphore free_semaphore;
+
+	Thread threads[IMAGE_WRITER_THREAD_COUNT];
+	u32 thread_count;
+
+	volatile b32 running;
+};
+
+static ImageWriterState image_writer;
+
+internal_fn void image_writer_lock()
+{
+	while (interlock_exchange_u32(&image_writer.lock, 0, 1) != 0) _mm_pause();
+}
+
+internal_fn void image_writer_unlock()
+{
+	cpu_write_barrier();
+	image_writer.lock = 0;
+}
+
+internal_fn i32 image_writer_thread(void* arg)
+{
+	temp_arena = arena_alloc();
+	DEFER(arena_free(temp_arena));
+
+	profiler_set_thread_name("Image Writer");
+
+	while (true)
+	{
+		ImageWriterEntry entry = {};
+		b32 found = false;
+
+		image_writer_lock();
+		if (image_writer.queue_count > 0) {
+			entry = image_writer.queue[image_writer.queue_begin];
+			image_writer.queue_begin = (image_writer.queue_begin + 1) % IMAGE_WRITER_QUEUE_SIZE;
+			image_writer.queue_count--;
+			found = true;
+		}
+		image_writer_unlock();
+
+		if (!found)
+		{
+			if (!image_writer.running) break;
+			os_semaphore_wait(image_writer.queued_semaphore, 100);
+			continue;
+		}
+
+		os_semaphore_release(image_writer.free_semaphore, 1);
+
+		if (save_image(entry.path, entry.image, entry.format)) printf("Saved intermediate: %s\n", entry.path);
+		else printf("Can't save the image %s\n", entry.path);
+
+		image_free(entry.image);
+		memory_free(entry.path);
+
+		if (temp_arena->size > 0) arena_pop_to(temp_arena, 0);
+
+		interlock_decrement_u32(&image_writer.pending_count);
+	}
+
+	return 0;
+}
+
+b32 image_writer_initialize()
+{
+	image_writer.running = true;
+	image_writer.queued_semaphore = os_semaphore_create(0, IMAGE_WRITER_QUEUE_SIZE);
+	image_writer.free_semaphore = os_semaphore_create(0, IMAGE_WRITER_QUEUE_SIZE);
+
+	if (image_writer.queued_semaphore.value == 0 || image_writer.free_semaphore.value == 0) {
+		printf("Can't create image writer semaphores\n");
+		return false;
+	}
+
+	for (u32 i = 0; i < IMAGE_WRITER_THREAD_COUNT; ++i)
+	{
+		Thread thread = os_thread_start(image_writer_thread, {});
+
+		if (thread.value == 0) {
+			printf("Can't create image writer thread\n");
+			return false;
+		}
+
+		image_writer.threads[image_writer.thread_count++] = thread;
+	}
+
+	return true;
+}
+
+void image_writer_shutdown()
+{
+	image_writer_flush();
+
+	image_writer.running = false;
+	os_semaphore_release(image_writer.queued_semaphore, image_writer.thread_count);
+	os_thread_wait_array(image_writer.threads, image_writer.thread_count);
+
+	os_semaphore_destroy(image_writer.queued_semaphore);
+	os_semaphore_destroy(image_writer.free_semaphore);
+	image_writer = {};
+}
+
+void image_writer_save(String path, Image image, ImageFileFormat format)
+{
+	if (image_is_invalid(image)) return;
+
+	// Same layout as the source, the rows are copied in one go
+	Image copy = image_alloc_with_apron(image.width, image.height, image.format, image.apron, image.border);
+	memory_copy(copy._data, image._data, image_calculate_size(image));
+
+	ImageWriterEntry entry;
+	entry.image = copy;
+	entry.format = format;
+	entry.path = (char*)memory_allocate(path.size + 1);
+	string_copy_from_data(entry.path, path.size + 1, path);
+
+	interlock_increment_u32(&image_writer.pending_count);
+
+	while (true)
+	{
+		image_writer_lock();
+
+		b32 queued = image_writer.queue_count < IMAGE_WRITER_QUEUE_SIZE;
+		if (queued) {
+			u32 index = (image_writer.queue_begin + image_writer.queue_count) % IMAGE_WRITER_QUEUE_SIZE;
+			image_writer.queue[index] = entry;
+			image_writer.queue_count++;
+		}
+
+		image_writer_unlock();
+
+		if (queued) break;
+
+		// Backpressure, wait until a writer takes an image
+		os_semaphore_wait(image_writer.free_semaphore, 10);
+	}
+
+	os_semaphore_release(image_writer.queued_semaphore, 1);
+}
+
+void image_writer_flush()
+{
+	while (image_writer.pending_count > 0) os_thread_yield();
+}
@@ -4,11 +4,13 @@
 #define _CRT_SECURE_NO_WARNINGS
 
 #include <memory.h>
+#include <string.h>
 #include <cassert>
 #include <cstdlib>
 #include <stdio.h>
 #include <stdint.h>
 #include <stdarg.h>
+#include <math.h>
 
 typedef uint8_t  u8;
 typedef uint16_t u16;
@@ -51,6 +53,8 @@ static_assert(sizeof(b32) == 4);
 #define GB(bytes) (((u64)(bytes)) << 30)
 #define TB(bytes) (((u64)(bytes)) << 40)
 
+#define ARRAY_COUNT(_array) (sizeof(_array) / sizeof((_array)[0]))
+
 #define inline_fn inline
 #define internal_fn static
 
@@ -76,24 +80,9 @@ _defer<F> _defer_func(F f) {
 
 // Utils
 
-#define PROFILE_BEGIN(_name) \
-if (app.sett.enable_profiler) { \
-for (i32 i = 0; i < app.profiler_indent; ++i) printf(" "); \
-printf("-> %s\n", _name); \
-} \
-f64 _start_time = timer_now(); \
-const char* _profile_name = _name; \
-app.profiler_indent++
-
-#define PROFILE_END() do { \
-f64 _end_time = timer_now(); \
-f64 _ellapsed_time = _end_time - _start_time; \
-app.profiler_indent--; \
-if (app.sett.enable_profiler) { \
-for (i32 i = 0; i < app.profiler_indent; ++i) printf(" "); \
-printf("<- %s: %s\n", _profile_name, string_format_time(_ellapsed_time).data); \
-} \
-} while (0)
+// The name must be a string literal, the profiler keeps the pointer
+#define PROFILE_BEGIN(_name) profiler_begin(_name)
+#define PROFILE_END() profiler_end()
 
 #define PROFILE_SCOPE(_name) \
 PROFILE_BEGIN(_name); \
@@ -161,12 +150,26 @@ String string_copy(Arena* arena, String src);
 String string_format(Arena* arena, String text, ...);
 String string_format_time(f64 seconds);
 
+// Text built with printf-like appends, the buffer grows as needed. A failed append leaves the text
+// as it was and sets 'failed', checked once by the caller at the end.
+struct TextBuilder {
+	char* data;
+	u64 size;
+	u64 capacity;
+	b32 failed;
+};
+
+TextBuilder text_builder_make(u64 capacity);
+void text_builder_free(TextBuilder* builder);
+void text_builder_append(TextBuilder* builder, const char* format, ...);
+
 f64 timer_now();
 
 // OS LAYER
 
 #define memory_copy(dst, src, size) memcpy(dst, src, size)
 #define memory_zero(dst, size) memset(dst, 0, size)
+#define memory_move(dst, src, size) memmove(dst, src, size)
 
 inline_fn void* memory_allocate(u64 size, b32 zero = false) {
 	while (true) {
@@ -196,12 +199,27 @@ void* arena_push(Arena* arena, u64 size);
 void* arena_push_align(Arena* arena, u64 user_size, u64 alignment);
 void arena_pop_to(Arena* arena, u64 size);
 
-void* os_allocate_image_memory(u32 pixels, u32 pixel_stride);
+void* os_allocate_image_memory(u64 pixels, u32 pixel_stride);
 void  os_free_image_memory(void* ptr);
 
 b32 os_remove_folder(String path);
 b32 os_create_folder(String path);
 
+// Paths of the regular files inside a folder, returns false if it's not a folder
+b32 os_list_files(Arena* arena, String path, Array<String>* files);
+
+// Whole file mapped in memory. Files mapped for writing are created with the given size and the
+// content is written to disk on unmap.
+struct FileMap {
+	u8* data;
+	u64 size;
+	u64 handles[2];
+};
+
+b32  os_file_map_read(String path, FileMap* map);
+b32  os_file_map_write(String path, u64 size, FileMap* map);
+void os_file_unmap(FileMap map);
+
 u64 os_get_time_counter();
 
 struct Thread { u64 value; };
@@ -213,6 +231,7 @@ Thread os_thread_start(ThreadFn* fn, RawBuffer data);
 void   os_thread_wait(Thread thread);
 void   os_thread_wait_array(Thread* threads, u32 count);
 void   os_thread_yield();
+b32    os_thread_pin(Thread thread, u32 logic_core); // Index over the cores the process may run on
 
 Semaphore os_semaphore_create(u32 initial_count, u32 max_count);
 void os_semaphore_wait(Semaphore semaphore, u32 millis);
@@ -222,6 +241,7 @@ void os_semaphore_destroy(Semaphore semaphore);
 u32 interlock_increment_u32(volatile u32* n);
 u32 interlock_decrement_u32(volatile u32* n);
 u32 interlock_exchange_u32(volatile u32* dst, u32 compare, u32 exchange);
+u32 interlock_add_u32(volatile u32* n, u32 value);
 
 // APP
 
@@ -230,6 +250,21 @@ enum BlurDistance {
 	BlurDistance_5,
 };
 
+// Odd number of taps centered on the pixel, applied to the rows and then to the columns. Each pass
+// writes |sum / normalize_factor| clamped to 255.
+#define SEPARABLE_KERNEL_MAX_TAPS 31
+
+struct SeparableKernel {
+	u32 tap_count;
+	u32 normalize_factor;
+	i32 coefficients[SEPARABLE_KERNEL_MAX_TAPS];
+};
+
+enum SobelMagnitude {
+	SobelMagnitude_L1,       // (|Gx| + |Gy|) / sqrt(2)
+	SobelMagnitude_L2Approx, // sqrt(Gx^2 + Gy^2) approximated with alpha max plus beta min
+};
+
 enum ImageFormat {
 	ImageFormat_Invalid,
 	ImageFormat_I8,
@@ -237,32 +272,69 @@ enum ImageFormat {
 	ImageFormat_RGBA8,
 };
 
+enum ImageFileFormat {
+	ImageFileFormat_PNG,
+	ImageFileFormat_PNM, // Uncompressed PGM (I8), PPM (RGB8) or PAM (RGBA8)
+	ImageFileFormat_Raw, // ImageRawHeader followed by the rows without padding
+};
+
+struct ImageRawHeader {
+	u32 magic; // IMAGE_RAW_MAGIC
+	u32 width;
+	u32 height;
+	u32 channels;
+};
+
+#define IMAGE_RAW_MAGIC 0x52424F53 // "SOBR"
+
+// How the apron around an image is filled from the pixels at the edges
+enum ImageBorder {
+	ImageBorder_Replicate, // aaa|abcd|ddd
+	ImageBorder_Mirror,    // dcb|abcd|cba
+};
+
+// Rows start at a multiple of IMAGE_ROW_ALIGNMENT bytes from each other. Images can have an apron of
+// pixels around them, so the kernels can read past the edges without special cases. '_data' points
+// to the first pixel inside the apron.
 struct Image {
 	void* _data;
 	ImageFormat format;
 	u32 width;
 	u32 height;
+	u32 stride; // In bytes
+	u32 apron;  // In pixels
+	ImageBorder border;
 };
 
+#define IMAGE_ROW_ALIGNMENT 64
+
 #define IMG_INVALID (Image{})
-#define IMG_INDEX(_img, _x, _y) (_x) + ((_y) * (_img).width)
+#define IMG_INDEX(_img, _x, _y) ((_x) + ((_y) * ((_img).stride / image_format_get_pixel_stride((_img).format))))
 
 struct AppGlobals {
 	struct {
 		b32 save_intermediates;
 		b32 enable_profiler;
+		b32 fused_pipeline;
+		b32 border_apron;
+		ImageFileFormat output_format;
+		i32 png_compression_level;
 		u32 blur_iterations;
 		BlurDistance blur_distance;
+		f32 blur_sigma; // A single gaussian pass instead of the blur distance and iterations, if positive
+		SobelMagnitude sobel_magnitude;
 		f32 threshold;
 	} sett;
 
 	struct {
 		u32 page_size;
 		u32 cache_line_size;
+		u32 l2_cache_size;
 		u32 logic_core_count;
-		u32 pixels_per_thread;
+		u32 min_pixels_per_task;  // Minimum grain of the parallel image loops
 		u32 pixels_padding;       // Amount of pixels at the end of image memory to ensure SIMD instructions does not overflow
-		u32 simd_granularity;     // Image memory and 'pixels_per_thread' must be aligned to the SIMD granularity
+		u32 simd_granularity;     // Image memory and task chunks must be aligned to the SIMD granularity
+		u32 simd_level;           // SimdLevel of the row kernels
 		u64 timer_start_counter;
 		u64 timer_frequency;
 	} os;
@@ -270,112 +342,235 @@ struct AppGlobals {
 	u32 intermediate_image_saves_counter;
 	String intermediate_path;
 
-	i32 profiler_indent;
-
 	Arena* static_arena;
-	Arena* temp_arena;
 };
 
 global_var AppGlobals app;
 
+// Each thread has its own scratch memory. Task threads restore the temp arena after every task.
+global_var thread_local Arena* temp_arena;
+
 void app_save_intermediate(Image image, String name);
 
+// Gray -> blur -> sobel -> threshold with the current settings, the result is owned by the caller
+Image edge_detection(Image original);
+
+// Runs the image operations over synthetic images from 256^2 to 'max_size'^2 with 1..N workers.
+// The task system must not be initialized, the results are saved as JSON.
+b32 bench_run(u32 max_size, String path);
+
+// Compares the image operations at every SIMD level, worker count and task grain with plain scalar
+// references, over random images of odd sizes. The task system must not be initialized.
+b32 validate_run(u32 seed);
+
 // Image Processing
 
 u32 image_format_get_pixel_stride(ImageFormat format);
 u32 image_format_get_number_of_channels(ImageFormat format);
-u32 image_calculate_size(Image image);
+u64 image_calculate_size(Image image);
 
 inline_fn b32 image_is_invalid(Image img) { return img.format == ImageFormat_Invalid; }
 
+// Rows are not contiguous, index the data with 'IMG_INDEX'
 template<typename T>
-inline_fn Array<T> image_get_data(Image img) { return array_make<T>((T*)img._data, app.os.pixels_padding + (image_calculate_size(img) / sizeof(T))); }
+inline_fn Array<T> image_get_data(Image img) { return array_make<T>((T*)img._data, (u32)((app.os.pixels_padding + image_calculate_size(img)) / sizeof(T))); }
+
+// 'y' can go into the apron
+inline_fn u8* image_get_row(Image img, i32 y) { return (u8*)img._data + (i64)y * img.stride; }
+
+// Image Pool
+// Buffers for image data, recycled by size class. The memory is aligned to a cache line and it's
+// not cleared when reused.
+
+struct ImagePoolStats {
+	u64 acquire_count;
+	u64 hit_count;            // Acquires served without allocating from the OS
+	u64 resident_bytes;       // Memory taken from the OS, in use or cached
+	u64 peak_resident_bytes;
+	u64 in_use_bytes;
+};
+
+void* image_pool_acquire(u64 size);
+void  image_pool_release(void* ptr);
+void* image_pool_reallocate(void* ptr, u64 size);
+u64   image_pool_get_capacity(void* ptr); // Usable bytes of an acquired buffer
+void  image_pool_trim(); // Releases the cached buffers to the OS
+
+// Small buffers come from the heap, the rest from the pool. Only the pooled ones can be released
+// with 'image_pool_release' or owned by an image.
+void* image_pool_acquire_mixed(u64 size);
+void  image_pool_release_mixed(void* ptr);
+void* image_pool_reallocate_mixed(void* ptr, u64 size);
+b32   image_pool_is_pooled(void* ptr); // For buffers of the mixed functions
+ImagePoolStats image_pool_get_stats();
 
 Image image_alloc(u32 width, u32 height, ImageFormat format);
+Image image_alloc_with_apron(u32 width, u32 height, ImageFormat format, u32 apron, ImageBorder border);
 void image_free(Image image);
+
+// Fills the apron from the pixels at the edges, kernels call it before reading from the apron
+void image_update_apron(Image image);
+
+// The result keeps the apron of the source
 Image image_copy(Image src, ImageFormat format);
+Image image_copy_with_apron(Image src, ImageFormat format, u32 apron, ImageBorder border);
 void image_mult(Image dst, f32 mult);
 
-Image image_apply_sobel_convolution(Image src);
+Image image_apply_sobel_convolution(Image src, SobelMagnitude magnitude);
 Image image_apply_threshold(Image src, f32 threshold);
+// Same as the sobel convolution followed by the threshold, in a single pass
+Image image_apply_sobel_threshold(Image src, SobelMagnitude magnitude, f32 threshold);
 Image image_apply_gaussian_blur(Image src, BlurDistance distance);
 
 Image image_blend(Image src0, Image src1, f32 factor);
+Image image_blend_threshold(Image src0, Image src1, f32 factor, f32 threshold);
 Image image_apply_1pass_kernel3x3(Image src, Image kernel, u32 normalize_factor, b32 include_border);
 Image image_apply_2pass_kernel5x5(Image src, Image kernel, u32 normalize_factor);
 
+// Sources with an apron of the kernel radius are processed entirely, otherwise the border keeps the source value
+Image image_apply_separable_kernel(Image src, SeparableKernel kernel);
+Image image_apply_gaussian_blur_sigma(Image src, f32 sigma);
+// Three box blurs close to a gaussian of 'sigma', same cost for any sigma. The borders are replicated.
+Image image_apply_box_blur(Image src, f32 sigma);
+
+#define BOX_BLUR_PASSES 3
+void box_blur_get_radii(f32 sigma, u32* radii);
+// The sigma blur switches to the box blur where it's faster than the separable kernel
+b32 gaussian_blur_uses_box(f32 sigma);
+
+// Coefficients in fixed point, scaled by the largest power of two up to 2^14 that keeps them in i16
+SeparableKernel separable_kernel_from_f32(const f32* coefficients, u32 tap_count);
+// 2 * ceil(3 * sigma) + 1 taps up to SEPARABLE_KERNEL_MAX_TAPS, they add up to 2^14
+SeparableKernel separable_kernel_gaussian(f32 sigma);
+
+// Gray -> blur -> sobel -> threshold without intermediate images, the source can be RGBA8 or I8. A
+// positive 'blur_sigma' replaces the blur distance and iterations with a single gaussian.
+Image image_apply_edge_detection_fused(Image src, BlurDistance blur_distance, u32 blur_iterations, f32 blur_sigma, SobelMagnitude magnitude, f32 threshold);
+
 Image load_image(String path);
-b32 save_image(String path, Image image);
+// Decoded with the channels of the file and converted to I8 while copying out of the decoder. Gray
+// and RGB files never allocate an RGBA image. RGBA and gray + alpha files are still decoded to
+// RGBA, alive during the copy.
+Image load_image_gray(String path, u32 apron, ImageBorder border);
+b32 save_image(String path, Image image, ImageFileFormat format);
+const char* image_file_format_get_extension(ImageFileFormat format);
 
 // Task System
 
 #define TASK_DATA_SIZE 128
 
 typedef void TaskFn(u32 index, void* user_data);
+typedef void TaskRangeFn(u32 begin, u32 end, void* user_data);
 
 struct TaskContext
 {
 	volatile i32 completed;
-	i32 dispatched;
+	volatile i32 dispatched;
 };
 
-b32  task_initialize();
+// The default worker count uses every core, the calling thread is the first worker
+b32  task_initialize(u32 worker_count = 0);
 void task_shutdown();
 
 void task_dispatch(TaskFn* fn, RawBuffer data, u32 task_count, TaskContext* context);
 void task_wait(TaskContext* context);
 b32  task_running(TaskContext* context);
 
+// Runs 'fn' over [begin, end) and waits for it. The range is split lazily in halves until the chunks
+// reach the grain, so idle workers steal the biggest halves first. The grain grows with the range to
+// keep a few chunks per worker, and chunk boundaries are multiples of 'alignment'.
+void task_parallel_for(u32 begin, u32 end, u32 grain, u32 alignment, TaskRangeFn* fn, RawBuffer data);
+
 void task_join();
 
+#define TASK_LATENCY_BUCKET_COUNT 16
+
+// Counters of a worker since the task system started, the worker 0 is the thread that initialized
+// it. Bucket i of the latency histogram counts the tasks that started less than 2^i microseconds
+// after their dispatch, the last bucket also counts the slower ones.
+struct TaskWorkerStats {
+	u64 executed_count;
+	u64 stolen_count; // Taken from the deque of another worker
+	u64 inline_count; // Run by 'task_wait' while waiting, or by 'task_dispatch' with a full deque
+	f64 busy_time;
+	f64 spin_time;    // Looking for tasks
+	f64 parked_time;  // Sleeping on the semaphore
+	u64 latency_histogram[TASK_LATENCY_BUCKET_COUNT];
+};
+
+Array<TaskWorkerStats> task_get_stats(Arena* arena);
+
+// Image Writer
+// Saves images on dedicated I/O threads. The image is copied into a pooled buffer, so the caller
+// can free it right away. The queue is bounded, saving blocks while it's full.
+
+b32  image_writer_initialize();
+void image_writer_shutdown();
+void image_writer_save(String path, Image image, ImageFileFormat format);
+void image_writer_flush();
+
+// Profiler
+// Begin and end events with the thread and the time, written to a ring buffer of each thread. The
+// trace is saved at shutdown in the Chrome trace format (chrome://tracing or ui.perfetto.dev).
+
+void profiler_begin(const char* name);
+void profiler_end();
+void profiler_set_thread_name(String name);
+b32  profiler_shutdown(String path); // The other threads must be done
+
 // Intrinsics & SIMD
 
+#if defined(_MSC_VER)
 #include <intrin.h>
 #define cpu_write_barrier() do { _WriteBarrier(); _mm_sfence(); } while(0)
 #define cpu_read_barrier() _ReadBarrier()
+#else
+#include <x86intrin.h>
+#define cpu_write_barrier() do { __asm__ __volatile__("" ::: "memory"); _mm_sfence(); } while(0)
+#define cpu_read_barrier() __asm__ __volatile__("" ::: "memory")
+#endif
 #define cpu_general_barrier() do { cpu_read_barrier(); cpu_write_barrier(); } while(0)
+#define cpu_full_barrier() do { cpu_read_barrier(); _mm_mfence(); } while(0) // Also orders stores with later loads
+
+// Row Kernels
+// Scalar, SSE4.1, AVX2 and AVX-512BW versions of the pixel loops, all of them give the same result.
+// The level is detected at startup, the 'SOBEL_SIMD' environment variable can force a lower one.
+
+enum SimdLevel {
+	SimdLevel_Scalar,
+	SimdLevel_SSE41,
+	SimdLevel_AVX2,
+	SimdLevel_AVX512BW,
+	SimdLevel_Count,
+};
 
-inline_fn void avx256_f32_from_u8(__m256* result, __m256i bytes)
-{
-	// u8 -> u16
-	__m256i u16_0 = _mm256_cvtepu8_epi16(_mm256_extracti128_si256(bytes, 0));
-	__m256i u16_1 = _mm256_cvtepu8_epi16(_mm256_extracti128_si256(bytes, 1));
-
-	// u16 -> u32
-	__m256i u32_0 = _mm256_cvtepu16_epi32(_mm256_extracti128_si256(u16_0, 0));
-	__m256i u32_1 = _mm256_cvtepu16_epi32(_mm256_extracti128_si256(u16_0, 1));
-	__m256i u32_2 = _mm256_cvtepu16_epi32(_mm256_extracti128_si256(u16_1, 0));
-	__m256i u32_3 = _mm256_cvtepu16_epi32(_mm256_extracti128_si256(u16_1, 1));
-
-	// u32 -> f32
-	__m256 f0 = _mm256_cvtepi32_ps(u32_0);
-	__m256 f1 = _mm256_cvtepi32_ps(u32_1);
-	__m256 f2 = _mm256_cvtepi32_ps(u32_2);
-	__m256 f3 = _mm256_cvtepi32_ps(u32_3);
-
-	result[0] = f0;
-	result[1] = f1;
-	result[2] = f2;
-	result[3] = f3;
-}
+// Passed as the threshold of the blend and sobel kernels to write the values, otherwise they write
+// (value > threshold) * 255 in the same pass
+#define ROW_THRESHOLD_NONE 0xFFFFFFFF
+
+#define ROW_KERNEL_MAX_TAPS SEPARABLE_KERNEL_MAX_TAPS
+
+struct RowKernels {
+	SimdLevel level;
+	void (*gray_from_rgba8)(u8* dst, const u8* src, u32 count);
+	void (*gray_from_rgb8)(u8* dst, const u8* src, u32 count);
+	void (*mult)(u8* dst, const u8* src, u32 count, f32 mult);
+	void (*blend)(u8* dst, const u8* src0, const u8* src1, u32 count, f32 factor, u32 threshold);
+	void (*threshold)(u8* dst, const u8* src, u32 count, u8 threshold);
+	// |sum(sources[t][x] * coefficients[t]) / normalize_factor| clamped to 255, up to ROW_KERNEL_MAX_TAPS
+	void (*kernel)(u8* dst, const u8* const* sources, const i32* coefficients, u32 tap_count, u32 count, u32 normalize_factor);
+	void (*sobel_magnitude)(u8* dst, const u8* top, const u8* mid, const u8* bot, u32 count, SobelMagnitude magnitude, u32 threshold);
+	// sums[x] += add[x] - sub[x], then dst[x] = round(sums[x] * scale). A step of a vertical running sum.
+	void (*box_sum)(u8* dst, i32* sums, const u8* add, const u8* sub, u32 count, f32 scale);
+	// Sum of 2 * radius + 1 pixels along the row times 'scale', the ends are replicated. 'prefix'
+	// has room for count + radius * 2 + 1 sums.
+	void (*box_blur)(u8* dst, const u8* src, i32* prefix, u32 count, u32 radius, f32 scale);
+};
 
-inline_fn __m256i avx256_u8_from_f32(__m256* floats)
-{
-	// f32 -> u32
-	__m256i u32_0 = _mm256_cvtps_epi32(floats[0]);
-	__m256i u32_1 = _mm256_cvtps_epi32(floats[1]);
-	__m256i u32_2 = _mm256_cvtps_epi32(floats[2]);
-	__m256i u32_3 = _mm256_cvtps_epi32(floats[3]);
-
-	// u32 -> u16
-	__m256i u16_0 = _mm256_packus_epi32(u32_0, u32_1);
-	__m256i u16_1 = _mm256_packus_epi32(u32_2, u32_3);
-	u16_0 = _mm256_permute4x64_epi64(u16_0, _MM_SHUFFLE(3, 1, 2, 0));
-	u16_1 = _mm256_permute4x64_epi64(u16_1, _MM_SHUFFLE(3, 1, 2, 0));
-
-	// u16 -> u8
-	__m256i bytes = _mm256_packus_epi16(u16_0, u16_1);
-	bytes = _mm256_permute4x64_epi64(bytes, _MM_SHUFFLE(3, 1, 2, 0));
-
-	return bytes;
-}
\ No newline at end of file
+global_var RowKernels row_kernels;
+
+void row_kernels_initialize(SimdLevel level);
+
+const char* simd_level_get_name(SimdLevel level);
+u32 simd_level_get_granularity(SimdLevel level);
+SimdLevel simd_level_select(SimdLevel supported); // Applies 'SOBEL_SIMD'
@@ -1,19 +1,80 @@
 #include "inc.h"
 
 AppGlobals app;
+thread_local Arena* temp_arena;
+
+// The apron lets the blur and sobel kernels process the border pixels too
+internal_fn u32 edge_detection_get_apron()
+{
+	if (!app.sett.border_apron || app.sett.fused_pipeline) return 0;
+	// The box blur replicates the borders by itself, only the sobel reads the apron
+	if (app.sett.blur_sigma > 0.f && gaussian_blur_uses_box(app.sett.blur_sigma)) return 1;
+	if (app.sett.blur_sigma > 0.f) return MAX(separable_kernel_gaussian(app.sett.blur_sigma).tap_count / 2, 1);
+	return 2;
+}
+
+// The RGBA original is only kept when it's saved, otherwise the image is converted to gray while loading
+internal_fn Image edge_detection_load(String path)
+{
+	if (app.sett.save_intermediates) return load_image(path);
+	return load_image_gray(path, edge_detection_get_apron(), ImageBorder_Replicate);
+}
+
+// Runs the edge detection with the current settings, the result is owned by the caller. The
+// original can be RGBA8 or I8.
+Image edge_detection(Image original)
+{
+	// The fused pipeline only produces the final mask, there are no intermediate stages to save
+	if (app.sett.fused_pipeline) {
+		return image_apply_edge_detection_fused(original, app.sett.blur_distance, app.sett.blur_iterations, app.sett.blur_sigma, app.sett.sobel_magnitude, app.sett.threshold);
+	}
+
+	u32 apron = edge_detection_get_apron();
+
+	// A gray original loaded with the apron is used as is
+	Image gray = original;
+	b32 owns_gray = original.format != ImageFormat_I8 || original.apron < apron;
+
+	if (owns_gray) gray = image_copy_with_apron(original, ImageFormat_I8, apron, ImageBorder_Replicate);
+	app_save_intermediate(gray, "gray");
+	DEFER(if (owns_gray) image_free(gray));
+
+	// A wide gaussian in one pass replaces the iterations of the small one
+	u32 blur_iterations = (app.sett.blur_sigma > 0.f) ? 1 : app.sett.blur_iterations;
+
+	Image blur = gray;
+	for (u32 it = 0; it < blur_iterations; ++it) {
+		Image new_blur = (app.sett.blur_sigma > 0.f) ? image_apply_gaussian_blur_sigma(blur, app.sett.blur_sigma) : image_apply_gaussian_blur(blur, app.sett.blur_distance);
+		app_save_intermediate(new_blur, "blur");
+		if (it != 0) image_free(blur);
+		blur = new_blur;
+	}
+	DEFER(if (blur._data != gray._data) image_free(blur));
+
+	// Without the sobel intermediate the mask comes out of the sobel pass
+	if (!app.sett.save_intermediates) {
+		return image_apply_sobel_threshold(blur, app.sett.sobel_magnitude, app.sett.threshold);
+	}
+
+	Image sobel = image_apply_sobel_convolution(blur, app.sett.sobel_magnitude);
+	app_save_intermediate(sobel, "sobel");
+	DEFER(image_free(sobel));
+
+	return image_apply_threshold(sobel, app.sett.threshold);
+}
 
 internal_fn void generate(const char* path, BlurDistance blur_distance, u32 blur_iterations, f32 threshold)
 {
 	PROFILE_SCOPE("Generate");
 
 	// Reset Temp Arena
-	arena_pop_to(app.temp_arena, 0);
+	arena_pop_to(temp_arena, 0);
 
 	app.sett.blur_distance = blur_distance;
 	app.sett.blur_iterations = blur_iterations;
 	app.sett.threshold = threshold;
 
-	Image original = load_image(path);
+	Image original = edge_detection_load(path);
 	DEFER(image_free(original));
 
 	if (image_is_invalid(original)) {
@@ -23,50 +84,277 @@ internal_fn void generate(const char* path, BlurDistance blur_distance, u32 blur
 
 	app_save_intermediate(original, "original");
 
-	Image gray = image_copy(original, ImageFormat_I8);
-	app_save_intermediate(gray, "gray");
-	DEFER(image_free(gray));
+	Image result = edge_detection(original);
+	app_save_intermediate(result, "result");
+	image_free(result);
+}
 
-	Image blur = gray;
-	for (u32 it = 0; it < app.sett.blur_iterations; ++it) {
-		Image new_blur = image_apply_gaussian_blur(blur, app.sett.blur_distance);
-		app_save_intermediate(new_blur, "blur");
-		if (it != 0) image_free(blur);
-		blur = new_blur;
+// Batch Mode
+// Images go through decode -> edge detection -> encode with several of them in flight. The edge
+// detection runs on the main thread, using the whole task system, while the decode of the next
+// images and the encode of the previous ones run as tasks.
+
+#define BATCH_DEFAULT_IN_FLIGHT 3
+
+struct BatchImage {
+	String path;
+	Image original;
+	Image result;
+	TaskContext decode_context;
+	TaskContext encode_context;
+};
+
+// File name without folders and extension
+internal_fn String path_get_name(String path)
+{
+	u64 begin = 0;
+	u64 end = path.size;
+
+	for (u64 i = 0; i < path.size; ++i) {
+		if (path.data[i] == '/' || path.data[i] == '\\') begin = i + 1;
 	}
 
-	Image sobel = image_apply_sobel_convolution(blur);
-	app_save_intermediate(sobel, "sobel");
-	DEFER(image_free(sobel));
+	for (u64 i = end; i > begin; --i) {
+		if (path.data[i - 1] == '.') {
+			end = i - 1;
+			break;
+		}
+	}
 
-	Image result = image_apply_threshold(sobel, app.sett.threshold);
-	app_save_intermediate(result, "result");
+	String name;
+	name.data = path.data + begin;
+	name.size = end - begin;
+	return name;
+}
+
+internal_fn void batch_decode_task(u32 index, void* _data)
+{
+	BatchImage* image = *(BatchImage**)_data;
+	image->original = edge_detection_load(image->path);
+}
+
+internal_fn void batch_encode_task(u32 index, void* _data)
+{
+	BatchImage* image = *(BatchImage**)_data;
+
+	String name = path_get_name(image->path);
+	const char* extension = image_file_format_get_extension(app.sett.output_format);
+	String path = string_format(temp_arena, "%s/%.*s.%s", app.intermediate_path.data, (i32)name.size, name.data, extension);
+
+	if (!save_image(path, image->result, app.sett.output_format)) printf("Can't save the image %s\n", path.data);
+
+	image_free(image->result);
+}
+
+internal_fn void batch(Array<String> paths, u32 in_flight)
+{
+	// One image is in edge detection and one in encode, the rest of the slots are decoded ahead
+	in_flight = MAX(in_flight, 3);
+	u32 decode_ahead = in_flight - 2;
+
+	BatchImage* slots = (BatchImage*)arena_push(app.static_arena, sizeof(BatchImage) * in_flight);
+
+	f64 start_time = timer_now();
+	u64 pixel_count = 0;
+	u32 image_count = 0;
+	u32 next_decode = 0;
+
+	for (u32 i = 0; i < paths.count; ++i)
+	{
+		// A slot is free once its previous image has been encoded
+		while (next_decode < paths.count && next_decode <= i + decode_ahead)
+		{
+			BatchImage* image = slots + next_decode % in_flight;
+			task_wait(&image->encode_context);
+
+			*image = {};
+			image->path = paths[next_decode++];
+			task_dispatch(batch_decode_task, { &image, sizeof(image) }, 1, &image->decode_context);
+		}
+
+		BatchImage* image = slots + i % in_flight;
+		task_wait(&image->decode_context);
+
+		if (image_is_invalid(image->original)) {
+			printf("Can't load the image %s\n", image->path.data);
+			continue;
+		}
+
+		image->result = edge_detection(image->original);
+		pixel_count += (u64)image->original.width * image->original.height;
+		image_count++;
+
+		image_free(image->original);
+		image->original = IMG_INVALID;
+
+		task_dispatch(batch_encode_task, { &image, sizeof(image) }, 1, &image->encode_context);
+	}
+
+	for (u32 i = 0; i < in_flight; ++i) task_wait(&slots[i].encode_context);
+
+	f64 seconds = timer_now() - start_time;
+	f64 images_per_second = (seconds > 0.0) ? image_count / seconds : 0.0;
+	f64 mpix_per_second = (seconds > 0.0) ? (pixel_count / 1000000.0) / seconds : 0.0;
+
+	printf("Batch: %u images in %s, %.2f images/s, %.2f MPix/s\n", image_count, string_format_time(seconds).data, images_per_second, mpix_per_second);
+}
+
+// Upper bound in microseconds of the bucket that reaches the fraction of the tasks
+internal_fn u64 latency_get_percentile(const u64* histogram, f64 fraction)
+{
+	u64 total = 0;
+	for (u32 i = 0; i < TASK_LATENCY_BUCKET_COUNT; ++i) total += histogram[i];
+
+	u64 count = 0;
+	for (u32 i = 0; i < TASK_LATENCY_BUCKET_COUNT; ++i) {
+		count += histogram[i];
+		if (count > 0 && count >= total * fraction) return 1ULL << i;
+	}
+	return 0;
+}
+
+internal_fn void print_task_stats(Array<TaskWorkerStats> stats)
+{
+	for (u32 i = 0; i < stats.count; ++i)
+	{
+		TaskWorkerStats s = stats[i];
+
+		printf("Task worker %u: %llu tasks (%llu stolen, %llu inline), busy %s, spin %s, parked %s, dispatch to start p50 < %llu us, p99 < %llu us\n",
+			i, (unsigned long long)s.executed_count, (unsigned long long)s.stolen_count, (unsigned long long)s.inline_count,
+			string_format_time(s.busy_time).data, string_format_time(s.spin_time).data, string_format_time(s.parked_time).data,
+			(unsigned long long)latency_get_percentile(s.latency_histogram, 0.5), (unsigned long long)latency_get_percentile(s.latency_histogram, 0.99));
+	}
 }
 
-int main()
+int main(int argc, char** argv)
 {
 	os_initialize();
 	app.sett.save_intermediates = true;
 	app.sett.enable_profiler = true;
+	app.sett.fused_pipeline = false;
+	app.sett.border_apron = false;
+	app.sett.sobel_magnitude = SobelMagnitude_L1;
+	app.sett.output_format = ImageFileFormat_PNG;
+	app.sett.png_compression_level = 8;
+
+	// Inputs of the batch mode, each one is a folder or an image
+	Array<String> batch_inputs = array_make((String*)arena_push(app.static_arena, sizeof(String) * argc), 0);
+	u32 batch_in_flight = BATCH_DEFAULT_IN_FLIGHT;
+	b32 batch_mode = false;
+	b32 bench_mode = false;
+	u32 bench_max_size = 16384;
+	b32 validate_mode = false;
+	u32 validate_seed = 1;
+
+	for (i32 i = 1; i < argc; ++i) {
+		if (strcmp(argv[i], "--fused") == 0) app.sett.fused_pipeline = true;
+		if (strcmp(argv[i], "--sobel-l2") == 0) app.sett.sobel_magnitude = SobelMagnitude_L2Approx;
+		if (strcmp(argv[i], "--apron") == 0) app.sett.border_apron = true;
+		if (strcmp(argv[i], "--blur-sigma") == 0 && i + 1 < argc) app.sett.blur_sigma = (f32)atof(argv[++i]);
+		if (strcmp(argv[i], "--in-flight") == 0 && i + 1 < argc) batch_in_flight = (u32)atoi(argv[++i]);
+		if (strcmp(argv[i], "--bench") == 0) bench_mode = true;
+		if (strcmp(argv[i], "--bench-max-size") == 0 && i + 1 < argc) bench_max_size = (u32)atoi(argv[++i]);
+		if (strcmp(argv[i], "--validate") == 0) validate_mode = true;
+		if (strcmp(argv[i], "--validate-seed") == 0 && i + 1 < argc) validate_seed = (u32)atoi(argv[++i]);
+		if (strcmp(argv[i], "--png-level") == 0 && i + 1 < argc) app.sett.png_compression_level = atoi(argv[++i]);
+		if (strcmp(argv[i], "--format") == 0 && i + 1 < argc) {
+			const char* format = argv[++i];
+			if (strcmp(format, "pnm") == 0) app.sett.output_format = ImageFileFormat_PNM;
+			else if (strcmp(format, "raw") == 0) app.sett.output_format = ImageFileFormat_Raw;
+			else app.sett.output_format = ImageFileFormat_PNG;
+		}
+		if (strcmp(argv[i], "--batch") == 0) {
+			batch_mode = true;
+			while (i + 1 < argc && strncmp(argv[i + 1], "--", 2) != 0) batch_inputs.data[batch_inputs.count++] = argv[++i];
+		}
+	}
 	app.intermediate_path = "images/result/";
 
+	// The batch mode only saves the results
+	if (batch_mode) {
+		app.sett.save_intermediates = false;
+		app.sett.blur_distance = BlurDistance_5;
+		app.sett.blur_iterations = 1;
+		app.sett.threshold = 0.3f;
+	}
+
+	printf("SIMD level: %s\n", simd_level_get_name((SimdLevel)app.os.simd_level));
+
+	// The benchmark starts the task system on its own, only the results are saved
+	if (bench_mode) {
+		app.sett.save_intermediates = false;
+		app.sett.enable_profiler = false;
+		os_create_folder(app.intermediate_path);
+
+		b32 result = bench_run(bench_max_size, string_format(app.static_arena, "%s/bench.json", app.intermediate_path.data));
+		image_pool_trim();
+		os_shutdown();
+		return result ? 0 : -1;
+	}
+
+	// The validation starts the task system on its own, nothing is saved
+	if (validate_mode) {
+		app.sett.save_intermediates = false;
+		app.sett.enable_profiler = false;
+
+		b32 result = validate_run(validate_seed);
+		image_pool_trim();
+		os_shutdown();
+		return result ? 0 : -1;
+	}
+
+	profiler_set_thread_name("Main");
 	PROFILE_BEGIN("Main");
 
 	if (!task_initialize()) return -1;
+	if (!image_writer_initialize()) return -1;
 
 	os_remove_folder(app.intermediate_path);
 	os_create_folder(app.intermediate_path);
 
-	generate("images/samples/valencia.jpg", BlurDistance_5, 1, 0.2f);
-	generate("images/samples/city.png", BlurDistance_5, 3, 0.3f);
-	generate("images/samples/fruit_low_res.png", BlurDistance_3, 0, 0.7f);
-	generate("images/samples/glimmer_chain_asset.png", BlurDistance_5, 1, 0.3f);
-	generate("images/samples/taj.png", BlurDistance_5, 1, 0.4f);
+	if (batch_mode)
+	{
+		u32 path_count = 0;
+		Array<String>* inputs = (Array<String>*)arena_push(app.static_arena, sizeof(Array<String>) * batch_inputs.count);
+
+		for (u32 i = 0; i < batch_inputs.count; ++i) {
+			if (!os_list_files(app.static_arena, batch_inputs[i], &inputs[i])) inputs[i] = array_make(&batch_inputs[i], 1);
+			path_count += inputs[i].count;
+		}
+
+		Array<String> paths = array_make((String*)arena_push(app.static_arena, sizeof(String) * path_count), 0);
+		for (u32 i = 0; i < batch_inputs.count; ++i) {
+			for (u32 j = 0; j < inputs[i].count; ++j) paths.data[paths.count++] = inputs[i][j];
+		}
+
+		batch(paths, batch_in_flight);
+	}
+	else
+	{
+		generate("images/samples/valencia.jpg", BlurDistance_5, 1, 0.2f);
+		generate("images/samples/city.png", BlurDistance_5, 3, 0.3f);
+		generate("images/samples/fruit_low_res.png", BlurDistance_3, 0, 0.7f);
+		generate("images/samples/glimmer_chain_asset.png", BlurDistance_5, 1, 0.3f);
+		generate("images/samples/taj.png", BlurDistance_5, 1, 0.4f);
+	}
+
+	image_writer_shutdown();
 
+	Array<TaskWorkerStats> task_stats = task_get_stats(app.static_arena);
 	task_shutdown();
 
 	PROFILE_END();
 
+	if (app.sett.enable_profiler) {
+		String trace_path = string_format(temp_arena, "%s/trace.json", app.intermediate_path.data);
+		if (!profiler_shutdown(trace_path)) printf("Can't save the profiler trace %s\n", trace_path.data);
+		print_task_stats(task_stats);
+	}
+
+	ImagePoolStats pool = image_pool_get_stats();
+	printf("Image pool: %llu/%llu hits, %.1f MB peak resident\n", (unsigned long long)pool.hit_count, (unsigned long long)pool.acquire_count, (f64)pool.peak_resident_bytes / MB(1));
+	image_pool_trim();
+
 	os_shutdown();
 	return 0;
 }
@@ -75,11 +363,12 @@ void app_save_intermediate(Image image, String name)
 {
 	if (!app.sett.save_intermediates) return;
 
-	const char* cname = string_copy(app.temp_arena, name).data;
+	const char* cname = string_copy(temp_arena, name).data;
 
-	String path = string_format(app.temp_arena, "%s/%u_%s.png", app.intermediate_path.data, app.intermediate_image_saves_counter++, cname);
+	const char* extension = image_file_format_get_extension(app.sett.output_format);
+	String path = string_format(temp_arena, "%s/%u_%s.%s", app.intermediate_path.data, app.intermediate_image_saves_counter++, cname, extension);
 
-	if (save_image(path, image)) printf("Saved intermediate: %s\n", cname);
-	else printf("Can't save intermediate image\n");
+	// Encoded in the background, the writer keeps its own copy of the image
+	image_writer_save(path, image, app.sett.output_format);
 }
 
@@ -0,0 +1,521 @@
+#include "inc.h"
+
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sched.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+#define LINUX_HUGE_PAGE_SIZE MB(2)
+
+// Image memory is mapped with a small header in front of the pointer returned to the user,
+// munmap needs the original mapping to release it. The header is 64 bytes so the user memory
+// keeps the SIMD alignment.
+struct LinuxImageHeader {
+    void* map_base;
+    u64 map_size;
+    u8 _padding[48];
+};
+
+static_assert(sizeof(LinuxImageHeader) == 64);
+
+struct LinuxSemaphore {
+    volatile u32 count;
+    volatile u32 waiters;
+    u32 max_count;
+};
+
+internal_fn u32 linux_get_cache_line_size()
+{
+    long size = sysconf(_SC_LEVEL1_DCACHE_LINESIZE);
+    return (size > 0) ? (u32)size : 64;
+}
+
+internal_fn u32 linux_get_l2_cache_size()
+{
+    long size = sysconf(_SC_LEVEL2_CACHE_SIZE);
+    return (size > 0) ? (u32)size : (u32)KB(256);
+}
+
+// CPUs the process may run on, read once at startup. The affinity mask respects taskset, cpusets
+// and container limits, the logic cores are numbered over its set bits.
+static cpu_set_t linux_allowed_cpus;
+static u32 linux_allowed_cpu_count;
+
+internal_fn void linux_read_allowed_cpus()
+{
+    CPU_ZERO(&linux_allowed_cpus);
+    if (sched_getaffinity(0, sizeof(linux_allowed_cpus), &linux_allowed_cpus) == 0) {
+        i32 count = CPU_COUNT(&linux_allowed_cpus);
+        if (count > 0) {
+            linux_allowed_cpu_count = (u32)count;
+            return;
+        }
+    }
+
+    // Unknown mask, all the online CPUs
+    long count = sysconf(_SC_NPROCESSORS_ONLN);
+    linux_allowed_cpu_count = (u32)MIN(MAX(count, 1), CPU_SETSIZE);
+
+    CPU_ZERO(&linux_allowed_cpus);
+    for (u32 i = 0; i < linux_allowed_cpu_count; ++i) CPU_SET(i, &linux_allowed_cpus);
+}
+
+// The CPU number of the n-th allowed CPU
+internal_fn i32 linux_get_allowed_cpu(u32 index)
+{
+    for (i32 cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+        if (!CPU_ISSET(cpu, &linux_allowed_cpus)) continue;
+        if (index == 0) return cpu;
+        index--;
+    }
+    return -1;
+}
+
+// The builtins check the CPUID bits and that the OS saves the vector registers
+internal_fn SimdLevel linux_get_simd_level()
+{
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw")) return SimdLevel_AVX512BW;
+    if (__builtin_cpu_supports("avx2")) return SimdLevel_AVX2;
+    if (__builtin_cpu_supports("sse4.1")) return SimdLevel_SSE41;
+    return SimdLevel_Scalar;
+}
+
+void os_initialize()
+{
+    app.os.page_size = (u32)sysconf(_SC_PAGESIZE);
+    app.os.cache_line_size = linux_get_cache_line_size();
+    app.os.l2_cache_size = linux_get_l2_cache_size();
+    linux_read_allowed_cpus();
+    app.os.logic_core_count = MAX(linux_allowed_cpu_count, 1);
+
+    SimdLevel simd_level = simd_level_select(linux_get_simd_level());
+    app.os.simd_level = simd_level;
+    app.os.simd_granularity = simd_level_get_granularity(simd_level);
+    app.os.min_pixels_per_task = KB(4);
+    app.os.pixels_padding = app.os.simd_granularity;
+    row_kernels_initialize(simd_level);
+
+    app.os.timer_frequency = 1000000000ULL;
+    app.os.timer_start_counter = os_get_time_counter();
+
+    temp_arena = arena_alloc();
+    app.static_arena = arena_alloc();
+}
+
+void os_shutdown()
+{
+    arena_free(temp_arena);
+    arena_free(app.static_arena);
+}
+
+Arena* arena_alloc()
+{
+    Arena* arena = (Arena*)memory_allocate(sizeof(Arena));
+
+    u64 reserve_size = GB(16);
+    arena->reserved_pages = (u32)u64_divide_high(reserve_size, app.os.page_size);
+    arena->committed_pages = 0;
+
+    u64 map_size = (u64)arena->reserved_pages * (u64)app.os.page_size;
+    void* data = mmap(NULL, map_size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    arena->data = (data == MAP_FAILED) ? NULL : (u8*)data;
+    arena->size = 0;
+    return arena;
+}
+
+void arena_free(Arena* arena) {
+    munmap(arena->data, (u64)arena->reserved_pages * (u64)app.os.page_size);
+    memory_free(arena);
+}
+
+void* arena_push(Arena* arena, u64 size) {
+    return arena_push_align(arena, size, app.os.cache_line_size);
+}
+
+void* arena_push_align(Arena* arena, u64 user_size, u64 alignment)
+{
+    u64 page_size = app.os.page_size;
+
+    u64 align_offset = (arena->size % alignment == 0) ? 0 : (alignment - (arena->size % alignment));
+    u64 aligned_size = user_size + align_offset;
+
+    u64 new_size = arena->size + aligned_size;
+    u32 commited_pages_needed = (u32)u64_divide_high(new_size, app.os.page_size);
+
+    if (commited_pages_needed > arena->committed_pages)
+    {
+        u32 commit_pages = MAX(commited_pages_needed - arena->committed_pages, 4);
+        commit_pages = MIN(commit_pages, arena->reserved_pages - arena->committed_pages);
+
+        u8* commit_ptr = arena->data + arena->committed_pages * page_size;
+        mprotect(commit_ptr, commit_pages * page_size, PROT_READ | PROT_WRITE);
+
+        arena->committed_pages += commit_pages;
+    }
+
+    u8* ptr = arena->data + arena->size + align_offset;
+    arena->size += aligned_size;
+
+    assert((u64)ptr % alignment == 0);
+
+    return ptr;
+}
+
+void arena_pop_to(Arena* arena, u64 size)
+{
+    if (arena->size <= size) {
+        assert(0);
+        return;
+    }
+
+    u64 free_bytes_size = arena->size - size;
+
+    memory_zero(arena->data + size, free_bytes_size);
+    arena->size = size;
+}
+
+void* os_allocate_image_memory(u64 pixels, u32 pixel_stride)
+{
+    // Extra memory to safely overflow the buffer using SIMD
+    u32 pixels_extra = u32_divide_high(app.os.pixels_padding, pixel_stride);
+    u64 size = (pixels + pixels_extra) * (u64)pixel_stride;
+    u64 header_size = sizeof(LinuxImageHeader);
+
+    u8* map_base = NULL;
+    u8* header = NULL;
+    u64 map_size = 0;
+
+    // Big images are backed by huge pages to reduce TLB misses when streaming them. Explicit
+    // huge pages need to be reserved by the system, otherwise fallback to transparent huge pages.
+    if (size >= LINUX_HUGE_PAGE_SIZE)
+    {
+        map_size = u64_divide_high(size + header_size, LINUX_HUGE_PAGE_SIZE) * LINUX_HUGE_PAGE_SIZE;
+        void* ptr = mmap(NULL, map_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+
+        if (ptr != MAP_FAILED) {
+            map_base = (u8*)ptr;
+            header = map_base;
+        }
+        else
+        {
+            // Over-reserve to align the user memory to the huge page size, THP only backs aligned ranges
+            map_size = size + header_size + LINUX_HUGE_PAGE_SIZE;
+            ptr = mmap(NULL, map_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if (ptr == MAP_FAILED) return NULL;
+
+            map_base = (u8*)ptr;
+            u64 aligned = u64_divide_high((u64)map_base + header_size, LINUX_HUGE_PAGE_SIZE) * LINUX_HUGE_PAGE_SIZE;
+            header = (u8*)aligned - header_size;
+
+            madvise((void*)aligned, size, MADV_HUGEPAGE);
+        }
+    }
+    else
+    {
+        map_size = size + header_size;
+        void* ptr = mmap(NULL, map_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (ptr == MAP_FAILED) return NULL;
+
+        map_base = (u8*)ptr;
+        header = map_base;
+    }
+
+    LinuxImageHeader* h = (LinuxImageHeader*)header;
+    h->map_base = map_base;
+    h->map_size = map_size;
+
+    return header + header_size;
+}
+
+void os_free_image_memory(void* ptr)
+{
+    if (ptr == NULL) return;
+
+    LinuxImageHeader* h = (LinuxImageHeader*)ptr - 1;
+    munmap(h->map_base, h->map_size);
+}
+
+b32 os_remove_folder(String path)
+{
+    String path0 = string_copy(temp_arena, path);
+    return rmdir(path0.data) == 0;
+}
+
+b32 os_create_folder(String path)
+{
+    String path0 = string_copy(temp_arena, path);
+
+    b32 result = mkdir(path0.data, 0755) == 0;
+
+    if (!result) {
+        b32 already_exists = errno == EEXIST;
+        if (already_exists) result = true;
+    }
+
+    return result;
+}
+
+b32 os_list_files(Arena* arena, String path, Array<String>* files)
+{
+    String path0 = string_copy(temp_arena, path);
+
+    DIR* dir = opendir(path0.data);
+    if (dir == NULL) return false;
+
+    // First pass counts the files, the second one fills the array
+    u32 count = 0;
+    u32 capacity = 0;
+    String* data = NULL;
+
+    for (u32 pass = 0; pass < 2; ++pass)
+    {
+        if (pass == 1) {
+            capacity = count;
+            data = (String*)arena_push(arena, sizeof(String) * capacity);
+            count = 0;
+            rewinddir(dir);
+        }
+
+        while (struct dirent* entry = readdir(dir))
+        {
+            String file_path = string_format(temp_arena, "%s/%s", path0.data, entry->d_name);
+
+            struct stat st;
+            if (stat(file_path.data, &st) != 0 || !S_ISREG(st.st_mode)) continue;
+
+            if (pass == 1) {
+                if (count == capacity) break;
+                data[count] = string_copy(arena, file_path);
+            }
+            count++;
+        }
+    }
+
+    closedir(dir);
+
+    *files = array_make(data, count);
+    return true;
+}
+
+b32 os_file_map_read(String path, FileMap* map)
+{
+    String path0 = string_copy(temp_arena, path);
+
+    int fd = open(path0.data, O_RDONLY);
+    if (fd < 0) return false;
+    DEFER(close(fd));
+
+    struct stat st;
+    if (fstat(fd, &st) != 0) return false;
+
+    *map = {};
+    map->size = (u64)st.st_size;
+
+    if (map->size == 0) return true;
+
+    void* ptr = mmap(NULL, map->size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (ptr == MAP_FAILED) return false;
+
+    map->data = (u8*)ptr;
+    return true;
+}
+
+b32 os_file_map_write(String path, u64 size, FileMap* map)
+{
+    String path0 = string_copy(temp_arena, path);
+
+    int fd = open(path0.data, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) return false;
+
+    // The mapping keeps the file alive, the descriptor is not needed after mmap
+    DEFER(close(fd));
+
+    if (ftruncate(fd, (off_t)size) != 0) return false;
+
+    *map = {};
+    map->size = size;
+
+    if (size == 0) return true;
+
+    void* ptr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (ptr == MAP_FAILED) return false;
+
+    map->data = (u8*)ptr;
+    return true;
+}
+
+void os_file_unmap(FileMap map)
+{
+    if (map.data == NULL) return;
+    munmap(map.data, map.size);
+}
+
+u64 os_get_time_counter()
+{
+    timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (u64)now.tv_sec * 1000000000ULL + (u64)now.tv_nsec;
+}
+
+internal_fn void* linux_thread_main(void* thread_data)
+{
+    ThreadFn* fn = *(ThreadFn**)thread_data;
+    void* user_data = (ThreadFn**)thread_data + 1;
+
+    i32 ret = fn(user_data);
+
+    memory_free(thread_data);
+
+    return (void*)(i64)ret;
+}
+
+Thread os_thread_start(ThreadFn* fn, RawBuffer data)
+{
+    u32 size_needed = sizeof(ThreadFn*);
+    size_needed += (u32)data.size;
+
+    ThreadFn** thread_data = (ThreadFn**)memory_allocate(size_needed, true);
+    *thread_data = fn;
+
+    u8* user_data = (u8*)(thread_data + 1);
+    memory_copy(user_data, data.data, data.size);
+
+    pthread_t handle;
+    if (pthread_create(&handle, NULL, linux_thread_main, thread_data) != 0) {
+        memory_free(thread_data);
+        return {};
+    }
+
+    Thread thread{};
+    thread.value = (u64)handle;
+    return thread;
+}
+
+void os_thread_wait(Thread thread)
+{
+    if (thread.value) pthread_join((pthread_t)thread.value, NULL);
+    assert(thread.value && "The thread must be valid");
+}
+
+void os_thread_wait_array(Thread* threads, u32 count) {
+    for (u32 i = 0; i < count; ++i) {
+        os_thread_wait(threads[i]);
+    }
+}
+
+void os_thread_yield() {
+    sched_yield();
+}
+
+b32 os_thread_pin(Thread thread, u32 logic_core)
+{
+    if (thread.value == 0) return false;
+
+    i32 cpu = linux_get_allowed_cpu(logic_core % MAX(linux_allowed_cpu_count, 1));
+    if (cpu < 0) return false;
+
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    return pthread_setaffinity_np((pthread_t)thread.value, sizeof(set), &set) == 0;
+}
+
+internal_fn i64 linux_futex(volatile u32* addr, i32 op, u32 value, const timespec* timeout) {
+    return syscall(SYS_futex, (u32*)addr, op, value, timeout, NULL, 0);
+}
+
+Semaphore os_semaphore_create(u32 initial_count, u32 max_count)
+{
+    LinuxSemaphore* s = (LinuxSemaphore*)memory_allocate(sizeof(LinuxSemaphore), true);
+    s->count = initial_count;
+    s->waiters = 0;
+    s->max_count = max_count;
+
+    Semaphore sem{};
+    sem.value = (u64)s;
+    return sem;
+}
+
+void os_semaphore_wait(Semaphore semaphore, u32 millis)
+{
+    assert(semaphore.value);
+    if (semaphore.value == 0) return;
+
+    LinuxSemaphore* s = (LinuxSemaphore*)semaphore.value;
+
+    u64 deadline = os_get_time_counter() + (u64)millis * 1000000ULL;
+
+    while (true)
+    {
+        u32 count = s->count;
+        if (count > 0) {
+            if (interlock_exchange_u32(&s->count, count, count - 1) == count) return;
+            continue;
+        }
+
+        u64 now = os_get_time_counter();
+        if (now >= deadline) return;
+
+        u64 remaining = deadline - now;
+        timespec timeout;
+        timeout.tv_sec = (time_t)(remaining / 1000000000ULL);
+        timeout.tv_nsec = (long)(remaining % 1000000000ULL);
+
+        // Sleeps only while the count is still zero, a release in between makes it return at once
+        interlock_increment_u32(&s->waiters);
+        linux_futex(&s->count, FUTEX_WAIT_PRIVATE, 0, &timeout);
+        interlock_decrement_u32(&s->waiters);
+    }
+}
+
+b32 os_semaphore_release(Semaphore semaphore, u32 count)
+{
+    assert(semaphore.value);
+    if (semaphore.value == 0) return false;
+
+    LinuxSemaphore* s = (LinuxSemaphore*)semaphore.value;
+
+    while (true)
+    {
+        u32 current = s->count;
+
+        // Same as Win32: exceeding the maximum count fails without changing the semaphore
+        if ((u64)current + (u64)count > (u64)s->max_count) return false;
+
+        if (interlock_exchange_u32(&s->count, current, current + count) == current) break;
+    }
+
+    cpu_general_barrier();
+    if (s->waiters) linux_futex(&s->count, FUTEX_WAKE_PRIVATE, count, NULL);
+
+    return true;
+}
+
+void os_semaphore_destroy(Semaphore semaphore)
+{
+    if (semaphore.value == 0) return;
+
+    LinuxSemaphore* s = (LinuxSemaphore*)semaphore.value;
+    memory_free(s);
+}
+
+u32 interlock_increment_u32(volatile u32* n) {
+    return __atomic_add_fetch(n, 1, __ATOMIC_SEQ_CST);
+}
+u32 interlock_decrement_u32(volatile u32* n) {
+    return __atomic_sub_fetch(n, 1, __ATOMIC_SEQ_CST);
+}
+u32 interlock_exchange_u32(volatile u32* dst, u32 compare, u32 exchange) {
+    return __sync_val_compare_and_swap(dst, compare, exchange);
+}
+u32 interlock_add_u32(volatile u32* n, u32 value) {
+    return __atomic_add_fetch(n, value, __ATOMIC_SEQ_CST);
+}
@@ -8,32 +8,106 @@
 
 #include "Windows.h"
 
-internal_fn u32 windows_get_cache_line_size()
+internal_fn b32 windows_get_cache_info(u32 level, CACHE_RELATIONSHIP* result)
 {
     DWORD buffer_size = 0;
     GetLogicalProcessorInformationEx(RelationCache, NULL, &buffer_size);
 
-    if (buffer_size == 0) return 0;
+    if (buffer_size == 0) return false;
 
     BYTE* buffer = (BYTE*)memory_allocate(buffer_size, 0);
     DEFER(memory_free(buffer));
 
     if (!GetLogicalProcessorInformationEx(RelationCache, (PSYSTEM_LOGICAL_PROCESSOR_INFORMATION_EX)buffer, &buffer_size)) {
-        return 0;
+        return false;
     }
 
     PSYSTEM_LOGICAL_PROCESSOR_INFORMATION_EX info = (PSYSTEM_LOGICAL_PROCESSOR_INFORMATION_EX)buffer;
     while (buffer_size > 0)
     {
-        if (info->Relationship == RelationCache && info->Cache.Level == 1 && (info->Cache.Type == CacheUnified || info->Cache.Type == CacheData)) {
-            return info->Cache.LineSize;
+        if (info->Relationship == RelationCache && info->Cache.Level == level && (info->Cache.Type == CacheUnified || info->Cache.Type == CacheData)) {
+            *result = info->Cache;
+            return true;
         }
 
         buffer_size -= info->Size;
         info = (PSYSTEM_LOGICAL_PROCESSOR_INFORMATION_EX)((BYTE*)info + info->Size);
     }
 
-    return 0;
+    return false;
+}
+
+internal_fn u32 windows_get_cache_line_size()
+{
+    CACHE_RELATIONSHIP cache;
+    if (!windows_get_cache_info(1, &cache)) return 0;
+    return cache.LineSize;
+}
+
+internal_fn u32 windows_get_l2_cache_size()
+{
+    CACHE_RELATIONSHIP cache;
+    if (!windows_get_cache_info(2, &cache)) return KB(256);
+    return cache.CacheSize;
+}
+
+internal_fn SimdLevel windows_get_simd_level()
+{
+    int info[4];
+    __cpuid(info, 0);
+    int max_leaf = info[0];
+
+    __cpuid(info, 1);
+    b32 sse41 = (info[2] >> 19) & 1;
+    b32 osxsave = (info[2] >> 27) & 1;
+    b32 avx = (info[2] >> 28) & 1;
+
+    if (!sse41) return SimdLevel_Scalar;
+
+    // The OS must save the YMM registers (XCR0 bits 1-2), and the ZMM ones for AVX-512 (bits 5-7)
+    u64 xcr0 = osxsave ? _xgetbv(0) : 0;
+    if (!avx || (xcr0 & 0x6) != 0x6 || max_leaf < 7) return SimdLevel_SSE41;
+
+    __cpuidex(info, 7, 0);
+    b32 avx2 = (info[1] >> 5) & 1;
+    b32 avx512f = (info[1] >> 16) & 1;
+    b32 avx512bw = (info[1] >> 30) & 1;
+
+    if (!avx2) return SimdLevel_SSE41;
+    if (avx512f && avx512bw && (xcr0 & 0xE6) == 0xE6) return SimdLevel_AVX512BW;
+    return SimdLevel_AVX2;
+}
+
+// Cores the process may run on, read once at startup. The logic cores are numbered over the set
+// bits, affinity masks only cover the first processor group (64 logic cores).
+static DWORD_PTR windows_allowed_cores;
+static u32 windows_allowed_core_count;
+
+internal_fn void windows_read_allowed_cores(u32 processor_count)
+{
+    DWORD_PTR process_mask = 0;
+    DWORD_PTR system_mask = 0;
+    if (!GetProcessAffinityMask(GetCurrentProcess(), &process_mask, &system_mask) || process_mask == 0) {
+        process_mask = 0;
+        for (u32 i = 0; i < MIN(processor_count, 64); ++i) process_mask |= (DWORD_PTR)1 << i;
+    }
+
+    windows_allowed_cores = process_mask;
+    windows_allowed_core_count = 0;
+    for (u32 i = 0; i < 64; ++i) {
+        if (process_mask & ((DWORD_PTR)1 << i)) windows_allowed_core_count++;
+    }
+}
+
+// The core number of the n-th allowed core
+internal_fn i32 windows_get_allowed_core(u32 index)
+{
+    for (i32 core = 0; core < 64; ++core) {
+        if (!(windows_allowed_cores & ((DWORD_PTR)1 << core))) continue;
+        if (index == 0) return core;
+        index--;
+    }
+    return -1;
 }
 
 void os_initialize()
@@ -45,11 +119,16 @@ void os_initialize()
     GetSystemInfo(&system_info);
     app.os.page_size = system_info.dwAllocationGranularity;
     app.os.cache_line_size = windows_get_cache_line_size();
-    app.os.logic_core_count = MAX(system_info.dwNumberOfProcessors, 1);
-
-    app.os.simd_granularity = 32; // AVX-256
-    app.os.pixels_per_thread = u32_divide_high(5000, 64) * 64;
+    app.os.l2_cache_size = windows_get_l2_cache_size();
+    windows_read_allowed_cores(system_info.dwNumberOfProcessors);
+    app.os.logic_core_count = MAX(windows_allowed_core_count, 1);
+
+    SimdLevel simd_level = simd_level_select(windows_get_simd_level());
+    app.os.simd_level = simd_level;
+    app.os.simd_granularity = simd_level_get_granularity(simd_level);
+    app.os.min_pixels_per_task = KB(4);
     app.os.pixels_padding = app.os.simd_granularity;
+    row_kernels_initialize(simd_level);
 
     LARGE_INTEGER windows_clock_frequency;
     QueryPerformanceFrequency(&windows_clock_frequency);
@@ -59,13 +138,13 @@ void os_initialize()
     QueryPerformanceCounter(&windows_begin_time);
     app.os.timer_start_counter = windows_begin_time.QuadPart;
 
-    app.temp_arena = arena_alloc();
+    temp_arena = arena_alloc();
     app.static_arena = arena_alloc();
 }
 
 void os_shutdown()
 {
-    arena_free(app.temp_arena);
+    arena_free(temp_arena);
     arena_free(app.static_arena);
 }
 
@@ -131,11 +210,11 @@ void arena_pop_to(Arena* arena, u64 size)
     arena->size = size;
 }
 
-void* os_allocate_image_memory(u32 pixels, u32 pixel_stride)
+void* os_allocate_image_memory(u64 pixels, u32 pixel_stride)
 {
     // Extra memory to safely overflow the buffer using SIMD
     u32 pixels_extra = u32_divide_high(app.os.pixels_padding, pixel_stride);
-    u64 size = (u64)(pixels + pixels_extra) * (u64)pixel_stride;
+    u64 size = (pixels + pixels_extra) * (u64)pixel_stride;
     
     return VirtualAlloc(NULL, size, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
 }
@@ -147,13 +226,13 @@ void os_free_image_memory(void* ptr)
 
 b32 os_remove_folder(String path)
 {
-    String path0 = string_copy(app.temp_arena, path);
+    String path0 = string_copy(temp_arena, path);
     return (b8)RemoveDirectoryA(path0.data);
 }
 
 b32 os_create_folder(String path)
 {
-    String path0 = string_copy(app.temp_arena, path);
+    String path0 = string_copy(temp_arena, path);
 
     b32 result = (b32)CreateDirectoryA(path0.data, NULL);
 
@@ -165,6 +244,134 @@ b32 os_create_folder(String path)
     return result;
 }
 
+b32 os_list_files(Arena* arena, String path, Array<String>* files)
+{
+    String path0 = string_copy(temp_arena, path);
+    String pattern = string_format(temp_arena, "%s\\*", path0.data);
+
+    DWORD attributes = GetFileAttributesA(path0.data);
+    if (attributes == INVALID_FILE_ATTRIBUTES || (attributes & FILE_ATTRIBUTE_DIRECTORY) == 0) return false;
+
+    // First pass counts the files, the second one fills the array
+    u32 count = 0;
+    u32 capacity = 0;
+    String* data = NULL;
+
+    for (u32 pass = 0; pass < 2; ++pass)
+    {
+        if (pass == 1) {
+            capacity = count;
+            data = (String*)arena_push(arena, sizeof(String) * capacity);
+            count = 0;
+        }
+
+        WIN32_FIND_DATAA find_data;
+        HANDLE find = FindFirstFileA(pattern.data, &find_data);
+        if (find == INVALID_HANDLE_VALUE) break;
+
+        do
+        {
+            if (find_data.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) continue;
+
+            if (pass == 1) {
+                if (count == capacity) break;
+                data[count] = string_format(arena, "%s/%s", path0.data, find_data.cFileName);
+            }
+            count++;
+        } while (FindNextFileA(find, &find_data));
+
+        FindClose(find);
+    }
+
+    *files = array_make(data, count);
+    return true;
+}
+
+b32 os_file_map_read(String path, FileMap* map)
+{
+    String path0 = string_copy(temp_arena, path);
+
+    HANDLE file = CreateFileA(path0.data, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file == INVALID_HANDLE_VALUE) return false;
+
+    LARGE_INTEGER size;
+    if (!GetFileSizeEx(file, &size)) {
+        CloseHandle(file);
+        return false;
+    }
+
+    *map = {};
+    map->size = (u64)size.QuadPart;
+    map->handles[0] = (u64)file;
+
+    // Empty files can't be mapped
+    if (map->size == 0) {
+        CloseHandle(file);
+        return true;
+    }
+
+    HANDLE mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+    if (mapping == NULL) {
+        CloseHandle(file);
+        return false;
+    }
+
+    void* ptr = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+    if (ptr == NULL) {
+        CloseHandle(mapping);
+        CloseHandle(file);
+        return false;
+    }
+
+    map->data = (u8*)ptr;
+    map->handles[1] = (u64)mapping;
+    return true;
+}
+
+b32 os_file_map_write(String path, u64 size, FileMap* map)
+{
+    String path0 = string_copy(temp_arena, path);
+
+    HANDLE file = CreateFileA(path0.data, GENERIC_READ | GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file == INVALID_HANDLE_VALUE) return false;
+
+    *map = {};
+    map->size = size;
+    map->handles[0] = (u64)file;
+
+    // Empty files can't be mapped
+    if (size == 0) {
+        CloseHandle(file);
+        return true;
+    }
+
+    HANDLE mapping = CreateFileMappingA(file, NULL, PAGE_READWRITE, (DWORD)(size >> 32), (DWORD)size, NULL);
+    if (mapping == NULL) {
+        CloseHandle(file);
+        return false;
+    }
+
+    void* ptr = MapViewOfFile(mapping, FILE_MAP_WRITE, 0, 0, size);
+    if (ptr == NULL) {
+        CloseHandle(mapping);
+        CloseHandle(file);
+        return false;
+    }
+
+    map->data = (u8*)ptr;
+    map->handles[1] = (u64)mapping;
+    return true;
+}
+
+void os_file_unmap(FileMap map)
+{
+    if (map.data == NULL) return;
+
+    UnmapViewOfFile(map.data);
+    CloseHandle((HANDLE)map.handles[1]);
+    CloseHandle((HANDLE)map.handles[0]);
+}
+
 u64 os_get_time_counter()
 {
     LARGE_INTEGER now;
@@ -223,6 +430,17 @@ void os_thread_yield() {
     SwitchToThread();
 }
 
+b32 os_thread_pin(Thread thread, u32 logic_core)
+{
+    if (thread.value == 0) return false;
+
+    i32 core = windows_get_allowed_core(logic_core % MAX(windows_allowed_core_count, 1));
+    if (core < 0) return false;
+
+    DWORD_PTR mask = (DWORD_PTR)1 << core;
+    return SetThreadAffinityMask((HANDLE)thread.value, mask) != 0;
+}
+
 Semaphore os_semaphore_create(u32 initial_count, u32 max_count)
 {
     HANDLE s = CreateSemaphoreExA(NULL, initial_count, max_count, NULL, 0, SEMAPHORE_ALL_ACCESS);
@@ -266,3 +484,6 @@ u32 interlock_decrement_u32(volatile u32* n) {
 u32 interlock_exchange_u32(volatile u32* dst, u32 compare, u32 exchange) {
     return InterlockedCompareExchange(dst, exchange, compare);
 }
+u32 interlock_add_u32(volatile u32* n, u32 value) {
+    return (u32)InterlockedAdd((volatile LONG*)n, (LONG)value);
+}
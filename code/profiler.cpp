@@ -0,0 +1,178 @@
+#include "inc.h"
+
+// Every thread writes its begin/end events to its own ring buffer, no locks or I/O while timing.
+// The oldest events are overwritten when a buffer is full. The trace is written at shutdown, when
+// the other threads are done.
+
+// Events per thread, must be a power of two
+#define PROFILER_RING_SIZE (1 << 15)
+#define PROFILER_MAX_THREADS 256
+
+// A NULL name is the end of the last scope
+struct ProfilerEvent
+{
+	const char* name;
+	u64 counter;
+};
+
+struct ProfilerThread
+{
+	u64 write_index;
+	u32 id;
+	char name[32];
+	ProfilerEvent events[PROFILER_RING_SIZE];
+};
+
+struct ProfilerState
+{
+	volatile u32 lock;
+	ProfilerThread* threads[PROFILER_MAX_THREADS];
+	u32 thread_count;
+};
+
+static ProfilerState profiler;
+
+static thread_local ProfilerThread* profiler_thread;
+
+internal_fn void profiler_lock()
+{
+	while (interlock_exchange_u32(&profiler.lock, 0, 1) != 0) _mm_pause();
+}
+
+internal_fn void profiler_unlock()
+{
+	cpu_write_barrier();
+	profiler.lock = 0;
+}
+
+internal_fn ProfilerThread* profiler_get_thread()
+{
+	if (profiler_thread != NULL) return profiler_thread;
+
+	ProfilerThread* thread = (ProfilerThread*)memory_allocate(sizeof(ProfilerThread), true);
+
+	profiler_lock();
+
+	if (profiler.thread_count < PROFILER_MAX_THREADS) {
+		thread->id = profiler.thread_count;
+		profiler.threads[profiler.thread_count++] = thread;
+	}
+	else {
+		memory_free(thread);
+		thread = NULL;
+	}
+
+	profiler_unlock();
+
+	if (thread == NULL) return NULL;
+
+	string_copy_from_data(thread->name, sizeof(thread->name) - 1, "Thread");
+	profiler_thread = thread;
+	return thread;
+}
+
+internal_fn void profiler_push(const char* name)
+{
+	if (!app.sett.enable_profiler) return;
+
+	ProfilerThread* thread = profiler_get_thread();
+	if (thread == NULL) return;
+
+	ProfilerEvent* event = thread->events + (thread->write_index & (PROFILER_RING_SIZE - 1));
+	event->name = name;
+	event->counter = os_get_time_counter();
+	thread->write_index++;
+}
+
+void profiler_begin(const char* name) {
+	profiler_push(name);
+}
+
+void profiler_end() {
+	profiler_push(NULL);
+}
+
+void profiler_set_thread_name(String name)
+{
+	if (!app.sett.enable_profiler) return;
+
+	ProfilerThread* thread = profiler_get_thread();
+	if (thread == NULL) return;
+
+	memory_zero(thread->name, sizeof(thread->name));
+	string_copy_from_data(thread->name, sizeof(thread->name) - 1, name);
+}
+
+// Microseconds since the timer start, the unit of the trace
+internal_fn f64 profiler_get_time_us(u64 counter)
+{
+	return (f64)(counter - app.os.timer_start_counter) * 1000000.0 / (f64)app.os.timer_frequency;
+}
+
+b32 profiler_shutdown(String path)
+{
+	profiler_lock();
+	DEFER(profiler_unlock());
+
+	u64 event_count = 0;
+	for (u32 i = 0; i < profiler.thread_count; ++i) {
+		event_count += MIN(profiler.threads[i]->write_index, PROFILER_RING_SIZE);
+	}
+
+	// Typical size of each line, long names grow the buffer
+	TextBuilder text = text_builder_make(256 + (event_count + profiler.thread_count) * 96);
+	DEFER(text_builder_free(&text));
+
+	text_builder_append(&text, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+
+	b32 first = true;
+
+	for (u32 i = 0; i < profiler.thread_count; ++i)
+	{
+		ProfilerThread* thread = profiler.threads[i];
+
+		text_builder_append(&text, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%u,\"args\":{\"name\":\"%s\"}}", first ? "" : ",\n", thread->id, thread->name);
+		first = false;
+
+		u64 end = thread->write_index;
+		u64 begin = (end > PROFILER_RING_SIZE) ? end - PROFILER_RING_SIZE : 0;
+
+		// Ends of the scopes that began before the oldest event are dropped
+		u32 depth = 0;
+
+		for (u64 e = begin; e < end; ++e)
+		{
+			ProfilerEvent event = thread->events[e & (PROFILER_RING_SIZE - 1)];
+
+			if (event.name == NULL && depth == 0) continue;
+			depth = (event.name == NULL) ? depth - 1 : depth + 1;
+
+			f64 time = profiler_get_time_us(event.counter);
+
+			if (event.name != NULL) text_builder_append(&text, ",\n{\"name\":\"%s\",\"ph\":\"B\",\"pid\":1,\"tid\":%u,\"ts\":%.3f}", event.name, thread->id, time);
+			else text_builder_append(&text, ",\n{\"ph\":\"E\",\"pid\":1,\"tid\":%u,\"ts\":%.3f}", thread->id, time);
+		}
+
+		memory_free(thread);
+	}
+
+	text_builder_append(&text, "\n]}\n");
+
+	// Later events of this thread go to a new buffer
+	u32 thread_count = profiler.thread_count;
+	profiler.thread_count = 0;
+	profiler_thread = NULL;
+
+	if (text.failed) {
+		assert(0);
+		return false;
+	}
+
+	FileMap file;
+	if (!os_file_map_write(path, text.size, &file)) return false;
+	memory_copy(file.data, text.data, text.size);
+	os_file_unmap(file);
+
+	printf("Profiler: %llu events from %u threads saved to %s\n", (unsigned long long)event_count, thread_count, path.data);
+	return true;
+}
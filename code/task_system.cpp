@@ -1,51 +1,108 @@
 #include "inc.h"
 
-#define TASK_QUEUE_SIZE 6000
+// Tasks per worker deque, must be a power of two
+#define TASK_DEQUE_SIZE 2048
 
-struct TaskThreadData
-{
-	Thread thread;
-	u32 id;
-};
+// Failed steal rounds before an idle worker parks on the semaphore
+#define TASK_IDLE_SPIN_ROUNDS 64
+
+#define TASK_WORKER_NONE 0xFFFFFFFF
+
+// Chunks per worker targeted by the adaptive grain of the parallel loops
+#define TASK_PARALLEL_FOR_CHUNKS_PER_WORKER 4
 
 struct TaskData
 {
 	TaskContext* context;
 	TaskFn* fn;
+	b8 user_data[TASK_DATA_SIZE]; // Aligned to 8 bytes, it can hold pointers
 	u32 index;
-	b8 user_data[TASK_DATA_SIZE];
+	u64 dispatch_counter;
 };
 
-struct TaskSystemState
+// Only written by the owner, other threads can read them while the worker runs. Times are in
+// counter ticks.
+struct TaskWorkerCounters
 {
-	TaskData tasks[TASK_QUEUE_SIZE];
-	volatile u32 task_count;
-	volatile u32 task_completed;
-	volatile u32 task_next;
+	u64 executed_count;
+	u64 stolen_count;
+	u64 inline_count;
+	u64 busy_ticks;
+	u64 spin_ticks;
+	u64 parked_ticks;
+	u64 latency_histogram[TASK_LATENCY_BUCKET_COUNT];
+};
 
-	Semaphore semaphore;
+// Chase-Lev deque: the owner pushes and pops at the bottom, thieves steal from the top.
+// 'top' is the only contended field, it lives in its own cache line.
+struct TaskWorker
+{
+	volatile u32 top;
+	u8 _padding0[60];
+
+	volatile u32 bottom;
+	volatile u32 dispatched;
+	volatile u32 completed;
+	u32 random_state;
+	Thread thread;
+	u32 id;
+	u32 task_depth; // Tasks running on this worker, the nested ones run from a 'task_wait'
+	u32 wait_depth;
+	u8 _padding1[28];
+
+	TaskWorkerCounters counters;
+	u64 idle_counter; // Start of the current spin, 0 while busy or parked
+	u8 _padding2[8];
+
+	TaskData tasks[TASK_DEQUE_SIZE];
+};
+
+static_assert(sizeof(TaskWorker) % 64 == 0);
+
+struct TaskSystemState
+{
+	// Owns the state and the workers, freed on shutdown so the task system can be restarted
+	Arena* arena;
 
-	TaskThreadData* thread_data;
+	// The worker 0 is the thread that initialized the task system
+	TaskWorker* workers;
+	u32 worker_count;
 	u32 thread_count;
 	volatile u32 thread_initialized_count;
 
+	Semaphore semaphore;
+
 	b32 running;
 };
 
 TaskSystemState* task_system;
 
+static thread_local u32 task_worker_index = TASK_WORKER_NONE;
+
 internal_fn i32 task_thread(void* arg);
 
-b32 task_initialize()
+b32 task_initialize(u32 worker_count)
 {
-	task_system = (TaskSystemState*)arena_push(app.static_arena, sizeof(TaskSystemState));
+	Arena* arena = arena_alloc();
+	task_system = (TaskSystemState*)arena_push(arena, sizeof(TaskSystemState));
+	task_system->arena = arena;
 	task_system->running = true;
 
-	u32 thread_count = MAX(app.os.logic_core_count - 1, 1);
+	u32 thread_count = (worker_count > 0) ? worker_count - 1 : MAX(app.os.logic_core_count - 1, 1);
+	worker_count = thread_count + 1;
+
+	task_system->workers = (TaskWorker*)arena_push_align(task_system->arena, sizeof(TaskWorker) * worker_count, 64);
+	task_system->worker_count = worker_count;
 
-	task_system->thread_data = (TaskThreadData*)arena_push(app.static_arena, sizeof(TaskThreadData) * thread_count);
+	for (u32 i = 0; i < worker_count; ++i) {
+		TaskWorker* worker = task_system->workers + i;
+		worker->id = i;
+		worker->random_state = 0x9E3779B9u * (i + 1);
+	}
+
+	task_worker_index = 0;
 
-	task_system->semaphore = os_semaphore_create(0, thread_count);
+	task_system->semaphore = os_semaphore_create(0, MAX(thread_count, 1));
 
 	if (task_system->semaphore.value == 0) {
 		printf("Can't create task system semaphore\n");
@@ -54,17 +111,23 @@ b32 task_initialize()
 
 	for (u32 t = 0; t < thread_count; ++t)
 	{
-		TaskThreadData* thread_data = task_system->thread_data + t;
-		thread_data->id = t;
+		TaskWorker* worker = task_system->workers + t + 1;
+		u32 id = worker->id;
 
-		thread_data->thread = os_thread_start(task_thread, {});
+		worker->thread = os_thread_start(task_thread, { &id, sizeof(id) });
 
-		if (thread_data->thread.value == 0)
+		if (worker->thread.value == 0)
 		{
 			printf("Can't create task thread\n");
 			task_system->running = false;
 			return false;
 		}
+
+		// The main thread keeps the first core, workers are pinned to the rest. A worker that can't be
+		// pinned still runs, the scheduler places it.
+		if (!os_thread_pin(worker->thread, id % app.os.logic_core_count)) {
+			printf("Can't pin task thread %u to the logic core %u\n", id, id % app.os.logic_core_count);
+		}
 	}
 
 	task_system->thread_count = thread_count;
@@ -83,87 +146,246 @@ void task_shutdown()
 
 	task_system->running = false;
 
-	Thread* threads = (Thread*)arena_push(app.temp_arena, sizeof(Thread) * task_system->thread_count);
+	Thread* threads = (Thread*)arena_push(temp_arena, sizeof(Thread) * task_system->thread_count);
 	for (u32 i = 0; i < task_system->thread_count; ++i)
-		threads[i] = task_system->thread_data[i].thread;
+		threads[i] = task_system->workers[i + 1].thread;
 
 	os_semaphore_release(task_system->semaphore, task_system->thread_count);
 
 	os_thread_wait_array(threads, task_system->thread_count);
 
 	os_semaphore_destroy(task_system->semaphore);
+
+	Arena* arena = task_system->arena;
 	task_system = NULL;
+	arena_free(arena);
+}
+
+internal_fn TaskWorker* _task_get_worker()
+{
+	assert(task_worker_index != TASK_WORKER_NONE && "Tasks can only be used from the main thread or task threads");
+	return task_system->workers + task_worker_index;
+}
+
+internal_fn b32 _task_deque_push(TaskWorker* worker, TaskData* task)
+{
+	u32 bottom = worker->bottom;
+	u32 top = worker->top;
+
+	if (bottom - top >= TASK_DEQUE_SIZE) return false;
+
+	worker->tasks[bottom & (TASK_DEQUE_SIZE - 1)] = *task;
+
+	cpu_write_barrier();
+	worker->bottom = bottom + 1;
+	return true;
 }
 
-internal_fn b32 _task_thread_do_work()
+internal_fn b32 _task_deque_pop(TaskWorker* worker, TaskData* task)
 {
-	b32 done = false;
+	u32 bottom = worker->bottom - 1;
+	worker->bottom = bottom;
+
+	// The bottom store must be visible before reading the top, or a thief could take the same task
+	cpu_full_barrier();
+	u32 top = worker->top;
+
+	if ((i32)(bottom - top) < 0) {
+		worker->bottom = top;
+		return false;
+	}
+
+	*task = worker->tasks[bottom & (TASK_DEQUE_SIZE - 1)];
+	if (bottom != top) return true;
 
-	u32 task_next = task_system->task_next;
+	// Last task, race against the thieves
+	b32 taken = interlock_exchange_u32(&worker->top, top, top + 1) == top;
+	worker->bottom = top + 1;
+	return taken;
+}
+
+internal_fn b32 _task_deque_steal(TaskWorker* worker, TaskData* task)
+{
+	u32 top = worker->top;
+	cpu_read_barrier();
+	u32 bottom = worker->bottom;
 
-	if (task_next < task_system->task_count)
+	if ((i32)(bottom - top) <= 0) return false;
+
+	// The copy is discarded if the owner or another thief took the task in the meantime
+	*task = worker->tasks[top & (TASK_DEQUE_SIZE - 1)];
+	cpu_read_barrier();
+
+	return interlock_exchange_u32(&worker->top, top, top + 1) == top;
+}
+
+internal_fn b32 _task_steal(TaskWorker* worker, TaskData* task)
+{
+	u32 count = task_system->worker_count;
+
+	// xorshift32, each worker starts from a different victim to spread the contention
+	u32 r = worker->random_state;
+	r ^= r << 13;
+	r ^= r >> 17;
+	r ^= r << 5;
+	worker->random_state = r;
+
+	for (u32 i = 0; i < count; ++i)
 	{
-		u32 task_index = interlock_exchange_u32(&task_system->task_next, task_next, task_next + 1);
-		cpu_read_barrier();
+		TaskWorker* victim = task_system->workers + (r + i) % count;
+		if (victim == worker) continue;
+		if (_task_deque_steal(victim, task)) return true;
+	}
 
-		if (task_index == task_next)
-		{
-			TaskData task = task_system->tasks[task_index % TASK_QUEUE_SIZE];
+	return false;
+}
+
+internal_fn b32 _task_any_queued()
+{
+	for (u32 i = 0; i < task_system->worker_count; ++i) {
+		TaskWorker* worker = task_system->workers + i;
+		if ((i32)(worker->bottom - worker->top) > 0) return true;
+	}
+	return false;
+}
+
+internal_fn u32 _task_latency_get_bucket(u64 ticks)
+{
+	u64 us = ticks * 1000000 / app.os.timer_frequency;
+
+	u32 bucket = 0;
+	while (bucket < TASK_LATENCY_BUCKET_COUNT - 1 && (1ULL << bucket) <= us) bucket++;
+	return bucket;
+}
+
+internal_fn void _task_execute(TaskWorker* worker, TaskData* task)
+{
+	assert(task->fn != NULL);
+
+	// Also the tasks that a full deque runs in place on the dispatching thread
+	PROFILE_SCOPE("Task");
+
+	TaskWorkerCounters* counters = &worker->counters;
+	u64 start_counter = os_get_time_counter();
+
+	// Nested tasks are part of the busy time of the outer one
+	if (worker->task_depth == 0 && worker->idle_counter != 0) {
+		counters->spin_ticks += start_counter - worker->idle_counter;
+		worker->idle_counter = 0;
+	}
+
+	counters->executed_count++;
+	if (worker->wait_depth > 0) counters->inline_count++;
+	counters->latency_histogram[_task_latency_get_bucket(start_counter - task->dispatch_counter)]++;
+
+	// The temp memory of a task is released when it finishes, tasks can run nested inside a wait
+	u64 temp_size = temp_arena->size;
+
+	worker->task_depth++;
+	task->fn(task->index, task->user_data);
+	worker->task_depth--;
 
-			assert(task.fn != NULL);
-			task.fn(task.index, task.user_data);
+	if (temp_arena->size > temp_size) arena_pop_to(temp_arena, temp_size);
 
-			interlock_increment_u32(&task_system->task_completed);
-			if (task.context != NULL) interlock_increment_u32((volatile u32*)&task.context->completed);
-			done = true;
+	if (worker->task_depth == 0) counters->busy_ticks += os_get_time_counter() - start_counter;
+
+	worker->completed++;
+	if (task->context != NULL) interlock_increment_u32((volatile u32*)&task->context->completed);
+}
+
+internal_fn b32 _task_thread_do_work(TaskWorker* worker)
+{
+	TaskData task;
+
+	if (!_task_deque_pop(worker, &task))
+	{
+		if (!_task_steal(worker, &task)) {
+			if (worker->task_depth == 0 && worker->idle_counter == 0) worker->idle_counter = os_get_time_counter();
+			return false;
 		}
+		worker->counters.stolen_count++;
 	}
 
-	return done;
+	_task_execute(worker, &task);
+	return true;
 }
 
-internal_fn i32 task_thread(void* _)
+internal_fn i32 task_thread(void* arg)
 {
+	task_worker_index = *(u32*)arg;
+	TaskWorker* worker = _task_get_worker();
+
+	temp_arena = arena_alloc();
+	DEFER(arena_free(temp_arena));
+
+	profiler_set_thread_name(string_format(temp_arena, "Task Worker %u", worker->id));
+	arena_pop_to(temp_arena, 0);
+
 	interlock_increment_u32(&task_system->thread_initialized_count);
 
-	u32 failed_count = 0;
+	u32 idle_rounds = 0;
 
 	while (task_system->running)
 	{
-		if (!_task_thread_do_work()) {
-			if (task_running(NULL)) os_thread_yield();
-			else os_semaphore_wait(task_system->semaphore, 100);
+		if (_task_thread_do_work(worker)) {
+			idle_rounds = 0;
+			continue;
 		}
-	}
 
-	return 0;
-}
+		// Spin a little before parking, tasks usually come in bursts
+		if (++idle_rounds < TASK_IDLE_SPIN_ROUNDS) {
+			_mm_pause();
+			continue;
+		}
 
-internal_fn void _task_add_queue(TaskFn* fn, RawBuffer data, u32 index, TaskContext* ctx)
-{
-	TaskData* task = task_system->tasks + task_system->task_count % TASK_QUEUE_SIZE;
-	task->fn = fn;
-	task->context = ctx;
-	task->index = index;
-	memory_copy(task->user_data, data.data, MIN(data.size, TASK_DATA_SIZE));
+		idle_rounds = 0;
+		if (_task_any_queued()) continue;
 
-	cpu_write_barrier();
-	++task_system->task_count;
+		u64 park_counter = os_get_time_counter();
+		worker->counters.spin_ticks += park_counter - worker->idle_counter;
+		worker->idle_counter = 0;
+
+		os_semaphore_wait(task_system->semaphore, 100);
+		worker->counters.parked_ticks += os_get_time_counter() - park_counter;
+	}
+
+	return 0;
 }
 
 void task_dispatch(TaskFn* fn, RawBuffer data, u32 task_count, TaskContext* context)
 {
+	// Tasks can dispatch more work to their own context
 	if (context) {
-		context->dispatched += task_count;
+		interlock_add_u32((volatile u32*)&context->dispatched, task_count);
 	}
 
 	assert(data.size <= TASK_DATA_SIZE && "The task data size is too large");
 	assert(fn != NULL && "Null task function");
 
-	for (u32 i = 0; i < task_count; ++i) {
-		_task_add_queue(fn, data, i, context);
+	TaskWorker* worker = _task_get_worker();
+
+	TaskData task;
+	task.fn = fn;
+	task.context = context;
+	task.dispatch_counter = os_get_time_counter();
+	memory_copy(task.user_data, data.data, MIN(data.size, TASK_DATA_SIZE));
+
+	for (u32 i = 0; i < task_count; ++i)
+	{
+		task.index = i;
+		worker->dispatched++;
+
+		// A full deque runs the task in place
+		if (!_task_deque_push(worker, &task)) {
+			worker->wait_depth++;
+			_task_execute(worker, &task);
+			worker->wait_depth--;
+		}
 	}
 
+	// A single worker runs everything from the waits
+	if (task_system->thread_count == 0) return;
+
 	if (!os_semaphore_release(task_system->semaphore, MIN(task_count, task_system->thread_count)))
 	{
 		u32 release_count = 0;
@@ -178,11 +400,135 @@ void task_join()
 
 void task_wait(TaskContext* context)
 {
-	while (task_running(context))
-		_task_thread_do_work();
+	TaskWorker* worker = _task_get_worker();
+
+	worker->wait_depth++;
+
+	while (task_running(context)) {
+		if (!_task_thread_do_work(worker)) _mm_pause();
+	}
+
+	worker->wait_depth--;
+
+	// The caller is not idle after the wait
+	if (worker->task_depth == 0 && worker->idle_counter != 0) {
+		worker->counters.spin_ticks += os_get_time_counter() - worker->idle_counter;
+		worker->idle_counter = 0;
+	}
 }
 
-b32 task_running(TaskContext* context) {
-	if (context) return context->completed < context->dispatched;
-	return task_system->task_completed < task_system->task_count;
-}
\ No newline at end of file
+b32 task_running(TaskContext* context)
+{
+	// Completed is read first, a task is always dispatched before it completes. Tasks can dispatch
+	// into their own context, reading dispatched first could miss the new ones.
+	if (context) {
+		i32 completed = context->completed;
+		cpu_read_barrier();
+		return completed < context->dispatched;
+	}
+
+	u32 completed = 0;
+	for (u32 i = 0; i < task_system->worker_count; ++i) completed += task_system->workers[i].completed;
+
+	cpu_read_barrier();
+
+	u32 dispatched = 0;
+	for (u32 i = 0; i < task_system->worker_count; ++i) dispatched += task_system->workers[i].dispatched;
+
+	return completed < dispatched;
+}
+
+Array<TaskWorkerStats> task_get_stats(Arena* arena)
+{
+	u32 count = task_system->worker_count;
+	Array<TaskWorkerStats> stats = array_make((TaskWorkerStats*)arena_push(arena, sizeof(TaskWorkerStats) * count), count);
+
+	f64 frequency = (f64)app.os.timer_frequency;
+
+	for (u32 i = 0; i < count; ++i)
+	{
+		TaskWorkerCounters counters = task_system->workers[i].counters;
+		TaskWorkerStats* s = &stats.data[i];
+
+		s->executed_count = counters.executed_count;
+		s->stolen_count = counters.stolen_count;
+		s->inline_count = counters.inline_count;
+		s->busy_time = counters.busy_ticks / frequency;
+		s->spin_time = counters.spin_ticks / frequency;
+		s->parked_time = counters.parked_ticks / frequency;
+		memory_copy(s->latency_histogram, counters.latency_histogram, sizeof(s->latency_histogram));
+	}
+
+	return stats;
+}
+
+struct ParallelFor_Task
+{
+	TaskRangeFn* fn;
+	void* user_data;
+	TaskContext* context;
+	u32 begin;
+	u32 end;
+	u32 grain;
+	u32 alignment;
+};
+
+internal_fn void parallel_for_task(u32 index, void* _data)
+{
+	ParallelFor_Task range = *(ParallelFor_Task*)_data;
+
+	// Push the upper half and keep going with the lower one, the owner pops the small halves back
+	// while thieves take the big ones from the top of the deque
+	while (range.end - range.begin > range.grain)
+	{
+		u32 mid = range.begin + (range.end - range.begin) / 2;
+		mid = u32_divide_high(mid, range.alignment) * range.alignment;
+		if (mid <= range.begin || mid >= range.end) break;
+
+		ParallelFor_Task upper = range;
+		upper.begin = mid;
+		task_dispatch(parallel_for_task, { &upper, sizeof(upper) }, 1, range.context);
+
+		range.end = mid;
+	}
+
+	range.fn(range.begin, range.end, range.user_data);
+}
+
+void task_parallel_for(u32 begin, u32 end, u32 grain, u32 alignment, TaskRangeFn* fn, RawBuffer data)
+{
+	if (end <= begin) return;
+
+	assert(data.size <= TASK_DATA_SIZE && "The task data size is too large");
+
+	alignment = MAX(alignment, 1);
+
+	u32 range = end - begin;
+	u32 adaptive_grain = range / (task_system->worker_count * TASK_PARALLEL_FOR_CHUNKS_PER_WORKER);
+	grain = MAX(MAX(grain, adaptive_grain), 1);
+	grain = u32_divide_high(grain, alignment) * alignment;
+
+	// The tasks point to the user data and context of this frame, it waits for all of them
+	u64 user_data[TASK_DATA_SIZE / sizeof(u64)];
+	memory_copy(user_data, data.data, MIN(data.size, TASK_DATA_SIZE));
+
+	if (range <= grain) {
+		fn(begin, end, user_data);
+		return;
+	}
+
+	TaskContext ctx = {};
+
+	ParallelFor_Task root = {};
+	root.fn = fn;
+	root.user_data = user_data;
+	root.context = &ctx;
+	root.begin = begin;
+	root.end = end;
+	root.grain = grain;
+	root.alignment = alignment;
+
+	// The caller takes the first chunk
+	parallel_for_task(0, &root);
+	task_wait(&ctx);
+}
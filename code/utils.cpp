@@ -30,38 +30,100 @@ String string_copy(Arena* arena, String src)
 
 String string_format(Arena* arena, String text, ...)
 {
-	String text0 = string_copy(app.temp_arena, text);
+	String text0 = string_copy(temp_arena, text);
 
 	va_list args;
 	va_start(args, text);
+
+	// The argument list is consumed by each call on some ABIs (SysV x64)
+	va_list args_copy;
+	va_copy(args_copy, args);
+
 	u32 length = vsnprintf(NULL, 0, text0.data, args) + 1;
 	char* buffer = (char*)arena_push(arena, length);
-	vsnprintf(buffer, length, text0.data, args);
+	vsnprintf(buffer, length, text0.data, args_copy);
+
+	va_end(args_copy);
 	va_end(args);
 
 	return buffer;
 }
 
+TextBuilder text_builder_make(u64 capacity)
+{
+	TextBuilder builder = {};
+	builder.capacity = MAX(capacity, 1);
+	builder.data = (char*)memory_allocate(builder.capacity);
+	builder.failed = builder.data == NULL;
+	if (builder.failed) builder.capacity = 0;
+	else builder.data[0] = '\0';
+	return builder;
+}
+
+void text_builder_free(TextBuilder* builder)
+{
+	memory_free(builder->data);
+	*builder = {};
+}
+
+void text_builder_append(TextBuilder* builder, const char* format, ...)
+{
+	if (builder->failed) return;
+
+	va_list args;
+	va_start(args, format);
+
+	va_list args_copy;
+	va_copy(args_copy, args);
+
+	// The size is always under the capacity, there is room for the terminator
+	i32 length = vsnprintf(builder->data + builder->size, builder->capacity - builder->size, format, args);
+
+	if (length < 0) {
+		builder->failed = true;
+	}
+	else if (builder->size + length >= builder->capacity)
+	{
+		u64 capacity = MAX(builder->capacity * 2, builder->size + length + 1);
+		char* data = (char*)memory_reallocate(builder->data, capacity);
+
+		if (data == NULL) {
+			builder->failed = true;
+		}
+		else {
+			builder->data = data;
+			builder->capacity = capacity;
+			vsnprintf(builder->data + builder->size, capacity - builder->size, format, args_copy);
+		}
+	}
+
+	if (builder->failed) builder->data[builder->size] = '\0';
+	else builder->size += length;
+
+	va_end(args_copy);
+	va_end(args);
+}
+
 String string_format_time(f64 seconds)
 {
     if (seconds >= 10.0) {
-        return string_format(app.temp_arena, "%.2f sec", seconds);
+        return string_format(temp_arena, "%.2f sec", seconds);
     }
 
     f64 millis = seconds * 1000.0;
 
     if (millis >= 10.0) {
-        return string_format(app.temp_arena, "%.2f ms", millis);
+        return string_format(temp_arena, "%.2f ms", millis);
     }
 
     f64 micro = millis * 1000.0;
 
     if (micro >= 10.0) {
-        return string_format(app.temp_arena, "%.2f us", micro);
+        return string_format(temp_arena, "%.2f us", micro);
     }
 
     f64 nano = micro * 1000.0;
-    return string_format(app.temp_arena, "%.2f ns", nano);
+    return string_format(temp_arena, "%.2f ns", nano);
 }
 
 f64 timer_now()
@@ -0,0 +1,832 @@
+#include "inc.h"
+
+// Validation of the image operations. The references are plain loops over the pixels, written from
+// the definition of each operation without the row kernels, the tasks or the aprons. Every SIMD
+// level runs with several worker counts and task grains over random images, with sizes that don't
+// fit the vector widths or the task chunks, and the results must be the same as the references.
+
+// Mismatches printed per run, the rest are only counted
+#define VALIDATE_MAX_REPORTS 32
+
+#define VALIDATE_RANDOM_SIZE_COUNT 12
+#define VALIDATE_RANDOM_SIZE_MAX 600
+
+// Single pixels, rows and columns, sizes around the kernel radius and the vector widths, and
+// images taller than a band of the fused pipeline
+static const u32 validate_sizes[][2] = {
+	{ 1, 1 }, { 1, 97 }, { 97, 1 }, { 2, 2 }, { 3, 3 }, { 4, 4 }, { 5, 5 }, { 2, 40 }, { 40, 2 },
+	{ 3, 40 }, { 40, 3 }, { 6, 5 }, { 15, 17 }, { 31, 33 }, { 63, 65 }, { 64, 64 }, { 65, 64 },
+	{ 129, 7 }, { 1031, 67 }, { 67, 1031 },
+};
+
+enum ValidateOp {
+	ValidateOp_GrayRGBA8,
+	ValidateOp_GrayRGB8,
+	ValidateOp_Apron,
+	ValidateOp_Mult,
+	ValidateOp_Blend,
+	ValidateOp_BlendThreshold,
+	ValidateOp_Threshold,
+	ValidateOp_Blur3,
+	ValidateOp_Blur5,
+	ValidateOp_Kernel3x3,
+	ValidateOp_Kernel5x5,
+	ValidateOp_Separable,
+	ValidateOp_GaussianSigma,
+	ValidateOp_BoxBlur,
+	ValidateOp_Sobel,
+	ValidateOp_SobelThreshold,
+	ValidateOp_EdgeDetection,
+	ValidateOp_EdgeDetectionFused,
+	ValidateOp_Count,
+};
+
+static const char* validate_op_names[ValidateOp_Count] = {
+	"gray_rgba8",
+	"gray_rgb8",
+	"apron",
+	"mult",
+	"blend",
+	"blend_threshold",
+	"threshold",
+	"blur3",
+	"blur5",
+	"kernel3x3",
+	"kernel5x5_2pass",
+	"separable_kernel",
+	"gaussian_sigma",
+	"box_blur",
+	"sobel",
+	"sobel_threshold",
+	"edge_detection",
+	"edge_detection_fused",
+};
+
+// Parameters of the operations, random for each size
+struct ValidateParams {
+	f32 mult;
+	f32 blend_factor;
+	f32 threshold;
+	SobelMagnitude magnitude;
+	BlurDistance blur_distance;
+	u32 blur_iterations;
+	f32 blur_sigma;
+	f32 box_sigma;
+	u32 apron;
+	ImageBorder border;
+	i32 kernel3x3[9];
+	u32 kernel3x3_normalize;
+	b32 kernel3x3_include_border;
+	i32 kernel5[5];
+	u32 kernel5_normalize;
+	SeparableKernel separable;
+};
+
+struct ValidateInputs {
+	Image rgba;
+	Image rgb;
+	Image gray0;
+	Image gray1;
+};
+
+// The configuration under test, printed with the mismatches
+struct ValidateState {
+	u32 seed;
+	SimdLevel level;
+	u32 worker_count;
+	b32 small_grain;
+	b32 apron;
+	u32 check_count;
+	u32 failure_count;
+};
+
+static ValidateState validate;
+
+internal_fn u32 validate_random()
+{
+	validate.seed = validate.seed * 1664525u + 1013904223u;
+	return validate.seed >> 8;
+}
+
+internal_fn f32 validate_random_f32(f32 min, f32 max) {
+	return min + (max - min) * (f32)(validate_random() & 0xFFFF) / 65535.f;
+}
+
+//- References
+
+// Same rounding as the row kernels, to nearest even
+inline_fn i32 reference_round(f32 v) {
+	return _mm_cvtss_si32(_mm_set_ss(v));
+}
+
+inline_fn u8 reference_clamp_u8(i32 v) {
+	return (u8)MIN(MAX(v, 0), 255);
+}
+
+inline_fn u8 reference_threshold_get_u8(f32 threshold) {
+	return (u8)(f32_clamp01(threshold) * 255.f);
+}
+
+// The pixels outside of the image are taken from the border, as the apron does
+internal_fn i32 reference_border_index(i32 i, i32 count, ImageBorder border)
+{
+	if (border == ImageBorder_Mirror) {
+		if (i < 0) i = -i;
+		if (i >= count) i = (count - 1) * 2 - i;
+	}
+	return MAX(MIN(i, count - 1), 0);
+}
+
+internal_fn u8 reference_get(Image image, i32 x, i32 y, ImageBorder border)
+{
+	x = reference_border_index(x, (i32)image.width, border);
+	y = reference_border_index(y, (i32)image.height, border);
+	return image_get_row(image, y)[x];
+}
+
+internal_fn Image reference_alloc(u32 width, u32 height)
+{
+	Image dst = image_alloc(width, height, ImageFormat_I8);
+	memory_zero(dst._data, image_calculate_size(dst));
+	return dst;
+}
+
+internal_fn Image reference_copy(Image src)
+{
+	Image dst = reference_alloc(src.width, src.height);
+	for (u32 y = 0; y < src.height; ++y) memory_copy(image_get_row(dst, y), image_get_row(src, y), src.width);
+	return dst;
+}
+
+// Luma in 1.15 fixed point premultiplied by a * 257 / 2^24, or the float formula
+internal_fn Image reference_gray(Image src, b32 fixed)
+{
+	Image dst = reference_alloc(src.width, src.height);
+	u32 pixel_stride = image_format_get_pixel_stride(src.format);
+
+	for (u32 y = 0; y < src.height; ++y)
+	{
+		for (u32 x = 0; x < src.width; ++x)
+		{
+			const u8* p = image_get_row(src, y) + x * pixel_stride;
+			u32 a = (pixel_stride == 4) ? p[3] : 255;
+			u8 v;
+
+			if (fixed) {
+				u32 luma = 9798 * p[0] + 19235 * p[1] + 3735 * p[2] + 128;
+				v = (u8)(((luma >> 7) * (a * 257)) >> 24);
+			}
+			else {
+				f32 luma = 0.299f * p[0] + 0.587f * p[1] + 0.114f * p[2];
+				v = reference_clamp_u8(reference_round(luma * (f32)a / 255.f));
+			}
+
+			image_get_row(dst, y)[x] = v;
+		}
+	}
+
+	return dst;
+}
+
+// Pixel in 8.7 by the factor in 8.8 rounded to 1.15, factors out of the fixed range use the float formula
+internal_fn Image reference_mult(Image src, f32 mult, b32 fixed)
+{
+	Image dst = reference_alloc(src.width, src.height);
+	b32 use_fixed = fixed && mult > -127.f && mult < 127.f;
+	i32 mult_fixed = reference_round(mult * 256.f);
+
+	for (u32 y = 0; y < src.height; ++y)
+	{
+		for (u32 x = 0; x < src.width; ++x)
+		{
+			i32 s = image_get_row(src, y)[x];
+			i32 v;
+
+			if (use_fixed) v = ((s << 7) * mult_fixed + 0x4000) >> 15;
+			else v = reference_round(f32_clamp(0.f, 255.f, (f32)s * mult));
+
+			image_get_row(dst, y)[x] = reference_clamp_u8(v);
+		}
+	}
+
+	return dst;
+}
+
+// s0 + (s1 - s0) * f with the factor in 0.15, factors out of [0, 1] use the float formula
+internal_fn Image reference_blend(Image src0, Image src1, f32 factor, u32 threshold, b32 fixed)
+{
+	Image dst = reference_alloc(src0.width, src0.height);
+	b32 use_fixed = fixed && factor >= 0.f && factor <= 1.f;
+	i32 factor_fixed = MIN(reference_round(factor * 32768.f), 32767);
+
+	for (u32 y = 0; y < src0.height; ++y)
+	{
+		for (u32 x = 0; x < src0.width; ++x)
+		{
+			i32 s0 = image_get_row(src0, y)[x];
+			i32 s1 = image_get_row(src1, y)[x];
+			i32 v;
+
+			if (use_fixed) v = s0 + (((s1 - s0) * factor_fixed + 0x4000) >> 15);
+			else v = reference_round((f32)s0 * (1.f - factor) + (f32)s1 * factor);
+
+			u8 res = reference_clamp_u8(v);
+			if (threshold != ROW_THRESHOLD_NONE) res = (res > threshold) * 255;
+			image_get_row(dst, y)[x] = res;
+		}
+	}
+
+	return dst;
+}
+
+internal_fn Image reference_threshold(Image src, f32 threshold)
+{
+	Image dst = reference_alloc(src.width, src.height);
+	u8 threshold_u8 = reference_threshold_get_u8(threshold);
+
+	for (u32 y = 0; y < src.height; ++y) {
+		for (u32 x = 0; x < src.width; ++x) {
+			image_get_row(dst, y)[x] = (image_get_row(src, y)[x] > threshold_u8) * 255;
+		}
+	}
+
+	return dst;
+}
+
+// Writes |sum / normalize_factor| clamped to 255 over the rectangle, 'coefficients' has
+// (radius_x * 2 + 1) * (radius_y * 2 + 1) values in rows
+internal_fn void reference_convolve(Image dst, Image src, const i32* coefficients, i32 radius_x, i32 radius_y, u32 normalize_factor,
+	u32 x_begin, u32 x_end, u32 y_begin, u32 y_end, ImageBorder border)
+{
+	for (u32 y = y_begin; y < y_end; ++y)
+	{
+		for (u32 x = x_begin; x < x_end; ++x)
+		{
+			const i32* k = coefficients;
+			i32 sum = 0;
+
+			for (i32 j = -radius_y; j <= radius_y; ++j) {
+				for (i32 i = -radius_x; i <= radius_x; ++i) sum += (i32)reference_get(src, (i32)x + i, (i32)y + j, border) * *k++;
+			}
+
+			sum /= (i32)normalize_factor;
+			image_get_row(dst, y)[x] = (u8)MIN(ABS(sum), 255);
+		}
+	}
+}
+
+// Without the apron the pixels whose neighbourhood goes out of the image keep the source value
+internal_fn Image reference_kernel3x3(Image src, const i32* coefficients, u32 normalize_factor, b32 include_border, b32 apron, ImageBorder border)
+{
+	Image dst = (apron || include_border) ? reference_copy(src) : reference_alloc(src.width, src.height);
+
+	if (apron) reference_convolve(dst, src, coefficients, 1, 1, normalize_factor, 0, src.width, 0, src.height, border);
+	else if (src.width >= 3 && src.height >= 3) reference_convolve(dst, src, coefficients, 1, 1, normalize_factor, 1, src.width - 1, 1, src.height - 1, border);
+
+	return dst;
+}
+
+// Horizontal and vertical passes, the intermediate is stored in u8 as the separable kernel does
+internal_fn Image reference_separable(Image src, SeparableKernel kernel, b32 apron, ImageBorder border)
+{
+	Image inter = reference_copy(src);
+	Image dst = reference_copy(src);
+	DEFER(image_free(inter));
+
+	u32 width = src.width;
+	u32 height = src.height;
+	u32 taps = kernel.tap_count;
+	i32 radius = (i32)taps / 2;
+
+	if (apron) {
+		reference_convolve(inter, src, kernel.coefficients, radius, 0, kernel.normalize_factor, 0, width, 0, height, border);
+		reference_convolve(dst, inter, kernel.coefficients, 0, radius, kernel.normalize_factor, 0, width, 0, height, border);
+	}
+	else if (width >= taps) {
+		reference_convolve(inter, src, kernel.coefficients, radius, 0, kernel.normalize_factor, radius, width - radius, 0, height, border);
+		if (height >= taps) reference_convolve(dst, inter, kernel.coefficients, 0, radius, kernel.normalize_factor, radius, width - radius, radius, height - radius, border);
+	}
+
+	return dst;
+}
+
+// Each box is the average of the whole window, the pixels out of the image are replicated
+internal_fn void reference_box(Image dst, Image src, u32 radius, b32 vertical)
+{
+	f32 scale = 1.f / (f32)(radius * 2 + 1);
+	i32 r = (i32)radius;
+
+	for (u32 y = 0; y < src.height; ++y)
+	{
+		for (u32 x = 0; x < src.width; ++x)
+		{
+			i32 sum = 0;
+			for (i32 i = -r; i <= r; ++i) {
+				sum += vertical ? reference_get(src, x, (i32)y + i, ImageBorder_Replicate) : reference_get(src, (i32)x + i, y, ImageBorder_Replicate);
+			}
+			image_get_row(dst, y)[x] = reference_clamp_u8(reference_round((f32)sum * scale));
+		}
+	}
+}
+
+// The boxes of every row first, then the ones of every column
+internal_fn Image reference_box_blur(Image src, f32 sigma)
+{
+	u32 radii[BOX_BLUR_PASSES];
+	box_blur_get_radii(sigma, radii);
+
+	Image images[2] = { reference_copy(src), reference_alloc(src.width, src.height) };
+	u32 current = 0;
+
+	for (u32 pass = 0; pass < BOX_BLUR_PASSES * 2; ++pass) {
+		reference_box(images[current ^ 1], images[current], radii[pass % BOX_BLUR_PASSES], pass >= BOX_BLUR_PASSES);
+		current ^= 1;
+	}
+
+	image_free(images[current ^ 1]);
+	return images[current];
+}
+
+internal_fn Image reference_gaussian_sigma(Image src, f32 sigma, u32 apron_size, ImageBorder border)
+{
+	if (gaussian_blur_uses_box(sigma)) return reference_box_blur(src, sigma);
+
+	SeparableKernel gaussian = separable_kernel_gaussian(sigma);
+	return reference_separable(src, gaussian, apron_size >= gaussian.tap_count / 2, border);
+}
+
+internal_fn Image reference_blur(Image src, BlurDistance distance, b32 apron, ImageBorder border)
+{
+	static const i32 gaussian3x3[9] = { 1, 2, 1, 2, 4, 2, 1, 2, 1 };
+	static const SeparableKernel gaussian5 = { 5, 16, { 1, 4, 6, 4, 1 } };
+
+	if (distance == BlurDistance_3) return reference_kernel3x3(src, gaussian3x3, 16, true, apron, border);
+	return reference_separable(src, gaussian5, apron, border);
+}
+
+// L1 is (|Gx| + |Gy|) / sqrt(2) in 16.16, L2 is max + min * 3 / 8. Without the apron the borders are zero.
+internal_fn Image reference_sobel(Image src, SobelMagnitude magnitude, u32 threshold, b32 apron, ImageBorder border)
+{
+	Image dst = reference_alloc(src.width, src.height);
+
+	u32 margin = apron ? 0 : 1;
+	if (!apron && (src.width < 3 || src.height < 3)) return dst;
+
+	for (u32 y = margin; y < src.height - margin; ++y)
+	{
+		for (u32 x = margin; x < src.width - margin; ++x)
+		{
+			i32 p[3][3];
+			for (i32 j = 0; j < 3; ++j) {
+				for (i32 i = 0; i < 3; ++i) p[j][i] = reference_get(src, (i32)x + i - 1, (i32)y + j - 1, border);
+			}
+
+			i32 gx = (p[0][2] + 2 * p[1][2] + p[2][2]) - (p[0][0] + 2 * p[1][0] + p[2][0]);
+			i32 gy = (p[2][0] + 2 * p[2][1] + p[2][2]) - (p[0][0] + 2 * p[0][1] + p[0][2]);
+			i32 ax = ABS(gx);
+			i32 ay = ABS(gy);
+
+			i32 v;
+			if (magnitude == SobelMagnitude_L1) v = ((ax + ay) * 46341) >> 16;
+			else v = MAX(ax, ay) + ((MIN(ax, ay) * 3) >> 3);
+
+			u8 res = (u8)MIN(v, 255);
+			if (threshold != ROW_THRESHOLD_NONE) res = (res > threshold) * 255;
+			image_get_row(dst, y)[x] = res;
+		}
+	}
+
+	return dst;
+}
+
+internal_fn Image reference_edge_detection(Image src, ValidateParams params, b32 apron)
+{
+	Image image = reference_gray(src, true);
+	u32 blur_iterations = (params.blur_sigma > 0.f) ? 1 : params.blur_iterations;
+
+	for (u32 it = 0; it < blur_iterations; ++it) {
+		Image blur;
+		if (params.blur_sigma > 0.f) blur = reference_gaussian_sigma(image, params.blur_sigma, apron ? SEPARABLE_KERNEL_MAX_TAPS : 0, ImageBorder_Replicate);
+		else blur = reference_blur(image, params.blur_distance, apron, ImageBorder_Replicate);
+		image_free(image);
+		image = blur;
+	}
+
+	Image dst = reference_sobel(image, params.magnitude, reference_threshold_get_u8(params.threshold), apron, ImageBorder_Replicate);
+	image_free(image);
+	return dst;
+}
+
+//- Operations
+
+// Ops that read the neighbourhood also run over sources with an apron
+internal_fn b32 validate_op_has_apron(ValidateOp op)
+{
+	switch (op)
+	{
+	case ValidateOp_Apron:
+	case ValidateOp_Blur3:
+	case ValidateOp_Blur5:
+	case ValidateOp_Kernel3x3:
+	case ValidateOp_Kernel5x5:
+	case ValidateOp_Separable:
+	case ValidateOp_GaussianSigma:
+	case ValidateOp_BoxBlur:
+	case ValidateOp_Sobel:
+	case ValidateOp_SobelThreshold:
+	case ValidateOp_EdgeDetection:
+		return true;
+	default:
+		return false;
+	}
+}
+
+// Fixed point ops are also compared with the float formula, within +-1
+internal_fn b32 validate_op_has_approx(ValidateOp op) {
+	return op == ValidateOp_GrayRGBA8 || op == ValidateOp_GrayRGB8 || op == ValidateOp_Mult || op == ValidateOp_Blend;
+}
+
+internal_fn Image validate_kernel_image(const i32* coefficients, u32 width, u32 height)
+{
+	Image kernel = image_alloc(width, height, ImageFormat_I8);
+	Array<i8> k = image_get_data<i8>(kernel);
+
+	for (u32 y = 0; y < height; ++y) {
+		for (u32 x = 0; x < width; ++x) k[IMG_INDEX(kernel, x, y)] = (i8)coefficients[x + y * width];
+	}
+
+	return kernel;
+}
+
+internal_fn SeparableKernel validate_kernel5_get_separable(ValidateParams params)
+{
+	SeparableKernel k = {};
+	k.tap_count = 5;
+	k.normalize_factor = params.kernel5_normalize;
+	for (u32 i = 0; i < 5; ++i) k.coefficients[i] = params.kernel5[i];
+	return k;
+}
+
+// The apron around the image as an image of its own
+internal_fn Image validate_apron_expand(Image src, u32 apron)
+{
+	Image dst = image_alloc(src.width + apron * 2, src.height + apron * 2, ImageFormat_I8);
+
+	for (u32 y = 0; y < dst.height; ++y) {
+		memory_copy(image_get_row(dst, y), image_get_row(src, (i32)y - (i32)apron) - apron, dst.width);
+	}
+
+	return dst;
+}
+
+internal_fn Image reference_apron_expand(Image src, u32 apron, ImageBorder border)
+{
+	Image dst = reference_alloc(src.width + apron * 2, src.height + apron * 2);
+
+	for (u32 y = 0; y < dst.height; ++y) {
+		for (u32 x = 0; x < dst.width; ++x) image_get_row(dst, y)[x] = reference_get(src, (i32)x - (i32)apron, (i32)y - (i32)apron, border);
+	}
+
+	return dst;
+}
+
+// The kernels only use an apron as large as their radius, 'apron' tells if the source has one
+internal_fn Image validate_reference(ValidateOp op, ValidateInputs inputs, ValidateParams params, b32 apron, b32 fixed)
+{
+	ImageBorder border = params.border;
+	u32 apron_size = apron ? params.apron : 0;
+
+	switch (op)
+	{
+	case ValidateOp_GrayRGBA8: return reference_gray(inputs.rgba, fixed);
+	case ValidateOp_GrayRGB8: return reference_gray(inputs.rgb, fixed);
+	case ValidateOp_Apron: return reference_apron_expand(inputs.gray0, params.apron, border);
+	case ValidateOp_Mult: return reference_mult(inputs.gray0, params.mult, fixed);
+	case ValidateOp_Blend: return reference_blend(inputs.gray0, inputs.gray1, params.blend_factor, ROW_THRESHOLD_NONE, fixed);
+	case ValidateOp_BlendThreshold: return reference_blend(inputs.gray0, inputs.gray1, params.blend_factor, reference_threshold_get_u8(params.threshold), fixed);
+	case ValidateOp_Threshold: return reference_threshold(inputs.gray0, params.threshold);
+	case ValidateOp_Blur3: return reference_blur(inputs.gray0, BlurDistance_3, apron_size >= 1, border);
+	case ValidateOp_Blur5: return reference_blur(inputs.gray0, BlurDistance_5, apron_size >= 2, border);
+	case ValidateOp_Kernel3x3: return reference_kernel3x3(inputs.gray0, params.kernel3x3, params.kernel3x3_normalize, params.kernel3x3_include_border, apron_size >= 1, border);
+	case ValidateOp_Kernel5x5: return reference_separable(inputs.gray0, validate_kernel5_get_separable(params), apron_size >= 2, border);
+	case ValidateOp_Separable: return reference_separable(inputs.gray0, params.separable, apron_size >= params.separable.tap_count / 2, border);
+	case ValidateOp_GaussianSigma: return reference_gaussian_sigma(inputs.gray0, params.blur_sigma, apron_size, border);
+	case ValidateOp_BoxBlur: return reference_box_blur(inputs.gray0, params.box_sigma);
+	case ValidateOp_Sobel: return reference_sobel(inputs.gray0, params.magnitude, ROW_THRESHOLD_NONE, apron_size >= 1, border);
+	case ValidateOp_SobelThreshold: return reference_sobel(inputs.gray0, params.magnitude, reference_threshold_get_u8(params.threshold), apron_size >= 1, border);
+	case ValidateOp_EdgeDetection:
+	case ValidateOp_EdgeDetectionFused: return reference_edge_detection(inputs.rgba, params, apron);
+	default: assert(0); return IMG_INVALID;
+	}
+}
+
+internal_fn Image validate_run_op(ValidateOp op, ValidateInputs inputs, ValidateParams params, b32 apron)
+{
+	Image gray0 = inputs.gray0;
+	if (apron) gray0 = image_copy_with_apron(inputs.gray0, ImageFormat_I8, params.apron, params.border);
+	DEFER(if (apron) image_free(gray0));
+
+	switch (op)
+	{
+	case ValidateOp_GrayRGBA8: return image_copy(inputs.rgba, ImageFormat_I8);
+	case ValidateOp_GrayRGB8: return image_copy(inputs.rgb, ImageFormat_I8);
+
+	case ValidateOp_Apron:
+	{
+		image_update_apron(gray0);
+		return validate_apron_expand(gray0, params.apron);
+	}
+
+	case ValidateOp_Mult:
+	{
+		Image dst = image_copy(inputs.gray0, ImageFormat_I8);
+		image_mult(dst, params.mult);
+		return dst;
+	}
+
+	case ValidateOp_Blend: return image_blend(inputs.gray0, inputs.gray1, params.blend_factor);
+	case ValidateOp_BlendThreshold: return image_blend_threshold(inputs.gray0, inputs.gray1, params.blend_factor, params.threshold);
+	case ValidateOp_Threshold: return image_apply_threshold(inputs.gray0, params.threshold);
+	case ValidateOp_Blur3: return image_apply_gaussian_blur(gray0, BlurDistance_3);
+	case ValidateOp_Blur5: return image_apply_gaussian_blur(gray0, BlurDistance_5);
+
+	case ValidateOp_Kernel3x3:
+	{
+		Image kernel = validate_kernel_image(params.kernel3x3, 3, 3);
+		DEFER(image_free(kernel));
+		return image_apply_1pass_kernel3x3(gray0, kernel, params.kernel3x3_normalize, params.kernel3x3_include_border);
+	}
+
+	case ValidateOp_Kernel5x5:
+	{
+		Image kernel = validate_kernel_image(params.kernel5, 5, 1);
+		DEFER(image_free(kernel));
+		return image_apply_2pass_kernel5x5(gray0, kernel, params.kernel5_normalize);
+	}
+
+	case ValidateOp_Separable: return image_apply_separable_kernel(gray0, params.separable);
+	case ValidateOp_GaussianSigma: return image_apply_gaussian_blur_sigma(gray0, params.blur_sigma);
+	case ValidateOp_BoxBlur: return image_apply_box_blur(gray0, params.box_sigma);
+
+	case ValidateOp_Sobel: return image_apply_sobel_convolution(gray0, params.magnitude);
+	case ValidateOp_SobelThreshold: return image_apply_sobel_threshold(gray0, params.magnitude, params.threshold);
+
+	case ValidateOp_EdgeDetection:
+	case ValidateOp_EdgeDetectionFused:
+	{
+		app.sett.fused_pipeline = op == ValidateOp_EdgeDetectionFused;
+		app.sett.border_apron = apron;
+		app.sett.blur_distance = params.blur_distance;
+		app.sett.blur_iterations = params.blur_iterations;
+		app.sett.blur_sigma = params.blur_sigma;
+		app.sett.sobel_magnitude = params.magnitude;
+		app.sett.threshold = params.threshold;
+		return edge_detection(inputs.rgba);
+	}
+
+	default: assert(0); return IMG_INVALID;
+	}
+}
+
+// Only the pixels inside the image are compared, the aprons are not part of the result
+internal_fn void validate_compare(ValidateOp op, const char* kind, Image result, Image reference, u32 tolerance)
+{
+	validate.check_count++;
+
+	b32 same_size = result.width == reference.width && result.height == reference.height && result.format == reference.format;
+	u32 bad_x = 0;
+	u32 bad_y = 0;
+	b32 failed = !same_size;
+
+	for (u32 y = 0; y < reference.height && !failed; ++y)
+	{
+		const u8* a = image_get_row(result, y);
+		const u8* b = image_get_row(reference, y);
+
+		for (u32 x = 0; x < reference.width; ++x) {
+			if ((u32)ABS((i32)a[x] - (i32)b[x]) > tolerance) {
+				bad_x = x;
+				bad_y = y;
+				failed = true;
+				break;
+			}
+		}
+	}
+
+	if (!failed) return;
+
+	if (validate.failure_count++ >= VALIDATE_MAX_REPORTS) return;
+
+	printf("Mismatch %s (%s) %ux%u, %s, %u workers, %s grain%s: ", validate_op_names[op], kind, reference.width, reference.height,
+		simd_level_get_name(validate.level), validate.worker_count, validate.small_grain ? "small" : "default", validate.apron ? ", apron" : "");
+
+	if (!same_size) printf("result is %ux%u\n", result.width, result.height);
+	else printf("pixel %u,%u is %u, expected %u\n", bad_x, bad_y, image_get_row(result, bad_y)[bad_x], image_get_row(reference, bad_y)[bad_x]);
+}
+
+//- Inputs
+
+internal_fn ValidateInputs validate_inputs_make(u32 width, u32 height)
+{
+	ValidateInputs inputs;
+	inputs.rgba = image_alloc(width, height, ImageFormat_RGBA8);
+	inputs.rgb = image_alloc(width, height, ImageFormat_RGB8);
+	inputs.gray0 = image_alloc(width, height, ImageFormat_I8);
+	inputs.gray1 = image_alloc(width, height, ImageFormat_I8);
+
+	// Half of the pixels are opaque, the premultiply has a shortcut for them
+	for (u32 y = 0; y < height; ++y)
+	{
+		u8* rgba = image_get_row(inputs.rgba, y);
+		u8* rgb = image_get_row(inputs.rgb, y);
+		u8* gray0 = image_get_row(inputs.gray0, y);
+		u8* gray1 = image_get_row(inputs.gray1, y);
+
+		for (u32 x = 0; x < width; ++x)
+		{
+			u32 v = validate_random();
+			rgba[x * 4 + 0] = (u8)v;
+			rgba[x * 4 + 1] = (u8)(v >> 8);
+			rgba[x * 4 + 2] = (u8)(v >> 16);
+			rgba[x * 4 + 3] = (validate_random() & 1) ? 255 : (u8)validate_random();
+
+			v = validate_random();
+			rgb[x * 3 + 0] = (u8)v;
+			rgb[x * 3 + 1] = (u8)(v >> 8);
+			rgb[x * 3 + 2] = (u8)(v >> 16);
+
+			gray0[x] = (u8)validate_random();
+			gray1[x] = (u8)validate_random();
+		}
+	}
+
+	return inputs;
+}
+
+internal_fn void validate_inputs_free(ValidateInputs inputs)
+{
+	image_free(inputs.rgba);
+	image_free(inputs.rgb);
+	image_free(inputs.gray0);
+	image_free(inputs.gray1);
+}
+
+// Factors out of the fixed point range and the edges of it are picked more often than the rest
+internal_fn ValidateParams validate_params_make()
+{
+	static const f32 mults[] = { 0.f, 1.f, -1.f, 0.5f, 126.9f, 127.f, -200.f };
+	static const f32 blend_factors[] = { 0.f, 0.5f, 1.f, -0.25f, 1.5f, 0.99999f };
+
+	ValidateParams params = {};
+
+	u32 r = validate_random() % 4;
+	params.mult = (r == 0) ? mults[validate_random() % ARRAY_COUNT(mults)] : validate_random_f32(-2.f, 4.f);
+
+	r = validate_random() % 4;
+	params.blend_factor = (r == 0) ? blend_factors[validate_random() % ARRAY_COUNT(blend_factors)] : validate_random_f32(0.f, 1.f);
+
+	params.threshold = validate_random_f32(0.f, 1.f);
+	params.magnitude = (validate_random() & 1) ? SobelMagnitude_L1 : SobelMagnitude_L2Approx;
+	params.blur_distance = (validate_random() & 1) ? BlurDistance_3 : BlurDistance_5;
+	params.blur_iterations = validate_random() % 3;
+	params.blur_sigma = (validate_random() & 1) ? validate_random_f32(0.3f, 12.f) : 0.f;
+	params.box_sigma = validate_random_f32(0.3f, 40.f); // Radii over the small sizes
+	params.border = (validate_random() & 1) ? ImageBorder_Replicate : ImageBorder_Mirror;
+
+	// Aprons under and over the radius of the kernels
+	static const u32 aprons[] = { 1, 2, 5, SEPARABLE_KERNEL_MAX_TAPS / 2 };
+	params.apron = aprons[validate_random() % ARRAY_COUNT(aprons)];
+
+	// Signed kernels, some of them don't fit in 16 bits and some normalize factors aren't powers of two
+	for (u32 i = 0; i < 9; ++i) params.kernel3x3[i] = (i32)(validate_random() % 33) - 16;
+	params.kernel3x3_normalize = (validate_random() & 1) ? (1u << (validate_random() % 7)) : (validate_random() % 40 + 1);
+	params.kernel3x3_include_border = validate_random() & 1;
+
+	for (u32 i = 0; i < 5; ++i) params.kernel5[i] = (i32)(validate_random() % 129) - 64;
+	params.kernel5_normalize = (validate_random() & 1) ? (1u << (validate_random() % 9)) : (validate_random() % 300 + 1);
+
+	// Any odd number of taps, with small, full i16 and out of i16 coefficients
+	SeparableKernel* k = &params.separable;
+	k->tap_count = (validate_random() % (SEPARABLE_KERNEL_MAX_TAPS / 2 + 1)) * 2 + 1;
+	k->normalize_factor = (validate_random() % 4 != 0) ? (1u << (validate_random() % 17)) : (validate_random() % 5000 + 1);
+
+	u32 range = validate_random() % 3;
+	for (u32 i = 0; i < k->tap_count; ++i) {
+		if (range == 0) k->coefficients[i] = (i32)(validate_random() % 129) - 64;
+		else if (range == 1) k->coefficients[i] = (i32)(validate_random() % 65536) - 32768;
+		else k->coefficients[i] = (i32)(validate_random() % 131072) - 65536;
+	}
+
+	return params;
+}
+
+//- Run
+
+internal_fn void validate_size(u32 width, u32 height)
+{
+	ValidateInputs inputs = validate_inputs_make(width, height);
+	ValidateParams params = validate_params_make();
+
+	// References of each op, with and without apron, and the float versions of the fixed point ops
+	Image references[ValidateOp_Count][2] = {};
+	Image approx[ValidateOp_Count] = {};
+
+	for (u32 op = 0; op < ValidateOp_Count; ++op)
+	{
+		for (u32 apron = 0; apron < 2; ++apron) {
+			if (apron && !validate_op_has_apron((ValidateOp)op)) continue;
+			if (!apron && op == ValidateOp_Apron) continue;
+			references[op][apron] = validate_reference((ValidateOp)op, inputs, params, apron, true);
+		}
+
+		if (validate_op_has_approx((ValidateOp)op)) approx[op] = validate_reference((ValidateOp)op, inputs, params, false, false);
+	}
+
+	u32 default_min_pixels_per_task = app.os.min_pixels_per_task;
+	u32 default_l2_cache_size = app.os.l2_cache_size;
+
+	for (u32 level = 0; level <= app.os.simd_level; ++level)
+	{
+		row_kernels_initialize((SimdLevel)level);
+		validate.level = (SimdLevel)level;
+
+		// The small grain splits the images in a task per row, and the fused pipeline in bands of 16 rows
+		for (u32 grain = 0; grain < 2; ++grain)
+		{
+			validate.small_grain = grain;
+			app.os.min_pixels_per_task = grain ? 1 : default_min_pixels_per_task;
+			app.os.l2_cache_size = grain ? KB(16) : default_l2_cache_size;
+
+			for (u32 op = 0; op < ValidateOp_Count; ++op)
+			{
+				for (u32 apron = 0; apron < 2; ++apron)
+				{
+					Image reference = references[op][apron];
+					if (image_is_invalid(reference)) continue;
+
+					validate.apron = apron;
+
+					Image result = validate_run_op((ValidateOp)op, inputs, params, apron);
+					validate_compare((ValidateOp)op, "reference", result, reference, 0);
+					if (!apron && !image_is_invalid(approx[op])) validate_compare((ValidateOp)op, "float", result, approx[op], 1);
+					image_free(result);
+				}
+			}
+		}
+	}
+
+	app.os.min_pixels_per_task = default_min_pixels_per_task;
+	app.os.l2_cache_size = default_l2_cache_size;
+	row_kernels_initialize((SimdLevel)app.os.simd_level);
+
+	for (u32 op = 0; op < ValidateOp_Count; ++op) {
+		image_free(references[op][0]);
+		image_free(references[op][1]);
+		image_free(approx[op]);
+	}
+
+	validate_inputs_free(inputs);
+}
+
+b32 validate_run(u32 seed)
+{
+	validate = {};
+	validate.seed = seed;
+
+	// A single worker runs every task inline, more workers than cores also interleave on one core
+	u32 worker_counts[2] = { 1, MAX(app.os.logic_core_count, 4) };
+
+	// Restarting the task system must not grow the static arena
+	u64 static_size = app.static_arena->size;
+
+	for (u32 w = 0; w < ARRAY_COUNT(worker_counts); ++w)
+	{
+		if (!task_initialize(worker_counts[w])) return false;
+		validate.worker_count = worker_counts[w];
+
+		for (u32 i = 0; i < ARRAY_COUNT(validate_sizes); ++i) validate_size(validate_sizes[i][0], validate_sizes[i][1]);
+
+		for (u32 i = 0; i < VALIDATE_RANDOM_SIZE_COUNT; ++i) {
+			u32 width = validate_random() % VALIDATE_RANDOM_SIZE_MAX + 1;
+			u32 height = validate_random() % VALIDATE_RANDOM_SIZE_MAX + 1;
+			validate_size(width, height);
+		}
+
+		task_shutdown();
+
+		validate.check_count++;
+		if (app.static_arena->size != static_size) {
+			validate.failure_count++;
+			printf("Static arena grew by %llu bytes across a task system restart, %u workers\n", (unsigned long long)(app.static_arena->size - static_size), worker_counts[w]);
+			static_size = app.static_arena->size;
+		}
+	}
+
+	if (validate.failure_count > 0) {
+		printf("Validation failed: %u of %u checks mismatched (seed %u)\n", validate.failure_count, validate.check_count, seed);
+		return false;
+	}
+
+	printf("Validation passed: %u checks\n", validate.check_count);
+	return true;
+}